@@ -0,0 +1,833 @@
+#include "int.h"
+#include "irq.h"
+#include "mem.h"
+#include "string.h"
+#include "paging.h"
+#include "vmalloc.h"
+#include "thread.h"
+#include "blkdev.h"
+#include "ahci.h"
+
+/*
+ * AHCI SATA host bus adapter driver. Each port with a disk attached
+ * is a block device ("sda", "sdb", ...). A port has 32 command slots;
+ * with native command queuing (NCQ) a dispatcher thread keeps up to
+ * the drive's queue depth of commands outstanding, so the drive can
+ * reorder them, and completions are reaped from the HBA's interrupt.
+ * Without NCQ, commands go one at a time. The port stops on an error;
+ * the interrupt handler leaves it to the dispatcher thread to find
+ * the failed command and restart the port.
+ */
+
+/* HBA registers (memory mapped, from BAR5) */
+struct ahci_port_regs {
+    uint32_t clb;       /* command list base */
+    uint32_t clbu;
+    uint32_t fb;        /* received FIS base */
+    uint32_t fbu;
+    uint32_t is;        /* interrupt status */
+    uint32_t ie;        /* interrupt enable */
+    uint32_t cmd;       /* command and status */
+    uint32_t reserved0;
+    uint32_t tfd;       /* task file data */
+    uint32_t sig;       /* signature */
+    uint32_t ssts;      /* SATA status */
+    uint32_t sctl;      /* SATA control */
+    uint32_t serr;      /* SATA error */
+    uint32_t sact;      /* SATA active (queued commands) */
+    uint32_t ci;        /* command issue */
+    uint32_t sntf;
+    uint32_t fbs;
+    uint32_t reserved1[11];
+    uint32_t vendor[4];
+};
+
+struct ahci_hba_regs {
+    uint32_t cap;       /* capabilities */
+    uint32_t ghc;       /* global host control */
+    uint32_t is;        /* interrupt status (one bit per port) */
+    uint32_t pi;        /* ports implemented */
+    uint32_t vs;        /* version */
+    uint32_t reserved[59];
+    struct ahci_port_regs ports[32];
+};
+
+enum {
+    HBA_CAP_NCS_SHIFT = 8,      /* number of command slots - 1 */
+    HBA_CAP_NCS_MASK = 0x1F,
+    HBA_CAP_SNCQ = 1 << 30,     /* supports NCQ */
+    HBA_GHC_IE = 1 << 1,        /* interrupt enable */
+};
+#define HBA_GHC_AE 0x80000000   /* AHCI enable */
+
+enum {
+    PORT_CMD_ST = 1 << 0,       /* start processing the command list */
+    PORT_CMD_FRE = 1 << 4,      /* FIS receive enable */
+    PORT_CMD_FR = 1 << 14,      /* FIS receive running */
+    PORT_CMD_CR = 1 << 15,      /* command list running */
+
+    PORT_IS_DHRS = 1 << 0,      /* device to host register FIS */
+    PORT_IS_PSS = 1 << 1,       /* PIO setup FIS */
+    PORT_IS_DSS = 1 << 2,       /* DMA setup FIS */
+    PORT_IS_SDBS = 1 << 3,      /* set device bits FIS (NCQ completion) */
+    PORT_IS_IFS = 1 << 27,      /* interface fatal error */
+    PORT_IS_HBDS = 1 << 28,     /* host bus data error */
+    PORT_IS_HBFS = 1 << 29,     /* host bus fatal error */
+    PORT_IS_TFES = 1 << 30,     /* task file error */
+    PORT_IS_ERROR = PORT_IS_IFS | PORT_IS_HBDS | PORT_IS_HBFS | PORT_IS_TFES,
+    PORT_IE_DEFAULT = PORT_IS_DHRS | PORT_IS_PSS | PORT_IS_DSS |
+        PORT_IS_SDBS | PORT_IS_ERROR,
+
+    PORT_TFD_ERR = 0x01,
+    PORT_TFD_DRQ = 0x08,
+    PORT_TFD_BSY = 0x80,
+
+    PORT_SSTS_DET_MASK = 0xF,
+    PORT_SSTS_DET_PRESENT = 3,  /* device present, phy communication */
+    PORT_SCTL_DET_MASK = 0xF,
+    PORT_SCTL_DET_INIT = 1,     /* COMRESET */
+    SATA_SIG_ATA = 0x00000101
+};
+
+/* in memory: the command list, command tables and received FISes */
+struct ahci_cmd_header {
+    uint16_t flags;     /* FIS length in dwords, CMD_WRITE */
+    uint16_t prdtl;     /* PRD table entries */
+    uint32_t prdbc;     /* bytes transferred */
+    uint32_t ctba;      /* command table (128 byte aligned) */
+    uint32_t ctbau;
+    uint32_t reserved[4];
+};
+
+enum { CMD_WRITE = 1 << 6 };
+
+struct ahci_prd {
+    uint32_t dba;       /* data (word aligned) */
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;       /* byte count - 1 (at most 4MB) */
+};
+
+enum { AHCI_PRDT_ENTRIES = 56 };    /* makes a table 1KB */
+
+struct ahci_cmd_table {
+    uint8_t cfis[64];   /* command FIS */
+    uint8_t acmd[16];   /* ATAPI command */
+    uint8_t reserved[48];
+    struct ahci_prd prdt[AHCI_PRDT_ENTRIES];
+};
+
+enum { TABLES_PER_PAGE = PAGE_SIZE / sizeof(struct ahci_cmd_table) };
+
+/* host to device register FIS */
+struct fis_h2d {
+    uint8_t type;
+    uint8_t flags;      /* FIS_COMMAND */
+    uint8_t command;
+    uint8_t featurel;
+    uint8_t lba0, lba1, lba2, device;
+    uint8_t lba3, lba4, lba5, featureh;
+    uint8_t countl, counth, icc, control;
+    uint8_t reserved[4];
+};
+
+enum {
+    FIS_TYPE_REG_H2D = 0x27,
+    FIS_COMMAND = 0x80,
+    FIS_DEVICE_LBA = 0x40
+};
+
+enum {
+    ATA_CMD_READ_DMA_EXT = 0x25,
+    ATA_CMD_WRITE_DMA_EXT = 0x35,
+    ATA_CMD_READ_FPDMA_QUEUED = 0x60,
+    ATA_CMD_WRITE_FPDMA_QUEUED = 0x61,
+    ATA_CMD_READ_LOG_EXT = 0x2F,
+    ATA_CMD_FLUSH_EXT = 0xEA,
+    ATA_CMD_IDENTIFY = 0xEC
+};
+
+/* the NCQ command error log (page 10h): which command failed */
+enum {
+    NCQ_LOG_PAGE = 0x10,
+    NCQ_LOG_TAG_MASK = 0x1F,
+    NCQ_LOG_NQ = 0x80           /* a non-queued command failed */
+};
+
+/* IDENTIFY DEVICE words */
+enum {
+    ID_LBA28_SECTORS = 60,
+    ID_QUEUE_DEPTH = 75,        /* bits 4:0, depth - 1 */
+    ID_SATA_CAP = 76,           /* bit 8: NCQ */
+    ID_CMDSET2 = 83,            /* bit 10: LBA48 */
+    ID_LBA48_SECTORS = 100
+};
+
+enum {
+    AHCI_SECTOR_SIZE = 512,
+    AHCI_MAX_SECTORS = 256,     /* per command (fits the PRD table) */
+    AHCI_MAX_SLOTS = 32,
+    AHCI_POLL_LIMIT = 1000000,
+    AHCI_RESET_MS = 1,          /* COMRESET held for at least 1ms */
+    AHCI_LINK_WAIT_MS = 1000    /* for the link and drive after it */
+};
+
+/*
+ * A request in a command slot. One too big for a single command
+ * is issued a command at a time, each in the same slot.
+ */
+struct ahci_slot {
+    block_request_t* request;
+    struct block_iter iter;     /* memory not in a command yet */
+    uint32_t lba;               /* where the next command starts */
+    unsigned int left;          /* sectors not in a command yet */
+};
+
+struct ahci_port {
+    volatile struct ahci_port_regs* regs;
+    struct ahci_cmd_header* cmd_list;   /* 32 headers, then received FISes */
+    struct ahci_cmd_table* tables[AHCI_MAX_SLOTS];
+    struct ahci_slot slots[AHCI_MAX_SLOTS];
+    uint32_t busy;              /* slots taken by a request */
+    uint32_t active;            /* slots issued to the HBA, not completed */
+    bool exclusive;             /* a non-queued command is active */
+    unsigned int depth;         /* slots used (1 without NCQ) */
+    bool ncq;
+    uint32_t sectors;           /* capacity (up to 2TB) */
+    uint32_t failed;            /* PxIS of an error not recovered from */
+    uint16_t* scratch;          /* a page for polled commands' data */
+    block_device_t* dev;
+    thread_queue_t slot_wait;   /* dispatcher, waiting for a slot */
+};
+
+static volatile struct ahci_hba_regs* g_hba;
+static struct ahci_port* g_ports[32];
+
+static uint32_t phys_addr(void* virt)
+{
+    return kernel_virt_to_phys((uintptr_t)virt);
+}
+
+/*
+ * Stop a port's command processing and FIS reception.
+ * @returns 0, or -1 if the port won't stop
+ */
+static int port_stop(volatile struct ahci_port_regs* regs)
+{
+    unsigned int i;
+    regs->cmd &= ~PORT_CMD_ST;
+    for (i = 0; i < AHCI_POLL_LIMIT && (regs->cmd & PORT_CMD_CR); i++) ;
+
+    regs->cmd &= ~PORT_CMD_FRE;
+    for (i = 0; i < AHCI_POLL_LIMIT; i++) {
+        if (!(regs->cmd & (PORT_CMD_CR | PORT_CMD_FR))) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void port_start(volatile struct ahci_port_regs* regs)
+{
+    unsigned int i;
+    for (i = 0; i < AHCI_POLL_LIMIT && (regs->cmd & PORT_CMD_CR); i++) ;
+
+    regs->cmd |= PORT_CMD_FRE;
+    regs->cmd |= PORT_CMD_ST;
+}
+
+/*
+ * Reset the link and the drive (COMRESET) of a stopped port, and
+ * wait for the drive to be ready again. May sleep.
+ * @returns 0, or -1 if it doesn't come back
+ */
+static int port_reset(volatile struct ahci_port_regs* regs)
+{
+    regs->sctl = (regs->sctl & ~PORT_SCTL_DET_MASK) | PORT_SCTL_DET_INIT;
+    sleep(AHCI_RESET_MS);
+    regs->sctl &= ~PORT_SCTL_DET_MASK;
+
+    unsigned int ms;
+    for (ms = 0; ms < AHCI_LINK_WAIT_MS; ms++) {
+        if ((regs->ssts & PORT_SSTS_DET_MASK) == PORT_SSTS_DET_PRESENT &&
+                !(regs->tfd & (PORT_TFD_BSY | PORT_TFD_DRQ))) {
+            regs->serr = regs->serr;
+            return 0;
+        }
+        sleep(1);
+    }
+    return -1;
+}
+
+static void prd_set(struct ahci_prd* prd, uint32_t phys, size_t bytes)
+{
+    prd->dba = phys;
+    prd->dbau = 0;
+    prd->reserved = 0;
+    prd->dbc = bytes - 1;
+}
+
+/*
+ * Fill in a slot's PRD table with as much of the memory left in `it`
+ * as one command can take, one entry per physically contiguous
+ * piece, and store its size in sectors in `count`.
+ * @returns number of entries, 0 if it can't be used for DMA
+ */
+static unsigned int build_prdt(struct ahci_cmd_table* table,
+        struct block_iter* it, unsigned int* count)
+{
+    size_t total = 0, max = AHCI_MAX_SECTORS * AHCI_SECTOR_SIZE;
+    unsigned int n = 0;
+    void* addr;
+    size_t bytes;
+    while ((bytes = block_iter_next_page(it, &addr, max - total)) > 0) {
+        uint32_t phys = kernel_virt_to_phys((uintptr_t)addr);
+        if (!phys || (phys & 1)) {
+            return 0;       /* must be word aligned */
+        }
+        struct ahci_prd* last = n > 0 ? &table->prdt[n - 1] : NULL;
+        if (last && last->dba + last->dbc + 1 == phys) {
+            last->dbc += bytes;
+        } else if (n == AHCI_PRDT_ENTRIES) {
+            block_iter_unget(it, bytes);
+            break;
+        } else {
+            prd_set(&table->prdt[n++], phys, bytes);
+        }
+        total += bytes;
+    }
+
+    /* end on a sector; the rest goes in the next command */
+    size_t extra = total % AHCI_SECTOR_SIZE;
+    block_iter_unget(it, extra);
+    total -= extra;
+    while (extra > 0) {
+        struct ahci_prd* last = &table->prdt[n - 1];
+        if (last->dbc + 1 <= extra) {
+            extra -= last->dbc + 1;
+            n--;
+        } else {
+            last->dbc -= extra;
+            extra = 0;
+        }
+    }
+    *count = total / AHCI_SECTOR_SIZE;
+    return n;
+}
+
+/*
+ * Set up command slot `slot` to run `command` on `count`
+ * sectors from `lba`, with `prds` entries in its PRD table.
+ */
+static void prepare_command(struct ahci_port* port, unsigned int slot,
+        uint8_t command, uint32_t lba, unsigned int count, unsigned int prds,
+        bool write)
+{
+    struct ahci_cmd_table* table = port->tables[slot];
+    struct ahci_cmd_header* header = &port->cmd_list[slot];
+
+    struct fis_h2d* fis = (struct fis_h2d*)table->cfis;
+    memset(fis, 0, sizeof(*fis));
+    fis->type = FIS_TYPE_REG_H2D;
+    fis->flags = FIS_COMMAND;
+    fis->command = command;
+    if (command != ATA_CMD_IDENTIFY) {
+        fis->device = FIS_DEVICE_LBA;
+    }
+    fis->lba0 = lba & 0xFF;
+    fis->lba1 = (lba >> 8) & 0xFF;
+    fis->lba2 = (lba >> 16) & 0xFF;
+    fis->lba3 = (lba >> 24) & 0xFF;
+
+    if (command == ATA_CMD_READ_FPDMA_QUEUED ||
+            command == ATA_CMD_WRITE_FPDMA_QUEUED) {
+        /* queued: the count goes in the features, the tag in the count */
+        fis->featurel = count & 0xFF;
+        fis->featureh = (count >> 8) & 0xFF;
+        fis->countl = slot << 3;
+    } else {
+        fis->countl = count & 0xFF;
+        fis->counth = (count >> 8) & 0xFF;
+    }
+
+    header->flags = (sizeof(*fis) / sizeof(uint32_t)) | (write ? CMD_WRITE : 0);
+    header->prdtl = prds;
+    header->prdbc = 0;
+}
+
+/*
+ * Run a command that reads a sector into port->scratch in `slot`
+ * and poll for it, while the port's interrupts are disabled.
+ * @returns 0 on success, -1 on failure
+ */
+static int polled_command(struct ahci_port* port, unsigned int slot,
+        uint8_t command, uint32_t lba, unsigned int count)
+{
+    prd_set(&port->tables[slot]->prdt[0], phys_addr(port->scratch),
+            AHCI_SECTOR_SIZE);
+    prepare_command(port, slot, command, lba, count, 1, false);
+
+    uint32_t bit = 1u << slot;
+    port->regs->ci = bit;
+    unsigned int i;
+    for (i = 0; i < AHCI_POLL_LIMIT; i++) {
+        if (port->regs->is & PORT_IS_TFES) {
+            return -1;
+        }
+        if (!(port->regs->ci & bit)) {
+            return (port->regs->tfd & PORT_TFD_ERR) ? -1 : 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Hand the command prepared in `slot` to the HBA.
+ */
+static void activate(struct ahci_port* port, unsigned int slot)
+{
+    /* no completion is looked for until the slot is marked active */
+    uint32_t bit = 1u << slot;
+    bool iflag = beg_int_atomic();
+    port->cmd_list[slot].prdbc = 0;
+    port->active |= bit;
+    if (port->ncq && port->slots[slot].request->type != BLOCK_REQUEST_FLUSH) {
+        port->regs->sact = bit;
+    }
+    port->regs->ci = bit;
+    end_int_atomic(iflag);
+}
+
+/*
+ * Issue the next command of the request in a (reserved) slot.
+ * @returns 0, or -1 if it can't be issued
+ */
+static int issue(struct ahci_port* port, unsigned int slot)
+{
+    struct ahci_slot* s = &port->slots[slot];
+    block_request_t* request = s->request;
+    uint8_t command;
+    bool write = request->type == BLOCK_REQUEST_WRITE;
+    if (request->type == BLOCK_REQUEST_FLUSH) {
+        command = ATA_CMD_FLUSH_EXT;
+    } else if (port->ncq) {
+        command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+    } else {
+        command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+    }
+
+    unsigned int prds = 0, count = 0;
+    if (request->type != BLOCK_REQUEST_FLUSH) {
+        prds = build_prdt(port->tables[slot], &s->iter, &count);
+        if (!prds || !count || count > s->left) {
+            return -1;
+        }
+    }
+
+    prepare_command(port, slot, command, s->lba, count, prds, write);
+    s->lba += count;
+    s->left -= count;
+    activate(port, slot);
+    return 0;
+}
+
+/*
+ * Start a request in a (reserved) command slot.
+ * @returns 0, or -1 if it can't be issued
+ */
+static int start_request(struct ahci_port* port, unsigned int slot,
+        block_request_t* request)
+{
+    if (request->type != BLOCK_REQUEST_FLUSH &&
+            (request->block_number >= port->sectors ||
+             request->block_count > port->sectors - request->block_number)) {
+        return -1;
+    }
+
+    struct ahci_slot* s = &port->slots[slot];
+    block_iter_init(&s->iter, request);
+    s->lba = request->block_number;
+    s->left = request->block_count;
+    return issue(port, slot);
+}
+
+/*
+ * The commands in `slots` are done, with result `rc`: issue the
+ * next command of each request that has more, finish the others.
+ * Called with interrupts disabled.
+ */
+static void finish_slots(struct ahci_port* port, uint32_t slots, int rc)
+{
+    while (slots) {
+        unsigned int slot = __builtin_ctz(slots);
+        slots &= ~(1u << slot);
+
+        struct ahci_slot* s = &port->slots[slot];
+        int result = rc;
+        port->active &= ~(1u << slot);
+        if (rc == 0 && s->left) {
+            if (issue(port, slot) == 0) {
+                continue;
+            }
+            result = -1;
+        }
+
+        block_request_t* request = s->request;
+        s->request = NULL;
+        port->busy &= ~(1u << slot);
+        notify_requester(request, BLOCK_REQUEST_COMPLETE, result);
+    }
+    if (!port->busy) {
+        port->exclusive = false;
+    }
+    wake_all(&port->slot_wait);
+}
+
+/*
+ * Bring a port back after an error. With NCQ, the drive's error log
+ * says which command failed; the others were only aborted, and are
+ * issued again. Otherwise, or if the drive doesn't recover without
+ * a reset, all outstanding commands fail. May sleep.
+ */
+static void recover(struct ahci_port* port)
+{
+    volatile struct ahci_port_regs* regs = port->regs;
+    DEBUGF("AHCI port error: IS %08X, TFD %08X, SERR %08X\n",
+            port->failed, regs->tfd, regs->serr);
+
+    /* those done before the error are fine */
+    uint32_t done = port->active & ~(regs->ci | regs->sact);
+    uint32_t aborted = port->active & ~done;
+    uint32_t failed = aborted;
+
+    bool reset = (port->failed & (PORT_IS_ERROR & ~PORT_IS_TFES)) ||
+        port_stop(regs) < 0 || (regs->tfd & (PORT_TFD_BSY | PORT_TFD_DRQ));
+    if (!reset) {
+        regs->serr = regs->serr;
+        regs->is = regs->is;
+        port_start(regs);
+        if (port->ncq && aborted) {
+            /* reading the log also ends the drive's error state */
+            uint8_t* log = (uint8_t*)port->scratch;
+            if (polled_command(port, port->depth, ATA_CMD_READ_LOG_EXT,
+                        NCQ_LOG_PAGE, 1) < 0) {
+                reset = true;
+            } else if (!(log[0] & NCQ_LOG_NQ)) {
+                failed &= 1u << (log[0] & NCQ_LOG_TAG_MASK);
+                if (!failed) {
+                    failed = aborted;
+                }
+            }
+        }
+    }
+    if (reset) {
+        port_stop(regs);
+        if (port_reset(regs) < 0) {
+            DEBUG("AHCI port doesn't come back after a reset\n");
+        }
+        regs->serr = regs->serr;
+        regs->is = regs->is;
+        port_start(regs);
+        failed = aborted;
+    }
+
+    bool iflag = beg_int_atomic();
+    uint32_t retry = aborted & ~failed;
+    while (retry) {
+        unsigned int slot = __builtin_ctz(retry);
+        retry &= ~(1u << slot);
+        activate(port, slot);
+    }
+    port->failed = 0;
+    regs->is = regs->is;
+    regs->ie = PORT_IE_DEFAULT;
+    finish_slots(port, done, 0);
+    finish_slots(port, failed, -1);
+    end_int_atomic(iflag);
+}
+
+/*
+ * Serves the requests queued on a port: takes each one the I/O
+ * scheduler picks, and issues it as soon as a slot is free.
+ * Flushes can't be queued alongside other commands, so they wait
+ * for the queue to drain, and nothing is issued until they're done.
+ * Also recovers the port from errors.
+ */
+static void handle_ahci_requests(uint32_t arg)
+{
+    struct ahci_port* port = (struct ahci_port*)arg;
+    uint32_t all = (port->depth == 32) ? 0xFFFFFFFF : (1u << port->depth) - 1;
+    block_request_t* request = NULL;
+
+    while (true) {
+        bool iflag = beg_int_atomic();
+        while (!port->failed && !request &&
+                !(request = block_device_try_pop_request(port->dev))) {
+            wait(port->dev->wait_queue);
+        }
+        bool exclusive = request &&
+            (!port->ncq || request->type == BLOCK_REQUEST_FLUSH);
+        while (!port->failed && (port->exclusive || port->busy == all ||
+                    (exclusive && port->busy))) {
+            wait(&port->slot_wait);
+        }
+        if (port->failed) {
+            end_int_atomic(iflag);
+            recover(port);
+            continue;
+        }
+        unsigned int slot = __builtin_ctz(~port->busy);
+        port->busy |= 1u << slot;
+        port->slots[slot].request = request;
+        port->exclusive = exclusive;
+        end_int_atomic(iflag);
+
+        if (start_request(port, slot, request) < 0) {
+            iflag = beg_int_atomic();
+            port->busy &= ~(1u << slot);
+            port->slots[slot].request = NULL;
+            port->exclusive = false;
+            wake_all(&port->slot_wait);
+            end_int_atomic(iflag);
+            notify_requester(request, BLOCK_REQUEST_COMPLETE, -1);
+        }
+        request = NULL;
+    }
+}
+
+static void ahci_port_irq(struct ahci_port* port)
+{
+    volatile struct ahci_port_regs* regs = port->regs;
+    uint32_t is = regs->is;
+    regs->is = is;
+
+    if (port->failed) {
+        return;     /* being recovered */
+    }
+    if (is & PORT_IS_ERROR) {
+        /* the port has stopped; recovering it means polling, so
+         * it's up to the port's thread */
+        port->failed = is;
+        regs->ie = 0;
+        wake_all(&port->slot_wait);
+        wake_all(port->dev->wait_queue);
+        return;
+    }
+
+    /* a slot's command is done once it's neither issued nor queued */
+    uint32_t done = port->active & ~(regs->ci | regs->sact);
+    if (done) {
+        finish_slots(port, done, 0);
+    }
+}
+
+static void ahci_irq(struct regs* r)
+{
+    (void)r;
+    uint32_t is = g_hba->is;
+    uint32_t pending = is;
+    while (pending) {
+        unsigned int p = __builtin_ctz(pending);
+        pending &= ~(1u << p);
+        if (g_ports[p]) {
+            ahci_port_irq(g_ports[p]);
+        }
+    }
+    g_hba->is = is;
+}
+
+static int ahci_open(block_device_t* dev)
+{
+    (void)dev;
+    return 0;
+}
+
+static int ahci_close(block_device_t* dev)
+{
+    (void)dev;
+    return 0;
+}
+
+static struct block_device_ops ahci_block_device_ops =
+{
+    ahci_open,
+    ahci_close,
+    NULL,
+};
+
+/*
+ * Set up the command list and tables for a port's first `slots`
+ * slots (beyond those set up already).
+ * @returns 0, or -1 if out of memory
+ */
+static int alloc_tables(struct ahci_port* port, unsigned int slots)
+{
+    unsigned int slot;
+    for (slot = 0; slot < slots; slot++) {
+        if (port->tables[slot]) {
+            continue;
+        }
+        if (slot % TABLES_PER_PAGE == 0) {
+            port->tables[slot] = alloc_zeroed_page();
+            if (!port->tables[slot]) {
+                return -1;
+            }
+        } else {
+            port->tables[slot] = port->tables[slot - 1] + 1;
+        }
+        port->cmd_list[slot].ctba = phys_addr(port->tables[slot]);
+        port->cmd_list[slot].ctbau = 0;
+    }
+    return 0;
+}
+
+/*
+ * Bring up a port with a disk attached, and register the disk.
+ */
+static void ahci_port_init(unsigned int num, unsigned int max_slots,
+        bool hba_ncq)
+{
+    static unsigned int disks = 0;
+    volatile struct ahci_port_regs* regs = &g_hba->ports[num];
+
+    if ((regs->ssts & PORT_SSTS_DET_MASK) != PORT_SSTS_DET_PRESENT ||
+            regs->sig != SATA_SIG_ATA) {
+        return;     /* nothing, or not a disk */
+    }
+
+    struct ahci_port* port = malloc(sizeof(*port));
+    uint16_t* id = alloc_zeroed_page();
+    if (!port || !id) {
+        free(port);
+        if (id) {
+            free_page(id);
+        }
+        return;
+    }
+    memset(port, 0, sizeof(*port));
+    port->regs = regs;
+    port->scratch = id;
+    thread_queue_clear(&port->slot_wait);
+
+    if (port_stop(regs) < 0) {
+        DEBUGF("AHCI port %u won't stop\n", num);
+        goto fail;
+    }
+
+    /* 1KB command list, then the 256 byte received FIS area */
+    port->cmd_list = alloc_zeroed_page();
+    if (!port->cmd_list || alloc_tables(port, 1) < 0) {
+        goto fail;
+    }
+    regs->clb = phys_addr(port->cmd_list);
+    regs->clbu = 0;
+    regs->fb = phys_addr((char*)port->cmd_list + 1024);
+    regs->fbu = 0;
+    regs->serr = regs->serr;
+    regs->is = regs->is;
+    regs->ie = 0;
+    port_start(regs);
+
+    if (polled_command(port, 0, ATA_CMD_IDENTIFY, 0, 0) < 0) {
+        DEBUGF("AHCI port %u: IDENTIFY failed\n", num);
+        goto fail;
+    }
+    if (!(id[ID_CMDSET2] & (1 << 10))) {
+        DEBUGF("AHCI port %u: no LBA48\n", num);
+        goto fail;
+    }
+    port->sectors = id[ID_LBA48_SECTORS] | ((uint32_t)id[ID_LBA48_SECTORS + 1] << 16);
+    if (id[ID_LBA48_SECTORS + 2] || id[ID_LBA48_SECTORS + 3]) {
+        port->sectors = 0xFFFFFFFF;
+    }
+
+    port->ncq = hba_ncq && max_slots > 1 && (id[ID_SATA_CAP] & (1 << 8));
+    port->depth = 1;
+    if (port->ncq) {
+        /* the slot after the last is for reading the error log */
+        port->depth = (id[ID_QUEUE_DEPTH] & 0x1F) + 1;
+        if (port->depth > max_slots - 1) {
+            port->depth = max_slots - 1;
+        }
+    }
+    if (alloc_tables(port, port->depth + port->ncq) < 0) {
+        goto fail;
+    }
+
+    char name[] = { 's', 'd', 'a' + disks, '\0' };
+    port->dev = register_block_device(name, AHCI_SECTOR_SIZE, port,
+            &ahci_block_device_ops);
+    if (!port->dev) {
+        goto fail;
+    }
+    disks++;
+    port->dev->blocks = port->sectors;
+    /* merge no further than one command takes */
+    port->dev->max_blocks = AHCI_MAX_SECTORS;
+    port->dev->max_segs = AHCI_PRDT_ENTRIES;
+
+    g_ports[num] = port;
+    regs->is = regs->is;
+    regs->ie = PORT_IE_DEFAULT;
+    spawn_thread(handle_ahci_requests, (uint32_t)port, PRIORITY_NORMAL, true);
+    DEBUGF("%s: AHCI port %u, %u sectors, queue depth %u\n",
+            name, num, port->sectors, port->depth);
+    return;
+
+fail:
+    port_stop(regs);
+    free_page(id);
+    unsigned int slot;
+    for (slot = 0; slot < AHCI_MAX_SLOTS; slot += TABLES_PER_PAGE) {
+        if (port->tables[slot]) {
+            free_page(port->tables[slot]);
+        }
+    }
+    if (port->cmd_list) {
+        free_page(port->cmd_list);
+    }
+    free(port);
+}
+
+/*
+ * Take over the AHCI controller with registers at physical
+ * address `abar` (BAR5), interrupting on PIC line `irq`.
+ */
+void ahci_init(uintptr_t abar, unsigned int irq)
+{
+    if (g_hba) {
+        return;     /* one controller is plenty */
+    }
+    if (irq > 15) {
+        DEBUGF("AHCI: unusable IRQ %u\n", irq);
+        return;
+    }
+
+    g_hba = ioremap(abar, sizeof(struct ahci_hba_regs));
+    if (!g_hba) {
+        return;
+    }
+
+    g_hba->ghc |= HBA_GHC_AE;
+    g_hba->ghc &= ~HBA_GHC_IE;
+
+    uint32_t cap = g_hba->cap;
+    unsigned int slots = ((cap >> HBA_CAP_NCS_SHIFT) & HBA_CAP_NCS_MASK) + 1;
+    bool ncq = cap & HBA_CAP_SNCQ;
+    DEBUGF("AHCI %X: %u slots, NCQ %s, ports %08X\n", g_hba->vs, slots,
+            ncq ? "yes" : "no", g_hba->pi);
+
+    irq_install_handler(irq, ahci_irq);
+
+    unsigned int p;
+    uint32_t pi = g_hba->pi;
+    for (p = 0; p < 32; p++) {
+        if (pi & (1u << p)) {
+            ahci_port_init(p, slots, ncq);
+        }
+    }
+
+    g_hba->is = g_hba->is;
+    g_hba->ghc |= HBA_GHC_IE;
+    enable_irq(irq);
+}
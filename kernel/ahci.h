@@ -0,0 +1,8 @@
+#ifndef DUNE_AHCI_H
+#define DUNE_AHCI_H
+
+#include "dune.h"
+
+void ahci_init(uintptr_t abar, unsigned int irq);
+
+#endif /* DUNE_AHCI_H */
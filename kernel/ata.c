@@ -1,12 +1,25 @@
 #include "ata.h"
 #include "io.h"
+#include "irq.h"
 #include "print.h"
 #include "thread.h"
+#include "blkdev.h"
+#include "mem.h"
+#include "paging.h"
 
 enum { ATA_MASTER, ATA_SLAVE };
 enum { IDE_ATA, IDE_ATAPI };
 enum { ATA_PRIMARY, ATA_SECONDARY };
-enum { ATA_READ, ATA_WRITE };
+enum { ATA_READ, ATA_WRITE, ATA_FLUSH };
+
+enum {
+    ATA_SECTOR_SIZE = 512,
+    ATA_MAX_SECTORS = 256,          /* per command */
+    ATA_LBA28_LIMIT = 0x10000000,   /* first sector LBA28 can't address */
+    ATA_CMDSET_LBA48 = 1 << 26,     /* in ide_device.commandsets */
+    ATA_CAP_DMA = 1 << 8,           /* in ide_device.capabilities */
+    ATA_POLL_LIMIT = 100000         /* status reads before giving up */
+};
 
 enum { ATAPI_CMD_READ = 0xA8, ATAPI_CMD_EJECT = 0x1B };
 
@@ -28,7 +41,35 @@ enum {
     ATA_REG_CONTROL     = 0x0C,
     ATA_REG_ALTSTATUS   = 0x0C,
     ATA_REG_DEVADDRESS  = 0x0D,
+    ATA_REG_BMCOMMAND   = 0x0E,
+    ATA_REG_BMSTATUS    = 0x10,
+    ATA_REG_BMPRDT      = 0x12
+};
 
+/* bus master IDE command and status bits */
+enum {
+    BM_CMD_START = 0x01,
+    BM_CMD_READ = 0x08,     /* device to memory */
+    BM_SR_ACTIVE = 0x01,
+    BM_SR_ERR = 0x02,
+    BM_SR_IRQ = 0x04
+};
+
+/*
+ * Physical region descriptor: one physically contiguous piece of a
+ * DMA transfer, which mustn't cross a 64KB boundary. The controller
+ * walks a table of them (itself physically contiguous).
+ */
+struct prd {
+    uint32_t addr;      /* physical address */
+    uint16_t bytes;     /* 0 means 64KB */
+    uint16_t flags;     /* PRD_EOT on the last one */
+} __attribute__((packed));
+
+enum {
+    PRD_EOT = 0x8000,
+    PRD_BOUNDARY = 0x10000,
+    PRD_MAX = PAGE_SIZE / sizeof(struct prd)
 };
 
 enum {
@@ -88,6 +129,17 @@ struct channel {
     uint16_t ctrl;      /* Control base */
     uint16_t bmide;     /* Bus Master IDE */
     uint8_t nIEN;       /* no interrupt */
+
+    /* one command at a time per channel, finished by its IRQ */
+    mutex_t lock;
+    bool busy;              /* command in progress */
+    int cmd;                /* ATA_READ/ATA_WRITE/ATA_FLUSH */
+    bool dma;               /* transfer done by the bus master */
+    struct prd* prdt;       /* PRD table page, NULL if no bus master */
+    struct block_iter iter; /* memory of the next sectors to transfer */
+    unsigned int sectors;   /* sectors left to transfer */
+    bool error;
+    completion_t done;
 } channels[2];
 
 struct ide_device {
@@ -100,10 +152,11 @@ struct ide_device {
     uint32_t commandsets;   /* Command Sets Supported */
     uint32_t size;          /* Size in Sectors */
     char model[41];         /* Model in string */
+    block_device_t* blkdev; /* registered block device (ATA only) */
+    bool dma;               /* use bus master DMA */
 } ide_devices[4];
 
 uint8_t ide_buffer[2048] = {0};
-static uint8_t ide_irq_invoked = 0;
 static uint8_t atapi_packet[12] = {0xA8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
 static void ide_write(uint8_t channel, uint8_t reg, uint8_t data)
@@ -168,9 +221,405 @@ static void ide_read_buffer(uint8_t channel, uint8_t reg, uintptr_t buffer, unsi
     }
 }
 
+/*
+ * Wait 400ns, e.g. for a drive select to take effect, by reading
+ * the alternate status register (which doesn't ack interrupts).
+ */
+static void ide_delay(uint8_t channel)
+{
+    unsigned int i;
+    for (i = 0; i < 4; i++) {
+        ide_read(channel, ATA_REG_ALTSTATUS);
+    }
+}
+
+/*
+ * Poll until the selected drive is no longer busy, and if
+ * `drq` is set, until it's ready to transfer data.
+ * @returns 0, or -1 on error or timeout
+ */
+static int ide_poll(uint8_t channel, bool drq)
+{
+    unsigned int i;
+    for (i = 0; i < ATA_POLL_LIMIT; i++) {
+        uint8_t status = ide_read(channel, ATA_REG_ALTSTATUS);
+        if (status & ATA_SR_BSY) {
+            continue;
+        }
+        if (!drq) {
+            return 0;
+        }
+        if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+            return -1;
+        }
+        if (status & ATA_SR_DRQ) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Describe the next `bytes` bytes of the memory `it` walks in the
+ * channel's PRD table, one entry per physically contiguous piece.
+ * @returns false if the memory can't be used for DMA
+ */
+static bool ide_build_prdt(struct channel* c, struct block_iter* it,
+        size_t bytes)
+{
+    struct prd* prd = c->prdt;
+    unsigned int n = 0;
+    uint32_t len = 0;   /* of the last entry (which may be 64KB) */
+    while (bytes > 0) {
+        void* addr;
+        size_t left = block_iter_next(it, &addr, bytes);
+        if (!left || ((uintptr_t)addr & 1)) {
+            return false;   /* must be word aligned */
+        }
+        bytes -= left;
+
+        uint8_t* buf = addr;
+        while (left > 0) {
+            uintptr_t virt = (uintptr_t)buf;
+            uintptr_t phys = kernel_virt_to_phys(virt);
+            if (!phys) {
+                return false;
+            }
+            /* a page never crosses a 64KB boundary */
+            size_t piece = PAGE_SIZE - (virt & ~PAGE_MASK);
+            if (piece > left) {
+                piece = left;
+            }
+
+            if (n > 0 && prd[n - 1].addr + len == phys &&
+                    prd[n - 1].addr / PRD_BOUNDARY ==
+                    (phys + piece - 1) / PRD_BOUNDARY) {
+                len += piece;
+            } else {
+                if (n == PRD_MAX) {
+                    return false;
+                }
+                prd[n].addr = phys;
+                prd[n].flags = 0;
+                n++;
+                len = piece;
+            }
+            prd[n - 1].bytes = (uint16_t)len;
+            buf += piece;
+            left -= piece;
+        }
+    }
+    prd[n - 1].flags = PRD_EOT;
+    return true;
+}
+
+/* the next sector of a PIO transfer (pieces are whole sectors) */
+static uintptr_t ide_next_sector(struct channel* c)
+{
+    void* addr;
+    block_iter_next(&c->iter, &addr, ATA_SECTOR_SIZE);
+    return (uintptr_t)addr;
+}
+
+/* called with interrupts disabled */
+static void ide_finish(struct channel* c, bool error)
+{
+    c->busy = false;
+    c->error = error;
+    complete(&c->done);
+}
+
+/*
+ * IRQ handler for a channel: moves the next sector of a PIO
+ * transfer, or finishes the command (DMA transfers interrupt
+ * only once, at the end).
+ */
+static void ide_irq(uint8_t channel)
+{
+    struct channel* c = &channels[channel];
+
+    /* reading the status register acknowledges the interrupt */
+    uint8_t status = ide_read(channel, ATA_REG_STATUS);
+    if (!c->busy) {
+        return;
+    }
+    if (c->dma) {
+        uint8_t bm = ide_read(channel, ATA_REG_BMSTATUS);
+        if (!(bm & BM_SR_IRQ)) {
+            return;
+        }
+        /* the whole transfer is done: stop the bus master */
+        ide_write(channel, ATA_REG_BMCOMMAND, 0);
+        ide_write(channel, ATA_REG_BMSTATUS, bm | BM_SR_ERR | BM_SR_IRQ);
+        ide_finish(c, (bm & BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF)));
+        return;
+    }
+    if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+        DEBUGF("ATA error: status %02X, error %02X\n", status,
+                ide_read(channel, ATA_REG_ERROR));
+        ide_finish(c, true);
+        return;
+    }
+
+    if (c->cmd == ATA_READ) {
+        if (!(status & ATA_SR_DRQ)) {
+            ide_finish(c, true);
+            return;
+        }
+        ide_read_buffer(channel, ATA_REG_DATA, ide_next_sector(c),
+                ATA_SECTOR_SIZE / 2);
+        if (--c->sectors == 0) {
+            ide_finish(c, false);
+        }
+    } else if (c->cmd == ATA_WRITE && c->sectors > 0) {
+        /* the last sector was taken: send the next one */
+        outportsw(c->base + ATA_REG_DATA, ide_next_sector(c),
+                ATA_SECTOR_SIZE / 2);
+        c->sectors--;
+    } else {
+        /* last sector written, or cache flushed */
+        ide_finish(c, false);
+    }
+}
+
+static void ide_primary_irq(struct regs* r)
+{
+    (void)r;
+    ide_irq(ATA_PRIMARY);
+}
+
+static void ide_secondary_irq(struct regs* r)
+{
+    (void)r;
+    ide_irq(ATA_SECONDARY);
+}
+
+/*
+ * Run one command on a drive: read or write `count` (at most
+ * ATA_MAX_SECTORS) sectors from `lba`, to or from the memory `it`
+ * walks (and advance it), or flush its write cache.
+ * Transfers use bus master DMA if the drive and memory allow it,
+ * PIO otherwise. Sleeps until the drive's interrupt says it's done.
+ * @returns 0 on success, -1 on failure
+ */
+static int ide_command(struct ide_device* drive, int cmd, uint32_t lba,
+        unsigned int count, struct block_iter* it)
+{
+    uint8_t chan = drive->channel;
+    struct channel* c = &channels[chan];
+    bool lba48 = drive->commandsets & ATA_CMDSET_LBA48;
+    /* LBA28 takes fewer register writes, so use it when possible */
+    bool ext = lba48 && (cmd == ATA_FLUSH || lba + count > ATA_LBA28_LIMIT);
+
+    static const uint8_t opcodes[2][2][3] = {
+        {
+            { ATA_CMD_READ_PIO, ATA_CMD_WRITE_PIO, ATA_CMD_CACHE_FLUSH },
+            { ATA_CMD_READ_PIO_EXT, ATA_CMD_WRITE_PIO_EXT,
+                ATA_CMD_CACHE_FLUSH_EXT }
+        }, {
+            { ATA_CMD_READ_DMA, ATA_CMD_WRITE_DMA, ATA_CMD_CACHE_FLUSH },
+            { ATA_CMD_READ_DMA_EXT, ATA_CMD_WRITE_DMA_EXT,
+                ATA_CMD_CACHE_FLUSH_EXT }
+        }
+    };
+
+    mutex_lock(&c->lock);
+
+    bool dma = false;
+    if (cmd != ATA_FLUSH) {
+        c->iter = *it;
+        dma = drive->dma &&
+            ide_build_prdt(c, &c->iter, count * ATA_SECTOR_SIZE);
+        if (!dma) {
+            c->iter = *it;  /* PIO starts over */
+        }
+    }
+    if (dma) {
+        outportl(c->bmide + ATA_REG_BMPRDT - ATA_REG_BMCOMMAND,
+                virt_to_phys((uintptr_t)c->prdt));
+        ide_write(chan, ATA_REG_BMCOMMAND, cmd == ATA_READ ? BM_CMD_READ : 0);
+        /* clear error and interrupt (write 1), keep the other bits */
+        ide_write(chan, ATA_REG_BMSTATUS,
+                ide_read(chan, ATA_REG_BMSTATUS) | BM_SR_ERR | BM_SR_IRQ);
+    }
+
+    if (ext || cmd == ATA_FLUSH) {
+        ide_write(chan, ATA_REG_HDDEVSEL, 0xE0 | (drive->drive << 4));
+    } else {
+        ide_write(chan, ATA_REG_HDDEVSEL,
+                0xE0 | (drive->drive << 4) | ((lba >> 24) & 0x0F));
+    }
+    ide_delay(chan);
+    if (ide_poll(chan, false) < 0) {
+        mutex_unlock(&c->lock);
+        return -1;
+    }
+
+    if (cmd != ATA_FLUSH) {
+        if (ext) {
+            /* high order bytes first */
+            ide_write(chan, ATA_REG_SECCOUNT1, (count >> 8) & 0xFF);
+            ide_write(chan, ATA_REG_LBA3, (lba >> 24) & 0xFF);
+            ide_write(chan, ATA_REG_LBA4, 0);
+            ide_write(chan, ATA_REG_LBA5, 0);
+        }
+        ide_write(chan, ATA_REG_SECCOUNT0, count & 0xFF);   /* 0: 256 */
+        ide_write(chan, ATA_REG_LBA0, lba & 0xFF);
+        ide_write(chan, ATA_REG_LBA1, (lba >> 8) & 0xFF);
+        ide_write(chan, ATA_REG_LBA2, (lba >> 16) & 0xFF);
+    }
+
+    completion_init(&c->done);
+    c->cmd = cmd;
+    c->dma = dma;
+    c->sectors = count;
+    c->error = false;
+
+    bool iflag = beg_int_atomic();
+    c->busy = true;
+    ide_write(chan, ATA_REG_COMMAND, opcodes[dma][ext][cmd]);
+    if (dma) {
+        ide_write(chan, ATA_REG_BMCOMMAND,
+                (cmd == ATA_READ ? BM_CMD_READ : 0) | BM_CMD_START);
+    }
+    end_int_atomic(iflag);
+
+    if (cmd == ATA_WRITE && !dma) {
+        /* the first sector goes out without an interrupt */
+        int rc = ide_poll(chan, true);
+        iflag = beg_int_atomic();
+        if (rc < 0) {
+            ide_finish(c, true);
+        } else {
+            outportsw(c->base + ATA_REG_DATA, ide_next_sector(c),
+                    ATA_SECTOR_SIZE / 2);
+            c->sectors--;
+        }
+        end_int_atomic(iflag);
+    }
+
+    wait_for_completion(&c->done);
+    bool error = c->error;
+    if (cmd != ATA_FLUSH) {
+        *it = c->iter;
+    }
+    mutex_unlock(&c->lock);
+
+    return error ? -1 : 0;
+}
+
+static int ide_do_request(struct ide_device* drive, block_request_t* request)
+{
+    if (request->type == BLOCK_REQUEST_FLUSH) {
+        return ide_command(drive, ATA_FLUSH, 0, 0, NULL);
+    }
+
+    uint32_t lba = request->block_number;
+    unsigned int count = request->block_count;
+    if (lba >= drive->size || count > drive->size - lba) {
+        return -1;
+    }
+
+    int cmd = (request->type == BLOCK_REQUEST_READ) ? ATA_READ : ATA_WRITE;
+    struct block_iter it;
+    block_iter_init(&it, request);
+    while (count > 0) {
+        unsigned int n = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+        if (ide_command(drive, cmd, lba, n, &it) < 0) {
+            return -1;
+        }
+        lba += n;
+        count -= n;
+    }
+    return 0;
+}
+
+/* serves the requests queued on one drive */
+static void handle_ata_requests(uint32_t arg)
+{
+    struct ide_device* drive = &ide_devices[arg];
+    while (true) {
+        block_request_t* request = block_device_pop_request(drive->blkdev);
+        int rc = ide_do_request(drive, request);
+        notify_requester(request, BLOCK_REQUEST_COMPLETE, rc);
+    }
+}
+
+static int ata_open(block_device_t* dev)
+{
+    (void)dev;
+    return 0;
+}
+
+static int ata_close(block_device_t* dev)
+{
+    (void)dev;
+    return 0;
+}
+
+static struct block_device_ops ata_block_device_ops =
+{
+    ata_open,
+    ata_close,
+    NULL,
+};
+
+/*
+ * Enable the channels' interrupts, and register each ATA drive
+ * as a block device ("hda" to "hdd").
+ */
+static void ide_register_drives(void)
+{
+    irq_install_handler(IRQ_ATA_PRIMARY, ide_primary_irq);
+    irq_install_handler(IRQ_ATA_SECONDARY, ide_secondary_irq);
+
+    int chan;
+    for (chan = 0; chan < 2; chan++) {
+        mutex_init(&channels[chan].lock);
+        channels[chan].busy = false;
+        channels[chan].dma = false;
+        /* one page holds a PRD table for any transfer we make */
+        channels[chan].prdt = channels[chan].bmide ? alloc_page() : NULL;
+        channels[chan].nIEN = 0;
+        ide_write(chan, ATA_REG_CONTROL, 0);
+    }
+    enable_irq(IRQ_ATA_PRIMARY);
+    enable_irq(IRQ_ATA_SECONDARY);
+
+    unsigned int i;
+    for (i = 0; i < 4; i++) {
+        struct ide_device* drive = &ide_devices[i];
+        if (!drive->reserved || drive->type != IDE_ATA) {
+            continue;
+        }
+        drive->dma = channels[drive->channel].prdt &&
+            (drive->capabilities & ATA_CAP_DMA);
+
+        char name[] = { 'h', 'd', 'a' + i, '\0' };
+        drive->blkdev = register_block_device(name, ATA_SECTOR_SIZE,
+                drive, &ata_block_device_ops);
+        if (!drive->blkdev) {
+            continue;
+        }
+        drive->blkdev->blocks = drive->size;
+        drive->blkdev->max_blocks = ATA_MAX_SECTORS;
+        drive->blkdev->max_segs = PRD_MAX;
+        spawn_thread(handle_ata_requests, i, PRIORITY_NORMAL, true);
+        DEBUGF("%s: %u sectors, %s\n", name, drive->size,
+                drive->dma ? "DMA" : "PIO");
+    }
+}
+
 void ide_initialize(uint32_t bar0, uint32_t bar1, uint32_t bar2,
         uint32_t bar3, uint32_t bar4)
 {
+    /* the driver only knows about one controller's two channels */
+    static bool initialized = false;
+    if (initialized) {
+        return;
+    }
+    initialized = true;
+
     /* Detect I/O Ports which interface IDE Controller */
     channels[ATA_PRIMARY].base = (bar0 &= 0xFFFFFFFC) + 0x1F0 * (!bar0);
     channels[ATA_PRIMARY].ctrl = (bar1 &= 0xFFFFFFFC) + 0x3F4 * (!bar1);
@@ -178,6 +627,11 @@ void ide_initialize(uint32_t bar0, uint32_t bar1, uint32_t bar2,
     channels[ATA_SECONDARY].ctrl = (bar3 &= 0xFFFFFFFC) + 0x374 * (!bar3);
     channels[ATA_PRIMARY ].bmide = (bar4 &= 0xFFFFFFFC) + 0;    /* Bus Master IDE */
     channels[ATA_SECONDARY].bmide = (bar4 &= 0xFFFFFFFC) + 8;   /* Bus Master IDE */
+    if (!bar4) {
+        /* no bus master: PIO only */
+        channels[ATA_PRIMARY].bmide = 0;
+        channels[ATA_SECONDARY].bmide = 0;
+    }
 
     DEBUGF("%X %X %X\n", channels[ATA_PRIMARY].base, channels[ATA_PRIMARY].ctrl, channels[ATA_PRIMARY].bmide);
     DEBUGF("%X %X %X\n", channels[ATA_SECONDARY].base, channels[ATA_SECONDARY].ctrl, channels[ATA_SECONDARY].bmide);
@@ -215,7 +669,8 @@ void ide_initialize(uint32_t bar0, uint32_t bar1, uint32_t bar2,
                 DEBUG("device found!\n");
             };
 
-            while (true) {
+            unsigned int polls;
+            for (polls = 0; polls < ATA_POLL_LIMIT; polls++) {
                 status = ide_read(chan, ATA_REG_STATUS);
                 if ((status & ATA_SR_ERR)) {
                     err = true;
@@ -227,6 +682,10 @@ void ide_initialize(uint32_t bar0, uint32_t bar1, uint32_t bar2,
                     break;  /* Everything is right */
                 }
             }
+            if (polls == ATA_POLL_LIMIT) {
+                DEBUG("device not responding\n");
+                continue;
+            }
 
             /* Probe for ATAPI Devices */
 
@@ -262,7 +721,7 @@ void ide_initialize(uint32_t bar0, uint32_t bar1, uint32_t bar2,
             ide_devices[count].commandsets = ((uint32_t *)(ide_buffer + ATA_IDENT_COMMANDSETS))[0];
 
             /* Get Size */
-            if (ide_devices[count].commandsets & (1 << 26)) {
+            if (ide_devices[count].commandsets & ATA_CMDSET_LBA48) {
                 /* Device uses 48-Bit Addressing */
                 ide_devices[count].size = ((uint32_t *)(ide_buffer + ATA_IDENT_MAX_LBA_EXT))[0];
                 /* In a 32-Bit operating system the last word is ignored */
@@ -298,4 +757,6 @@ void ide_initialize(uint32_t bar0, uint32_t bar1, uint32_t bar2,
             /* DEBUG("\n"); */
         }
     }
+
+    ide_register_drives();
 }
@@ -0,0 +1,1007 @@
+#include "int.h"
+#include "mem.h"
+#include "string.h"
+#include "timer.h"
+#include "bcache.h"
+
+/*
+ * Buffer cache: device blocks kept in RAM, found through a hash
+ * table on (device, block number). Unreferenced buffers sit on an
+ * LRU list and the least recently used ones are evicted once the
+ * cached data outgrows the memory budget. Changed buffers are
+ * written back later (see `write_back`).
+ */
+enum { BCACHE_BUCKETS = 256 };
+
+static buffer_t* g_buckets[BCACHE_BUCKETS];
+static buffer_t* g_lru_head;        /* next to evict */
+static buffer_t* g_lru_tail;        /* most recently released */
+static size_t g_cached_bytes;
+static size_t g_limit = BCACHE_DEFAULT_LIMIT;
+
+static buffer_t* g_dirty_head;      /* dirty the longest */
+static buffer_t* g_dirty_tail;
+static size_t g_dirty_bytes;
+static thread_queue_t g_flusher_wait;   /* flusher, while nothing's dirty */
+
+static unsigned int g_hits, g_misses, g_evictions;
+static unsigned int g_blocks_written, g_write_errors;
+
+static unsigned int bucket(block_device_t* dev, unsigned int block)
+{
+    return (dev->id * 31 + block) % BCACHE_BUCKETS;
+}
+
+/* the following are called with interrupts disabled */
+
+static void lru_remove(buffer_t* buf)
+{
+    if (buf->lru_prev) {
+        buf->lru_prev->lru_next = buf->lru_next;
+    } else {
+        g_lru_head = buf->lru_next;
+    }
+    if (buf->lru_next) {
+        buf->lru_next->lru_prev = buf->lru_prev;
+    } else {
+        g_lru_tail = buf->lru_prev;
+    }
+    buf->lru_prev = NULL;
+    buf->lru_next = NULL;
+}
+
+static void lru_append(buffer_t* buf)
+{
+    buf->lru_next = NULL;
+    buf->lru_prev = g_lru_tail;
+    if (g_lru_tail) {
+        g_lru_tail->lru_next = buf;
+    } else {
+        g_lru_head = buf;
+    }
+    g_lru_tail = buf;
+}
+
+static void dirty_append(buffer_t* buf)
+{
+    buf->dirty_next = NULL;
+    buf->dirty_prev = g_dirty_tail;
+    if (g_dirty_tail) {
+        g_dirty_tail->dirty_next = buf;
+    } else {
+        g_dirty_head = buf;
+    }
+    g_dirty_tail = buf;
+    g_dirty_bytes += buf->dev->blocksize;
+}
+
+static void dirty_remove(buffer_t* buf)
+{
+    if (buf->dirty_prev) {
+        buf->dirty_prev->dirty_next = buf->dirty_next;
+    } else {
+        g_dirty_head = buf->dirty_next;
+    }
+    if (buf->dirty_next) {
+        buf->dirty_next->dirty_prev = buf->dirty_prev;
+    } else {
+        g_dirty_tail = buf->dirty_prev;
+    }
+    buf->dirty_prev = NULL;
+    buf->dirty_next = NULL;
+    g_dirty_bytes -= buf->dev->blocksize;
+}
+
+static buffer_t* hash_find(block_device_t* dev, unsigned int block)
+{
+    buffer_t* buf;
+    for (buf = g_buckets[bucket(dev, block)]; buf; buf = buf->hash_next) {
+        if (buf->dev == dev && buf->block == block) {
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+static void hash_remove(buffer_t* buf)
+{
+    buffer_t** b = &g_buckets[bucket(buf->dev, buf->block)];
+    while (*b != buf) {
+        b = &(*b)->hash_next;
+    }
+    *b = buf->hash_next;
+    buf->hash_next = NULL;
+}
+
+/*
+ * Remove an unreferenced buffer from the cache.
+ * @returns the buffer, to be freed by `free_buffer`
+ */
+static buffer_t* evict(buffer_t* buf)
+{
+    KASSERT(buf->refcount == 0);
+    lru_remove(buf);
+    hash_remove(buf);
+    g_cached_bytes -= buf->dev->blocksize;
+    return buf;
+}
+
+static void free_buffer(buffer_t* buf)
+{
+    free(buf->data);
+    free(buf);
+}
+
+/*
+ * Evict least recently used buffers until `bytes` more fit
+ * in the budget (or nothing is left to evict). Dirty buffers
+ * have to be written back first. Blocks read ahead but not asked
+ * for yet get a second chance, so that a reader's own released
+ * blocks go before the ones it's about to read.
+ * @returns list of evicted buffers (linked by hash_next) to free
+ */
+static buffer_t* shrink(size_t bytes)
+{
+    buffer_t* evicted = NULL;
+    buffer_t* buf = g_lru_head;
+    while (buf && g_cached_bytes + bytes > g_limit) {
+        buffer_t* next = buf->lru_next;
+        if (buf->flags & BUF_DIRTY) {
+            /* skip it */
+        } else if (buf->flags & BUF_READAHEAD) {
+            buf->flags &= ~BUF_READAHEAD;
+            lru_remove(buf);
+            lru_append(buf);
+            if (!next) {
+                next = buf;
+            }
+        } else {
+            evict(buf);
+            buf->hash_next = evicted;
+            evicted = buf;
+            g_evictions++;
+        }
+        buf = next;
+    }
+    return evicted;
+}
+
+static void free_buffers(buffer_t* list)
+{
+    while (list) {
+        buffer_t* next = list->hash_next;
+        free_buffer(list);
+        list = next;
+    }
+}
+
+/*
+ * Allocate a buffer for a block (not yet in the cache),
+ * with one reference for the caller.
+ * @returns NULL if out of memory
+ */
+static buffer_t* new_buffer(block_device_t* dev, unsigned int block)
+{
+    buffer_t* buf = malloc(sizeof(*buf));
+    void* data = buf ? malloc(dev->blocksize) : NULL;
+    if (!data) {
+        free(buf);
+        return NULL;
+    }
+
+    buf->dev = dev;
+    buf->block = block;
+    buf->data = data;
+    buf->flags = 0;
+    buf->refcount = 1;
+    buf->hash_next = NULL;
+    buf->lru_prev = NULL;
+    buf->lru_next = NULL;
+    buf->dirty_prev = NULL;
+    buf->dirty_next = NULL;
+    buf->dirtied = 0;
+    thread_queue_clear(&buf->wait_queue);
+    return buf;
+}
+
+/*
+ * Add a new buffer to the cache, making room for it.
+ * Called with interrupts disabled.
+ * @returns list of evicted buffers to free
+ */
+static buffer_t* insert(buffer_t* buf)
+{
+    unsigned int b = bucket(buf->dev, buf->block);
+    buf->hash_next = g_buckets[b];
+    g_buckets[b] = buf;
+
+    buffer_t* evicted = shrink(buf->dev->blocksize);
+    g_cached_bytes += buf->dev->blocksize;
+    return evicted;
+}
+
+/*
+ * Find or create the buffer for a block, taking a reference.
+ * @returns NULL if out of memory
+ */
+static buffer_t* get_buffer(block_device_t* dev, unsigned int block)
+{
+    bool iflag = beg_int_atomic();
+    buffer_t* buf = hash_find(dev, block);
+    if (buf) {
+        if (buf->refcount++ == 0) {
+            lru_remove(buf);
+        }
+        buf->flags &= ~BUF_READAHEAD;
+        g_hits++;
+        end_int_atomic(iflag);
+        return buf;
+    }
+    end_int_atomic(iflag);
+
+    /* allocate outside of the critical section */
+    buffer_t* new_buf = new_buffer(dev, block);
+    if (!new_buf) {
+        return NULL;
+    }
+
+    iflag = beg_int_atomic();
+    buf = hash_find(dev, block);
+    if (buf) {
+        /* someone else got there first */
+        if (buf->refcount++ == 0) {
+            lru_remove(buf);
+        }
+        buf->flags &= ~BUF_READAHEAD;
+        g_hits++;
+        end_int_atomic(iflag);
+        free_buffer(new_buf);
+        return buf;
+    }
+
+    buffer_t* evicted = insert(new_buf);
+    g_misses++;
+    end_int_atomic(iflag);
+
+    free_buffers(evicted);
+    return new_buf;
+}
+
+/*
+ * Sequential readahead. Each stream of reads through consecutive
+ * blocks of a device is tracked separately (several threads may be
+ * scanning different parts of a disk). Once a stream's second
+ * sequential read comes in, the blocks after it are read into the
+ * cache asynchronously, and whenever the reader reaches the first
+ * block of that batch, the next batch is issued: the device works
+ * ahead of the reader rather than waiting for each of its requests.
+ * The window doubles with every batch, up to a limit.
+ */
+enum {
+    RA_STREAMS = 8,             /* streams tracked at once */
+    RA_MIN_BLOCKS = 4,          /* first window */
+    RA_MAX_BYTES = 0x10000      /* largest window (64KB) */
+};
+
+struct ra_stream {
+    block_device_t* dev;        /* NULL if unused */
+    unsigned int next;          /* block a sequential read asks for next */
+    unsigned int mark;          /* reading this block issues the next batch */
+    unsigned int end;           /* one past the last block read ahead */
+    unsigned int window;        /* blocks in the last batch (0: none yet) */
+    unsigned int last_used;     /* for replacing the least recently used */
+};
+
+static struct ra_stream g_streams[RA_STREAMS];
+static unsigned int g_stream_clock;
+static unsigned int g_ra_blocks;
+
+/* a batch of blocks read ahead with one request */
+struct prefetch {
+    block_request_t request;
+    unsigned int count;         /* buffers being read */
+    struct block_seg* segs;     /* their data, read by request */
+    buffer_t* bufs[];
+};
+
+static unsigned int ra_max_blocks(block_device_t* dev)
+{
+    /* don't read so far ahead that the batches evict each other */
+    size_t bytes = g_limit / 4 < RA_MAX_BYTES ? g_limit / 4 : RA_MAX_BYTES;
+    unsigned int blocks = bytes / dev->blocksize;
+    if (blocks > dev->max_blocks) {
+        blocks = dev->max_blocks;
+    }
+    return blocks ? blocks : 1;
+}
+
+/*
+ * Completion callback for a readahead batch: hand its blocks
+ * to the buffers waiting for them.
+ */
+static void prefetch_done(block_request_t* request)
+{
+    struct prefetch* p = request->done_data;
+    bool ok = request->state == BLOCK_REQUEST_COMPLETE && request->ecode >= 0;
+
+    bool iflag = beg_int_atomic();
+    unsigned int i;
+    for (i = 0; i < p->count; i++) {
+        buffer_t* buf = p->bufs[i];
+        if (ok) {
+            buf->flags |= BUF_VALID;
+        }
+        buf->flags &= ~BUF_BUSY;
+        wake_all(&buf->wait_queue);
+        if (--buf->refcount == 0) {
+            /* a failed read is left for a real reader to retry,
+             * or for eviction */
+            lru_append(buf);
+        }
+    }
+    end_int_atomic(iflag);
+
+    free(p->segs);
+    free(p);
+}
+
+/*
+ * Start reading up to `count` blocks from `start` into the cache,
+ * skipping blocks that are already cached and stopping at the first
+ * cached block after that, so one (vectored) request reads the batch
+ * straight into the buffers. Allocation failures just cut the batch
+ * short.
+ */
+static void prefetch(block_device_t* dev, unsigned int start,
+        unsigned int count)
+{
+    struct prefetch* p = malloc(sizeof(*p) + count * sizeof(buffer_t*));
+    struct block_seg* segs = p ? malloc(count * sizeof(*segs)) : NULL;
+    if (!segs) {
+        free(p);
+        return;
+    }
+    p->count = 0;
+    p->segs = segs;
+    unsigned int pages = 0;     /* the driver takes at most dev->max_segs */
+
+    unsigned int block;
+    for (block = start; block < start + count; block++) {
+        buffer_t* buf = new_buffer(dev, block);
+        if (!buf) {
+            break;
+        }
+        unsigned int buf_pages = block_pages(buf->data, dev->blocksize);
+        if (pages + buf_pages > dev->max_segs) {
+            free_buffer(buf);
+            break;
+        }
+
+        bool iflag = beg_int_atomic();
+        if (hash_find(dev, block)) {
+            end_int_atomic(iflag);
+            free_buffer(buf);
+            if (p->count) {
+                break;
+            }
+            continue;
+        }
+        /* the prefetch holds the buffer's reference until it's read */
+        buf->flags = BUF_BUSY | BUF_READAHEAD;
+        buffer_t* evicted = insert(buf);
+        end_int_atomic(iflag);
+
+        free_buffers(evicted);
+        unsigned int offset = (uintptr_t)buf->data % PAGE_SIZE;
+        segs[p->count].page = (char*)buf->data - offset;
+        segs[p->count].offset = offset;
+        segs[p->count].len = dev->blocksize;
+        p->bufs[p->count++] = buf;
+        pages += buf_pages;
+    }
+
+    if (!p->count) {
+        free(segs);
+        free(p);
+        return;
+    }
+
+    g_ra_blocks += p->count;
+    block_request_init_vec(&p->request, dev, BLOCK_REQUEST_READ,
+            p->bufs[0]->block, segs, p->count, prefetch_done, p);
+    block_device_submit(&p->request);
+}
+
+/*
+ * Note a read of `block`, and read ahead if it continues a stream.
+ */
+static void readahead(block_device_t* dev, unsigned int block)
+{
+    bool iflag = beg_int_atomic();
+
+    struct ra_stream* s = NULL;
+    struct ra_stream* oldest = &g_streams[0];
+    unsigned int i;
+    for (i = 0; i < RA_STREAMS; i++) {
+        struct ra_stream* t = &g_streams[i];
+        if (t->dev == dev && (t->next == block || t->next == block + 1)) {
+            s = t;
+            break;
+        }
+        if (!t->dev || (oldest->dev && t->last_used < oldest->last_used)) {
+            oldest = t;
+        }
+    }
+    g_stream_clock++;
+
+    if (!s) {
+        /* maybe the start of a new stream */
+        s = oldest;
+        s->dev = dev;
+        s->next = block + 1;
+        s->mark = s->end = block + 1;
+        s->window = 0;
+        s->last_used = g_stream_clock;
+        end_int_atomic(iflag);
+        return;
+    }
+
+    s->last_used = g_stream_clock;
+    if (s->next == block + 1) {
+        /* re-reading the last block */
+        end_int_atomic(iflag);
+        return;
+    }
+    s->next = block + 1;
+    if (s->window && block < s->mark) {
+        /* still working through the last batch */
+        end_int_atomic(iflag);
+        return;
+    }
+
+    unsigned int max = ra_max_blocks(dev);
+    s->window = s->window ? s->window * 2 : RA_MIN_BLOCKS;
+    if (s->window > max) {
+        s->window = max;
+    }
+    unsigned int start = s->end > block + 1 ? s->end : block + 1;
+    unsigned int count = s->window;
+    s->mark = start;
+    s->end = start + count;
+    end_int_atomic(iflag);
+
+    prefetch(dev, start, count);
+}
+
+/*
+ * Get a block's contents, reading it from the device unless it's
+ * cached. Threads asking for a block that is being read wait for
+ * that read instead of issuing their own. Sequential reads start
+ * reading the following blocks ahead (see `readahead`). May sleep.
+ * Release the buffer with `bcache_release` when done.
+ * @returns NULL on read error or if out of memory
+ */
+buffer_t* bcache_read(block_device_t* dev, unsigned int block)
+{
+    KASSERT(dev);
+
+    readahead(dev, block);
+
+    buffer_t* buf = get_buffer(dev, block);
+    if (!buf) {
+        return NULL;
+    }
+
+    bool iflag = beg_int_atomic();
+    for (;;) {
+        if (buf->flags & BUF_VALID) {
+            end_int_atomic(iflag);
+            return buf;
+        }
+        if (!(buf->flags & BUF_BUSY)) {
+            break;
+        }
+        wait(&buf->wait_queue);
+    }
+
+    /* our turn to read it */
+    buf->flags |= BUF_BUSY;
+    end_int_atomic(iflag);
+
+    int rc = block_device_read(dev, block, 1, buf->data);
+
+    iflag = beg_int_atomic();
+    buf->flags &= ~BUF_BUSY;
+    if (rc >= 0) {
+        buf->flags |= BUF_VALID;
+    }
+    wake_all(&buf->wait_queue);
+    end_int_atomic(iflag);
+
+    if (rc < 0) {
+        bcache_release(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/*
+ * Drop a reference to a buffer. Unreferenced buffers stay cached
+ * (unless they don't hold valid data) until evicted.
+ */
+void bcache_release(buffer_t* buf)
+{
+    KASSERT(buf);
+
+    buffer_t* evicted = NULL;
+
+    bool iflag = beg_int_atomic();
+    KASSERT(buf->refcount > 0);
+    if (--buf->refcount == 0) {
+        lru_append(buf);
+        if (!(buf->flags & BUF_VALID)) {
+            /* failed read: don't keep it around */
+            evicted = evict(buf);
+            evicted->hash_next = NULL;
+        } else {
+            evicted = shrink(0);
+        }
+    }
+    end_int_atomic(iflag);
+
+    free_buffers(evicted);
+}
+
+/*
+ * Write-back. Changed buffers go on a dirty list, oldest first, and
+ * the flusher thread writes them back once they've been dirty for
+ * DIRTY_EXPIRE ticks, or sooner while over a quarter of the cache
+ * budget is dirty. Past half the budget, writers start write-back
+ * themselves (without waiting for it). Each request writes a run of
+ * adjacent dirty blocks, copied into a bounce buffer so the buffers
+ * can be changed again while it's in flight.
+ */
+enum {
+    DIRTY_EXPIRE = 3 * TICKS_PER_SEC,
+    FLUSH_INTERVAL_MS = 500,
+    WB_MAX_BLOCKS = 64          /* largest write-back run */
+};
+
+/* a thread waiting for a set of write-back requests */
+struct wb_wait {
+    unsigned int pending;       /* requests not finished */
+    int error;                  /* -1 if any failed */
+    completion_t done;
+};
+
+/* a run of blocks written back with one request */
+struct writeback {
+    block_request_t request;
+    struct wb_wait* waiter;     /* or NULL */
+    unsigned int count;         /* buffers being written */
+    void* data;                 /* count * blocksize bytes */
+    buffer_t* bufs[];
+};
+
+enum wb_result { WB_WRITTEN, WB_NOT_STARTED, WB_FAILED };
+
+/* the following are called with interrupts disabled */
+
+static bool writable(buffer_t* buf)
+{
+    return buf && (buf->flags & (BUF_DIRTY | BUF_WRITING | BUF_ERROR)) ==
+        BUF_DIRTY;
+}
+
+static bool expired(buffer_t* buf)
+{
+    return (int32_t)(get_ticks() - buf->dirtied) >= DIRTY_EXPIRE;
+}
+
+static void mark_dirty(buffer_t* buf)
+{
+    if (!(buf->flags & BUF_DIRTY)) {
+        if (!g_dirty_head) {
+            wake_all(&g_flusher_wait);
+        }
+        buf->flags |= BUF_DIRTY;
+        buf->dirtied = get_ticks();
+        dirty_append(buf);
+    }
+}
+
+/*
+ * The oldest dirty buffer (of `dev`, or of any device if NULL)
+ * that can be written back now.
+ */
+static buffer_t* oldest_writable(block_device_t* dev)
+{
+    buffer_t* buf;
+    for (buf = g_dirty_head; buf; buf = buf->dirty_next) {
+        if ((!dev || buf->dev == dev) && writable(buf)) {
+            break;
+        }
+    }
+    return buf;
+}
+
+/*
+ * Done with writing back a buffer (or with trying to). Unwritten
+ * buffers stay dirty; failed ones aren't retried until the next
+ * `bcache_sync` or change.
+ */
+static void end_write(buffer_t* buf, enum wb_result result)
+{
+    buf->flags &= ~BUF_WRITING;
+    if (result != WB_WRITTEN) {
+        mark_dirty(buf);
+    }
+    if (result == WB_FAILED) {
+        buf->flags |= BUF_ERROR;
+    }
+    wake_all(&buf->wait_queue);
+    if (--buf->refcount == 0) {
+        lru_append(buf);
+    }
+}
+
+/* completion callback for a write-back run */
+static void writeback_done(block_request_t* request)
+{
+    struct writeback* wb = request->done_data;
+    bool ok = request->state == BLOCK_REQUEST_COMPLETE && request->ecode >= 0;
+
+    bool iflag = beg_int_atomic();
+    unsigned int i;
+    for (i = 0; i < wb->count; i++) {
+        end_write(wb->bufs[i], ok ? WB_WRITTEN : WB_FAILED);
+    }
+    if (ok) {
+        g_blocks_written += wb->count;
+    } else {
+        g_write_errors++;
+    }
+    if (wb->waiter) {
+        if (!ok) {
+            wb->waiter->error = -1;
+        }
+        if (--wb->waiter->pending == 0) {
+            complete(&wb->waiter->done);
+        }
+    }
+    end_int_atomic(iflag);
+
+    free(wb->data);
+    free(wb);
+}
+
+/*
+ * Start writing back the run of adjacent dirty blocks around
+ * `block` of `dev` with one request.
+ * @returns 0 (also if there's nothing to write), -1 if out of memory
+ */
+static int write_run(block_device_t* dev, unsigned int block,
+        struct wb_wait* waiter)
+{
+    buffer_t* run[WB_MAX_BLOCKS];
+    unsigned int max = dev->max_blocks < WB_MAX_BLOCKS ?
+        dev->max_blocks : WB_MAX_BLOCKS;
+    unsigned int count = 0, i;
+
+    bool iflag = beg_int_atomic();
+    if (writable(hash_find(dev, block))) {
+        unsigned int start = block;
+        while (start > 0 && block - start + 1 < max &&
+                writable(hash_find(dev, start - 1))) {
+            start--;
+        }
+        buffer_t* buf;
+        while (count < max && writable(buf = hash_find(dev, start + count))) {
+            run[count++] = buf;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        buffer_t* buf = run[i];
+        buf->flags = (buf->flags & ~BUF_DIRTY) | BUF_WRITING;
+        dirty_remove(buf);
+        if (buf->refcount++ == 0) {
+            lru_remove(buf);
+        }
+    }
+    end_int_atomic(iflag);
+
+    if (!count) {
+        return 0;
+    }
+
+    struct writeback* wb = malloc(sizeof(*wb) + count * sizeof(buffer_t*));
+    char* data = wb ? malloc(count * dev->blocksize) : NULL;
+    if (!data) {
+        free(wb);
+        iflag = beg_int_atomic();
+        for (i = 0; i < count; i++) {
+            end_write(run[i], WB_NOT_STARTED);
+        }
+        end_int_atomic(iflag);
+        return -1;
+    }
+
+    /* changes from here on make the buffers dirty again */
+    wb->waiter = waiter;
+    wb->count = count;
+    wb->data = data;
+    for (i = 0; i < count; i++) {
+        wb->bufs[i] = run[i];
+        memcpy(data + i * dev->blocksize, run[i]->data, dev->blocksize);
+    }
+
+    if (waiter) {
+        iflag = beg_int_atomic();
+        waiter->pending++;
+        end_int_atomic(iflag);
+    }
+    block_request_init(&wb->request, dev, BLOCK_REQUEST_WRITE,
+            run[0]->block, count, data, writeback_done, wb);
+    block_device_submit(&wb->request);
+    return 0;
+}
+
+/*
+ * Start writing back the oldest dirty blocks (of `dev`, or of any
+ * device if NULL) while more than `keep` bytes are dirty, and
+ * also any that have expired if `expire` is set.
+ * @returns 0, or -1 if out of memory
+ */
+static int write_back(block_device_t* dev, size_t keep, bool expire,
+        struct wb_wait* waiter)
+{
+    for (;;) {
+        bool iflag = beg_int_atomic();
+        buffer_t* buf = oldest_writable(dev);
+        if (!buf || (g_dirty_bytes <= keep && !(expire && expired(buf)))) {
+            end_int_atomic(iflag);
+            return 0;
+        }
+        block_device_t* buf_dev = buf->dev;
+        unsigned int block = buf->block;
+        end_int_atomic(iflag);
+
+        if (write_run(buf_dev, block, waiter) < 0) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Sleep until none of `dev`'s buffers are being written back.
+ * Called with interrupts disabled.
+ */
+static void wait_for_writes(block_device_t* dev)
+{
+    unsigned int b = 0;
+    while (b < BCACHE_BUCKETS) {
+        buffer_t* buf;
+        for (buf = g_buckets[b]; buf; buf = buf->hash_next) {
+            if (buf->dev == dev && (buf->flags & BUF_WRITING)) {
+                break;
+            }
+        }
+        if (buf) {
+            wait(&buf->wait_queue);
+        } else {
+            b++;
+        }
+    }
+}
+
+/*
+ * Note that a buffer's data was changed by its user. It's written
+ * back to the device later; use `bcache_sync` to wait for that.
+ * Doesn't sleep.
+ */
+void bcache_write(buffer_t* buf)
+{
+    KASSERT(buf);
+    KASSERT(buf->refcount > 0);
+    KASSERT(buf->flags & BUF_VALID);
+
+    bool iflag = beg_int_atomic();
+    buf->flags &= ~BUF_ERROR;
+    mark_dirty(buf);
+    end_int_atomic(iflag);
+
+    /* too much dirty data: don't wait for the flusher */
+    write_back(NULL, g_limit / 2, false, NULL);
+}
+
+/*
+ * Write all of a device's dirty blocks, and make the device commit
+ * them to stable storage. Blocks whose write-back failed before are
+ * retried. Writes the flusher starts meanwhile are waited for, and
+ * their errors reported, too. May sleep.
+ * @returns 0 on success, -1 on failure
+ */
+int bcache_sync(block_device_t* dev)
+{
+    KASSERT(dev);
+
+    struct wb_wait waiter;
+    waiter.pending = 1;     /* until everything is submitted */
+    waiter.error = 0;
+    completion_init(&waiter.done);
+
+    bool iflag = beg_int_atomic();
+    buffer_t* buf;
+    for (buf = g_dirty_head; buf; buf = buf->dirty_next) {
+        if (buf->dev == dev) {
+            buf->flags &= ~BUF_ERROR;
+        }
+    }
+    end_int_atomic(iflag);
+
+    /* until none of dev's blocks are dirty or being written,
+     * whoever started writing them */
+    bool more = true;
+    while (more) {
+        if (write_back(dev, 0, false, &waiter) < 0) {
+            waiter.error = -1;
+            break;
+        }
+        iflag = beg_int_atomic();
+        wait_for_writes(dev);
+        more = oldest_writable(dev) != NULL;
+        end_int_atomic(iflag);
+    }
+
+    iflag = beg_int_atomic();
+    if (--waiter.pending == 0) {
+        complete(&waiter.done);
+    }
+    end_int_atomic(iflag);
+    wait_for_completion(&waiter.done);
+
+    /* failed writes stay dirty, marked BUF_ERROR */
+    iflag = beg_int_atomic();
+    for (buf = g_dirty_head; buf; buf = buf->dirty_next) {
+        if (buf->dev == dev && (buf->flags & BUF_ERROR)) {
+            waiter.error = -1;
+        }
+    }
+    end_int_atomic(iflag);
+
+    if (block_device_flush(dev) < 0) {
+        return -1;
+    }
+    return waiter.error;
+}
+
+static void free_request(block_request_t* request)
+{
+    free(request);
+}
+
+/*
+ * Start writing back all of a device's dirty blocks, followed by
+ * a device cache flush, without waiting for them to finish. Whatever is
+ * written to the device afterwards only reaches it once those
+ * blocks are on stable storage. Blocks whose write-back failed
+ * before are retried. Sleeps only while blocks that changed during
+ * an earlier write-back are still being written.
+ * @returns 0, or -1 if out of memory
+ */
+int bcache_barrier(block_device_t* dev)
+{
+    KASSERT(dev);
+
+    bool iflag = beg_int_atomic();
+    buffer_t* buf;
+    for (buf = g_dirty_head; buf; buf = buf->dirty_next) {
+        if (buf->dev == dev && (buf->flags & BUF_WRITING)) {
+            /* changed while being written: the new data follows the old */
+            wait_for_writes(dev);
+            break;
+        }
+    }
+    for (buf = g_dirty_head; buf; buf = buf->dirty_next) {
+        if (buf->dev == dev) {
+            buf->flags &= ~BUF_ERROR;
+        }
+    }
+    end_int_atomic(iflag);
+
+    if (write_back(dev, 0, false, NULL) < 0) {
+        return -1;
+    }
+
+    block_request_t* flush = malloc(sizeof(*flush));
+    if (!flush) {
+        return -1;
+    }
+    block_request_init(flush, dev, BLOCK_REQUEST_FLUSH, 0, 0, NULL,
+            free_request, NULL);
+    block_device_submit(flush);
+    return 0;
+}
+
+static void flusher(uint32_t arg)
+{
+    (void)arg;
+    while (true) {
+        bool iflag = beg_int_atomic();
+        while (!g_dirty_head) {
+            wait(&g_flusher_wait);
+        }
+        end_int_atomic(iflag);
+
+        write_back(NULL, g_limit / 4, true, NULL);
+        sleep(FLUSH_INTERVAL_MS);
+    }
+}
+
+/*
+ * Start the flusher thread.
+ */
+void bcache_init(void)
+{
+    thread_queue_clear(&g_flusher_wait);
+    spawn_thread(flusher, 0, PRIORITY_NORMAL, true);
+}
+
+/*
+ * Drop every unreferenced cached block of a device, e.g. when
+ * its contents changed behind the cache's back. Dirty blocks
+ * are kept (sync them first to have them dropped too).
+ */
+void bcache_invalidate(block_device_t* dev)
+{
+    KASSERT(dev);
+
+    buffer_t* evicted = NULL;
+
+    bool iflag = beg_int_atomic();
+    unsigned int i;
+    for (i = 0; i < RA_STREAMS; i++) {
+        if (g_streams[i].dev == dev) {
+            g_streams[i].dev = NULL;
+        }
+    }
+
+    buffer_t* buf = g_lru_head;
+    while (buf) {
+        buffer_t* next = buf->lru_next;
+        if (buf->dev == dev && !(buf->flags & BUF_DIRTY)) {
+            evict(buf);
+            buf->hash_next = evicted;
+            evicted = buf;
+        }
+        buf = next;
+    }
+    end_int_atomic(iflag);
+
+    free_buffers(evicted);
+}
+
+/*
+ * Set the memory budget for cached block data (in bytes),
+ * evicting buffers if it shrank. Referenced buffers are never
+ * evicted, so the cache may exceed the budget while they're in use.
+ */
+void bcache_set_limit(size_t bytes)
+{
+    bool iflag = beg_int_atomic();
+    g_limit = bytes;
+    buffer_t* evicted = shrink(0);
+    end_int_atomic(iflag);
+
+    free_buffers(evicted);
+}
+
+void bcache_dump_stats(void)
+{
+    dbgprintf("bcache: %u/%u bytes, %u hits, %u misses, %u evictions, "
+            "%u blocks read ahead\n", g_cached_bytes, g_limit, g_hits,
+            g_misses, g_evictions, g_ra_blocks);
+    dbgprintf("bcache: %u bytes dirty, %u blocks written back, "
+            "%u write errors\n", g_dirty_bytes, g_blocks_written,
+            g_write_errors);
+}
@@ -0,0 +1,56 @@
+#ifndef DUNE_BCACHE_H
+#define DUNE_BCACHE_H
+
+#include "dune.h"
+#include "thread.h"
+#include "blkdev.h"
+
+/* buffer flags */
+enum {
+    BUF_VALID = 0x1,    /* data holds the block's contents */
+    BUF_BUSY  = 0x2,    /* being read from the device */
+    BUF_READAHEAD = 0x4,    /* read ahead, not asked for yet */
+    BUF_DIRTY = 0x8,    /* changed since it was last written back */
+    BUF_WRITING = 0x10, /* being written back */
+    BUF_ERROR = 0x20    /* last write-back failed */
+};
+
+/*
+ * A cached copy of one device block. Buffers are shared: everyone
+ * asking for the same block gets the same buffer, which stays in
+ * the cache after the last reference is released, until it's
+ * evicted to make room. Changed buffers are written back to the
+ * device later, and aren't evicted until then.
+ */
+struct buffer {
+    block_device_t* dev;
+    unsigned int block;             /* block number on `dev` */
+    void* data;                     /* dev->blocksize bytes */
+    uint32_t flags;                 /* BUF_* flags */
+    int refcount;                   /* users of the buffer */
+    struct buffer* hash_next;       /* next in hash bucket */
+    struct buffer* lru_prev;        /* unreferenced buffers, least */
+    struct buffer* lru_next;        /*   recently used first */
+    struct buffer* dirty_prev;      /* dirty buffers, least */
+    struct buffer* dirty_next;      /*   recently dirtied first */
+    uint32_t dirtied;               /* tick it became dirty */
+    thread_queue_t wait_queue;      /* threads waiting for a read */
+};
+typedef struct buffer buffer_t;
+
+/* default memory budget for cached block data */
+enum { BCACHE_DEFAULT_LIMIT = 0x20000 };    /* 128KB */
+
+void bcache_init(void);
+
+buffer_t* bcache_read(block_device_t* dev, unsigned int block);
+void bcache_release(buffer_t* buf);
+void bcache_write(buffer_t* buf);
+int bcache_sync(block_device_t* dev);
+int bcache_barrier(block_device_t* dev);
+void bcache_invalidate(block_device_t* dev);
+
+void bcache_set_limit(size_t bytes);
+void bcache_dump_stats(void);
+
+#endif /* DUNE_BCACHE_H */
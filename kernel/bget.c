@@ -403,7 +403,7 @@
 					 how many buffer allocation attempts
 					 the test program should make. */
 
-#define SizeQuant   4		      /* Buffer allocation size quantum:
+#define SizeQuant   8		      /* Buffer allocation size quantum:
 					 all buffers allocated are a
 					 multiple of this size.  This
 					 MUST be a power of two. */
@@ -448,7 +448,6 @@
 #undef BufDump
 #undef BufValid
 #undef DumpData
-#undef BufStats
 #undef FreeWipe
 
 
@@ -2,6 +2,7 @@
 #include "int.h"
 #include "mem.h"
 #include "blkdev.h"
+#include "iosched.h"
 
 static mutex_t block_device_lock;
 
@@ -19,43 +20,54 @@ static void all_devices_add(block_device_t* dev)
     all_devices_tail = dev;
 }
 
-static void all_devices_remove(block_device_t* dev)
+/*
+ * The most physically contiguous pieces a request's memory can
+ * take: one per page each of its segments, or its buffer, touches.
+ */
+static unsigned int request_pieces(block_request_t* request)
 {
-    block_device_t** d = &all_devices_head;
-    while (*d) {
-        if (dev == *d) {
-            *d = (*d)->next;
-            return;
-        }
-        d = &(*d)->next;
+    if (!request->nsegs) {
+        return block_pages(request->buffer,
+                request->block_count * request->device->blocksize);
+    }
+    unsigned int pieces = 0;
+    unsigned int i;
+    for (i = 0; i < request->nsegs; i++) {
+        struct block_seg* seg = &request->segs[i];
+        pieces += block_pages((char*)seg->page + seg->offset, seg->len);
     }
+    return pieces;
 }
 
-static void block_device_push_request(
-        block_device_t* dev,
-        block_request_t* request)
+/*
+ * Queue a request (set up with `block_request_init`) on its device
+ * and return without waiting for it. The device's I/O scheduler may
+ * merge it with a queued request for the adjacent blocks. The
+ * request's memory must stay valid until its completion callback runs.
+ */
+void block_device_submit(block_request_t* request)
 {
-    cli();
+    KASSERT(request);
+    KASSERT(request->device);
+    KASSERT(request->type == BLOCK_REQUEST_FLUSH ||
+            (request->block_count && (request->buffer || request->nsegs)));
+
+    block_device_t* dev = request->device;
+
+    bool iflag = beg_int_atomic();
 
     DEBUG("Pushing block device request\n");
-    if (dev->request_list_head == NULL) {
-        dev->request_list_head = request;
-    } else if (dev->request_list_tail != NULL) {
-        dev->request_list_tail->next = request;
-    }
+    request->state = BLOCK_REQUEST_PENDING;
     request->next = NULL;
-    dev->request_list_tail = request;
+    request->merged = NULL;
+    request->pieces = request_pieces(request);
+    dev->sched->add(dev, request);
+    dev->queued++;
 
     DEBUG("Waking block device requestee(s)\n");
     wake_all(dev->wait_queue);
-    sti();
 
-    cli();
-    while (request->state == BLOCK_REQUEST_PENDING) {
-        DEBUG("Block device request pending\n");
-        wait(&request->wait_queue);
-    }
-    sti();
+    end_int_atomic(iflag);
 }
 
 block_device_t* register_block_device(
@@ -77,6 +89,7 @@ block_device_t* register_block_device(
     strncpy(dev->name, name, MAX_BLOCK_DEV_NAME);
     dev->id = block_device_ids++;
     dev->blocksize = blocksize;
+    dev->blocks = 0;
     dev->driver_data = driver_data;
     dev->ops = ops;
 
@@ -88,8 +101,14 @@ block_device_t* register_block_device(
     dev->wait_queue->head = NULL;
     dev->wait_queue->tail = NULL;
 
-    dev->request_list_head = NULL;
-    dev->request_list_tail = NULL;
+    dev->queued = 0;
+    dev->max_blocks = UINT32_MAX;
+    dev->max_segs = UINT32_MAX;
+    dev->sched = NULL;
+    if (block_device_set_scheduler(dev, &io_sched_deadline) != 0) {
+        DEBUG("Failed to allocate mem for block device request queue\n");
+        return NULL;
+    }
 
     mutex_lock(&block_device_lock);
     all_devices_add(dev);
@@ -122,6 +141,27 @@ block_device_t* block_device_open(const unsigned int id)
     return dev;
 }
 
+/*
+ * Find the block device called `name`, and open it.
+ * @returns the device, or NULL if there's none (or it won't open)
+ */
+block_device_t* open_block_device(const char* name)
+{
+    mutex_lock(&block_device_lock);
+    block_device_t* dev;
+    for (dev = all_devices_head; dev; dev = dev->next) {
+        if (strncmp(dev->name, name, MAX_BLOCK_DEV_NAME) == 0) {
+            break;
+        }
+    }
+    mutex_unlock(&block_device_lock);
+
+    if (dev && dev->ops->open && dev->ops->open(dev) != 0) {
+        return NULL;
+    }
+    return dev;
+}
+
 void block_device_close(block_device_t* dev)
 {
     KASSERT(dev);
@@ -132,72 +172,305 @@ void block_device_close(block_device_t* dev)
     }
 }
 
+/*
+ * Sleep until a request is queued on `dev`, and take the one its
+ * I/O scheduler picks. Its block_count includes any requests merged
+ * into it (up to `dev->max_blocks`).
+ */
 block_request_t* block_device_pop_request(block_device_t* dev)
 {
     cli();
-    while (dev->request_list_head == NULL) {
+    block_request_t* request;
+    while ((request = dev->sched->next(dev)) == NULL) {
         DEBUG("No block requests... device waiting\n");
         wait(dev->wait_queue);
     }
 
     DEBUG("Popping block request\n");
-    block_request_t* request = dev->request_list_head;
-
-    /* actually pop request from linked list */
-    if (dev->request_list_head == dev->request_list_tail) {
-        dev->request_list_head = NULL;
-        dev->request_list_tail = NULL;
-    } else {
-        dev->request_list_head = request->next;
+    block_request_t* r;
+    for (r = request->merged; r; r = r->next) {
+        dev->queued--;
     }
+    dev->queued--;
 
     sti();
 
     return request;
 }
 
-void notify_requester(block_request_t* request, int state, int error)
+/*
+ * Like `block_device_pop_request`, but returns NULL instead of
+ * sleeping when nothing can be dispatched, so a driver can batch
+ * up the requests that are already queued.
+ */
+block_request_t* block_device_try_pop_request(block_device_t* dev)
+{
+    bool iflag = beg_int_atomic();
+    block_request_t* request = dev->sched->next(dev);
+    if (request) {
+        block_request_t* r;
+        for (r = request->merged; r; r = r->next) {
+            dev->queued--;
+        }
+        dev->queued--;
+    }
+    end_int_atomic(iflag);
+
+    return request;
+}
+
+static void finish_request(block_request_t* request, int state, int error)
 {
-    cli();
     request->state = state;
     request->ecode = error;
-    DEBUG("Block request completed, waking requester\n");
-    wake_all(&request->wait_queue);
-    sti();
+    if (request->done) {
+        request->done(request);
+    }
 }
 
-static void init_request(block_request_t* request, block_device_t* dev,
-        int type, unsigned int start, unsigned int count, void* buffer)
+/*
+ * Finish a request, and any requests merged into it: record
+ * the result and run the completion callbacks.
+ * Called by block device drivers.
+ */
+void notify_requester(block_request_t* request, int state, int error)
 {
+    bool iflag = beg_int_atomic();
+    DEBUG("Block request completed\n");
+
+    block_request_t* merged = request->merged;
+    request->merged = NULL;
+    block_request_t* r;
+    for (r = merged; r; r = r->next) {
+        request->block_count -= r->block_count;
+    }
+
+    /* callbacks may free their requests */
+    while (merged) {
+        r = merged;
+        merged = merged->next;
+        finish_request(r, state, error);
+    }
+    finish_request(request, state, error);
+
+    end_int_atomic(iflag);
+}
+
+void block_request_init(block_request_t* request, block_device_t* dev,
+        int type, unsigned int start_block, unsigned int block_count,
+        void* buffer, block_request_done_t done, void* done_data)
+{
+    KASSERT(request);
+
     request->type = type;
     request->state = BLOCK_REQUEST_PENDING;
-    request->block_number = start;
-    request->block_count = count;
+    request->ecode = 0;
+    request->block_number = start_block;
+    request->block_count = block_count;
     request->device = dev;
     request->buffer = buffer;
-    thread_queue_clear(&request->wait_queue);
+    request->segs = NULL;
+    request->nsegs = 0;
+    request->done = done;
+    request->done_data = done_data;
+    request->next = NULL;
+    request->merged = NULL;
+    request->fifo_next = NULL;
+    request->deadline = 0;
 }
 
-void block_device_read(block_device_t* dev, unsigned int start_block,
-        unsigned int block_count, void* buffer)
+/*
+ * Set up a vectored request: its memory is `nsegs` pieces, which
+ * must stay valid (like the array) until it completes. Drivers fail
+ * requests that touch more than `dev->max_segs` pages.
+ */
+void block_request_init_vec(block_request_t* request, block_device_t* dev,
+        int type, unsigned int start_block, struct block_seg* segs,
+        unsigned int nsegs, block_request_done_t done, void* done_data)
+{
+    KASSERT(segs && nsegs);
+
+    unsigned int blocks = 0;
+    unsigned int i;
+    for (i = 0; i < nsegs; i++) {
+        KASSERT(segs[i].len && segs[i].len % dev->blocksize == 0);
+        blocks += segs[i].len / dev->blocksize;
+    }
+
+    block_request_init(request, dev, type, start_block, blocks, NULL,
+            done, done_data);
+    request->segs = segs;
+    request->nsegs = nsegs;
+}
+
+/*
+ * Start walking the memory of a (popped) request.
+ */
+void block_iter_init(struct block_iter* it, block_request_t* request)
+{
+    it->head = request;
+    it->request = request;
+    it->seg = 0;
+    it->addr = NULL;
+    it->bytes = 0;
+
+    if (!request->nsegs) {
+        /* the head's own blocks: merged requests come after them */
+        unsigned int blocks = request->block_count;
+        block_request_t* r;
+        for (r = request->merged; r; r = r->next) {
+            blocks -= r->block_count;
+        }
+        it->addr = request->buffer;
+        it->bytes = blocks * request->device->blocksize;
+        it->seg = 1;
+    }
+}
+
+/*
+ * Take the next piece of a request's memory, of at most `max`
+ * bytes, at `*addr`. Pieces are whole blocks if `max` is.
+ * @returns its length, 0 at the end
+ */
+size_t block_iter_next(struct block_iter* it, void** addr, size_t max)
+{
+    while (!it->bytes) {
+        block_request_t* r = it->request;
+        if (r->nsegs && it->seg < r->nsegs) {
+            struct block_seg* seg = &r->segs[it->seg++];
+            it->addr = (uint8_t*)seg->page + seg->offset;
+            it->bytes = seg->len;
+            continue;
+        }
+
+        /* on to the next merged request */
+        it->request = (r == it->head) ? r->merged : r->next;
+        if (!it->request) {
+            return 0;
+        }
+        r = it->request;
+        it->seg = 0;
+        if (!r->nsegs) {
+            it->addr = r->buffer;
+            it->bytes = r->block_count * r->device->blocksize;
+            it->seg = 1;
+        }
+    }
+
+    size_t bytes = it->bytes < max ? it->bytes : max;
+    *addr = it->addr;
+    it->addr += bytes;
+    it->bytes -= bytes;
+    return bytes;
+}
+
+/*
+ * Like `block_iter_next`, but the piece doesn't cross a page, so
+ * it's physically contiguous.
+ */
+size_t block_iter_next_page(struct block_iter* it, void** addr, size_t max)
+{
+    size_t bytes = block_iter_next(it, addr, max);
+    size_t room = PAGE_SIZE - (uintptr_t)*addr % PAGE_SIZE;
+    if (bytes > room) {
+        block_iter_unget(it, bytes - room);
+        bytes = room;
+    }
+    return bytes;
+}
+
+/*
+ * Hand back the last `bytes` bytes taken from the current piece,
+ * for the next call to return again. A driver that can't fit all
+ * of a request in one command continues from there with the next.
+ */
+void block_iter_unget(struct block_iter* it, size_t bytes)
+{
+    it->addr -= bytes;
+    it->bytes += bytes;
+}
+
+/*
+ * Completion callback that signals the completion_t in `done_data`.
+ */
+void block_request_signal(block_request_t* request)
 {
-    KASSERT(block_count);
-    KASSERT(buffer);
+    complete((completion_t*)request->done_data);
+}
+
+/*
+ * Submit a request and sleep until it's done.
+ * @returns the driver's result code (negative on failure)
+ */
+static int block_device_io(block_device_t* dev, int type,
+        unsigned int start_block, unsigned int block_count, void* buffer)
+{
+    completion_t done;
+    completion_init(&done);
 
     block_request_t request;
-    init_request(&request, dev, BLOCK_REQUEST_READ,
-            start_block, block_count, buffer);
-    block_device_push_request(dev, &request);
+    block_request_init(&request, dev, type, start_block, block_count,
+            buffer, block_request_signal, &done);
+    block_device_submit(&request);
+    wait_for_completion(&done);
+
+    return request.ecode;
 }
 
-void block_device_write(block_device_t* dev, unsigned int start_block,
-        unsigned int block_count, void* buffer)
+static int block_device_iov(block_device_t* dev, int type,
+        unsigned int start_block, struct block_seg* segs, unsigned int nsegs)
 {
-    KASSERT(block_count);
-    KASSERT(buffer);
+    completion_t done;
+    completion_init(&done);
 
     block_request_t request;
-    init_request(&request, dev, BLOCK_REQUEST_WRITE,
+    block_request_init_vec(&request, dev, type, start_block, segs, nsegs,
+            block_request_signal, &done);
+    block_device_submit(&request);
+    wait_for_completion(&done);
+
+    return request.ecode;
+}
+
+int block_device_read(block_device_t* dev, unsigned int start_block,
+        unsigned int block_count, void* buffer)
+{
+    return block_device_io(dev, BLOCK_REQUEST_READ,
             start_block, block_count, buffer);
-    block_device_push_request(dev, &request);
+}
+
+int block_device_write(block_device_t* dev, unsigned int start_block,
+        unsigned int block_count, void* buffer)
+{
+    return block_device_io(dev, BLOCK_REQUEST_WRITE,
+            start_block, block_count, buffer);
+}
+
+/*
+ * Read blocks from `start_block` into the pieces of memory in
+ * `segs`, with one request. May sleep.
+ * @returns the driver's result code (negative on failure)
+ */
+int block_device_readv(block_device_t* dev, unsigned int start_block,
+        struct block_seg* segs, unsigned int nsegs)
+{
+    return block_device_iov(dev, BLOCK_REQUEST_READ, start_block,
+            segs, nsegs);
+}
+
+int block_device_writev(block_device_t* dev, unsigned int start_block,
+        struct block_seg* segs, unsigned int nsegs)
+{
+    return block_device_iov(dev, BLOCK_REQUEST_WRITE, start_block,
+            segs, nsegs);
+}
+
+/*
+ * Make the device commit its write cache to stable storage, after
+ * everything submitted before. May sleep.
+ * @returns the driver's result code (negative on failure)
+ */
+int block_device_flush(block_device_t* dev)
+{
+    return block_device_io(dev, BLOCK_REQUEST_FLUSH, 0, 0, NULL);
 }
@@ -1,6 +1,7 @@
 #ifndef DUNE_BLKDEV_H
 #define DUNE_BLKDEV_H
 
+#include "mem.h"
 #include "thread.h"
 
 enum { MAX_BLOCK_DEV_NAME = 64 };
@@ -8,24 +9,52 @@ enum { BLOCK_SIZE = 512 };
 
 struct block_device_ops;
 struct block_request;
+struct io_scheduler;
 
 struct block_device {
     unsigned int id;            /* unique block device ID */
     unsigned int blocksize;     /* size in bytes of one block */
+    unsigned int blocks;        /* capacity (0 if unknown) */
     char name[MAX_BLOCK_DEV_NAME];  /* name of device */
     void* driver_data;          /* implementation-specific data */
     thread_queue_t* wait_queue; /* queue for request fulfilling thread */
     struct block_device* next;  /* next in linked list */
-    struct block_request* request_list_head;
-    struct block_request* request_list_tail;
+    struct io_scheduler* sched; /* orders/merges queued requests */
+    void* sched_data;           /* the scheduler's request queue */
+    unsigned int queued;        /* requests submitted, not yet popped */
+    unsigned int max_blocks;    /* largest (merged) request for the driver */
+    unsigned int max_segs;      /* most pages a (merged) request may touch */
     struct block_device_ops* ops;
 };
 typedef struct block_device block_device_t;
 
-enum request_type { BLOCK_REQUEST_READ, BLOCK_REQUEST_WRITE };
+/*
+ * A flush request (no blocks) makes the device commit its volatile
+ * write cache. It's also a barrier: requests submitted before it are
+ * served before it, and requests submitted after it, after it.
+ */
+enum request_type { BLOCK_REQUEST_READ, BLOCK_REQUEST_WRITE,
+    BLOCK_REQUEST_FLUSH };
 enum request_state { BLOCK_REQUEST_PENDING, BLOCK_REQUEST_COMPLETE };
 enum request_error { BLOCK_REQUEST_FAIL };
 
+/*
+ * One piece of a vectored request's memory: `len` bytes (a multiple
+ * of the block size) at `offset` into `page`.
+ */
+struct block_seg {
+    void* page;                 /* kernel virtual address */
+    unsigned int offset;
+    unsigned int len;
+};
+
+/*
+ * Called when a block request finishes, by the driver's thread or
+ * interrupt handler with interrupts disabled, so it must not sleep.
+ * The request may be freed or reused from here on.
+ */
+typedef void (*block_request_done_t)(struct block_request* request);
+
 struct block_request {
     int type;                   /* read/write */
     int state;                  /* request's current state */
@@ -34,11 +63,39 @@ struct block_request {
     unsigned int block_count;   /* number of blocks to read/write */
     block_device_t* device;     /* device on which to read/write */
     void* buffer;               /* block read/write source/destination */
-    thread_queue_t wait_queue;  /* queue for the waiting requester */
+    struct block_seg* segs;     /* or, if nsegs, these pieces in order */
+    unsigned int nsegs;
+    block_request_done_t done;  /* completion callback, or NULL */
+    void* done_data;            /* for use by the completion callback */
     struct block_request* next; /* next in linked list */
+
+    /* I/O scheduler state */
+    struct block_request* merged;       /* served along with this one */
+    unsigned int pieces;                /* pages touched, merged included */
+    struct block_request* fifo_next;    /* next in age order */
+    uint32_t deadline;                  /* tick to dispatch it by */
 };
 typedef struct block_request block_request_t;
 
+/* pages touched by `bytes` bytes at `addr` (the most DMA pieces) */
+static inline unsigned int block_pages(const void* addr, size_t bytes)
+{
+    uintptr_t start = (uintptr_t)addr;
+    return bytes ? (start + bytes - 1) / PAGE_SIZE - start / PAGE_SIZE + 1 : 0;
+}
+
+/*
+ * Walks the memory of a request, and of the requests merged into
+ * it, in (virtually) contiguous pieces. See `block_iter_next`.
+ */
+struct block_iter {
+    block_request_t* head;
+    block_request_t* request;   /* whose memory is being walked */
+    unsigned int seg;           /* its next segment */
+    uint8_t* addr;              /* rest of the current piece */
+    size_t bytes;
+};
+
 struct block_device_ops {
     int (*open)(block_device_t* dev);
     int (*close)(block_device_t* dev);
@@ -57,14 +114,34 @@ block_device_t* register_block_device(
 
 block_device_t* open_block_device(const char* name);
 void close_block_device(block_device_t* dev);
-void block_device_read(block_device_t* dev, unsigned int start_block,
+int block_device_read(block_device_t* dev, unsigned int start_block,
         unsigned int block_count, void* buffer);
-void block_device_write(block_device_t* dev, unsigned int start_block,
+int block_device_write(block_device_t* dev, unsigned int start_block,
         unsigned int block_count, void* buffer);
+int block_device_flush(block_device_t* dev);
+int block_device_readv(block_device_t* dev, unsigned int start_block,
+        struct block_seg* segs, unsigned int nsegs);
+int block_device_writev(block_device_t* dev, unsigned int start_block,
+        struct block_seg* segs, unsigned int nsegs);
+
+void block_request_init(block_request_t* request, block_device_t* dev,
+        int type, unsigned int start_block, unsigned int block_count,
+        void* buffer, block_request_done_t done, void* done_data);
+void block_request_init_vec(block_request_t* request, block_device_t* dev,
+        int type, unsigned int start_block, struct block_seg* segs,
+        unsigned int nsegs, block_request_done_t done, void* done_data);
+void block_device_submit(block_request_t* request);
+void block_request_signal(block_request_t* request);
 
 void notify_requester(block_request_t* request, int state, int error);
 block_request_t* block_device_pop_request(
         block_device_t* dev);
         /* , thread_queue_t* requestee_wait_queue); */
+block_request_t* block_device_try_pop_request(block_device_t* dev);
+
+void block_iter_init(struct block_iter* it, block_request_t* request);
+size_t block_iter_next(struct block_iter* it, void** addr, size_t max);
+size_t block_iter_next_page(struct block_iter* it, void** addr, size_t max);
+void block_iter_unget(struct block_iter* it, size_t bytes);
 
 #endif /* DUNE_BLKDEV_H */
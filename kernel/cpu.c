@@ -0,0 +1,106 @@
+#include "cpu.h"
+
+/* CPUID leaf 1 EDX feature flags, filled in by `cpu_init` */
+static uint32_t g_cpu_features;
+
+void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx,
+        uint32_t* ecx, uint32_t* edx)
+{
+    asm volatile("cpuid"
+            : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+            : "0" (leaf));
+}
+
+/*
+ * Query the processor's feature flags.
+ * Must be called before anything that checks `cpu_has_feature`.
+ */
+void cpu_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    /* leaf 0 returns the highest supported leaf in eax */
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 1) {
+        DEBUG("CPUID leaf 1 not supported\n");
+        return;
+    }
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    g_cpu_features = edx;
+    DEBUGF("CPU features: 0x%x\n", g_cpu_features);
+
+    /* allow SSE instructions (used by memcpy/memset) */
+    if (cpu_has_feature(CPUID_FEAT_EDX_FXSR | CPUID_FEAT_EDX_SSE)) {
+        write_cr0((read_cr0() & ~CR0_EM) | CR0_MP);
+        write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    }
+}
+
+bool cpu_has_feature(uint32_t edx_feature)
+{
+    return (g_cpu_features & edx_feature) == edx_feature;
+}
+
+/*
+ * Returns true if running at CPL 3 (e.g. kernel library
+ * code called from a user thread)
+ */
+bool cpu_user_mode(void)
+{
+    uint16_t cs;
+    asm volatile("mov %%cs, %0" : "=r" (cs));
+    return (cs & 3) == 3;
+}
+
+/*
+ * Index of the executing CPU, for per-CPU data.
+ * Always 0 until SMP is supported.
+ */
+unsigned int cpu_id(void)
+{
+    return 0;
+}
+
+uint32_t read_cr0(void)
+{
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0": "=r" (cr0));
+    return cr0;
+}
+
+void write_cr0(uint32_t cr0)
+{
+    asm volatile("mov %0, %%cr0":: "r" (cr0));
+}
+
+uint32_t read_cr2(void)
+{
+    uint32_t cr2;
+    asm volatile("mov %%cr2, %0": "=r" (cr2));
+    return cr2;
+}
+
+uint32_t read_cr3(void)
+{
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0": "=r" (cr3));
+    return cr3;
+}
+
+void write_cr3(uint32_t cr3)
+{
+    asm volatile("mov %0, %%cr3":: "r" (cr3) : "memory");
+}
+
+uint32_t read_cr4(void)
+{
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0": "=r" (cr4));
+    return cr4;
+}
+
+void write_cr4(uint32_t cr4)
+{
+    asm volatile("mov %0, %%cr4":: "r" (cr4) : "memory");
+}
@@ -0,0 +1,50 @@
+#ifndef DUNE_CPU_H
+#define DUNE_CPU_H
+
+#include "dune.h"
+
+/* upper bound on processors for per-CPU data */
+enum { MAX_CPUS = 1 };
+
+/* CPUID leaf 1, EDX feature bits */
+enum {
+    CPUID_FEAT_EDX_FPU  = 1 << 0,
+    CPUID_FEAT_EDX_PSE  = 1 << 3,
+    CPUID_FEAT_EDX_PGE  = 1 << 13,
+    CPUID_FEAT_EDX_FXSR = 1 << 24,
+    CPUID_FEAT_EDX_SSE  = 1 << 25,
+    CPUID_FEAT_EDX_SSE2 = 1 << 26
+};
+
+/* Control register bits */
+#define CR0_PG 0x80000000   /* paging enabled */
+
+enum {
+    CR0_MP = 0x00000002,    /* monitor coprocessor */
+    CR0_EM = 0x00000004     /* x87/SSE emulation (traps all FPU/SSE use) */
+};
+
+enum {
+    CR4_PSE = 0x00000010,       /* 4MB pages */
+    CR4_PGE = 0x00000080,       /* global pages */
+    CR4_OSFXSR = 0x00000200,    /* SSE instructions enabled */
+    CR4_OSXMMEXCPT = 0x00000400 /* unmasked SSE exceptions raise #XM */
+};
+
+void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx,
+        uint32_t* ecx, uint32_t* edx);
+
+void cpu_init(void);
+bool cpu_has_feature(uint32_t edx_feature);
+unsigned int cpu_id(void);
+bool cpu_user_mode(void);
+
+uint32_t read_cr0(void);
+void write_cr0(uint32_t cr0);
+uint32_t read_cr2(void);
+uint32_t read_cr3(void);
+void write_cr3(uint32_t cr3);
+uint32_t read_cr4(void);
+void write_cr4(uint32_t cr4);
+
+#endif /* DUNE_CPU_H */
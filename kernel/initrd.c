@@ -1,35 +1,11 @@
 #include "string.h"
 #include "mem.h"
 #include "blkdev.h"
+#include "iosched.h"
 #include "initrd.h"
 
 block_device_t* ramdisk_device = NULL;
 
-static int test_ramdisk(unsigned int nbytes)
-{
-    /* dumb test */
-    char* buffer1 = malloc(nbytes);
-    char* buffer2 = malloc(nbytes);
-    if (!buffer1 || !buffer2) {
-        kprintf("Malloc error\n");
-        khalt();
-    }
-    memset(buffer1, 0, nbytes);
-    memset(buffer2, 0, nbytes);
-
-    block_device_read(ramdisk_device, 0, nbytes, buffer1);
-
-    unsigned int i = 0;
-    for (i = 0; i < nbytes; i++) {
-        buffer1[i] /= 2;
-    }
-
-    block_device_write(ramdisk_device, 0, nbytes, buffer1);
-    block_device_read(ramdisk_device, 0, nbytes, buffer2);
-
-    return memcmp(buffer1, buffer2, nbytes);
-}
-
 int ramdisk_open(block_device_t* dev)
 {
     (void)dev;
@@ -68,6 +44,30 @@ int ramdisk_write(block_device_t* dev, unsigned int offset,
     return bytes;
 }
 
+/*
+ * Copy a request's blocks (one byte each) piece by piece.
+ * @returns bytes copied, or -1 past the end of the disk
+ */
+static int ramdisk_transfer(block_request_t* request)
+{
+    struct block_iter it;
+    block_iter_init(&it, request);
+
+    unsigned int offset = request->block_number;
+    void* addr;
+    size_t bytes;
+    while ((bytes = block_iter_next(&it, &addr, SIZE_MAX)) > 0) {
+        int rc = (request->type == BLOCK_REQUEST_READ) ?
+            ramdisk_read(request->device, offset, bytes, addr) :
+            ramdisk_write(request->device, offset, bytes, addr);
+        if (rc < 0) {
+            return rc;
+        }
+        offset += bytes;
+    }
+    return offset - request->block_number;
+}
+
 void handle_ramdisk_requests(uint32_t arg)
 {
     (void)arg;
@@ -75,12 +75,11 @@ void handle_ramdisk_requests(uint32_t arg)
         int rc = 0;
         block_request_t* request = block_device_pop_request(ramdisk_device);
 
-        if (request->type == BLOCK_REQUEST_READ) {
-            rc = ramdisk_read(request->device, request->block_number,
-                    request->block_count, request->buffer);
-        } else if (request->type == BLOCK_REQUEST_WRITE) {
-            rc = ramdisk_write(request->device, request->block_number,
-                    request->block_count, request->buffer);
+        if (request->type == BLOCK_REQUEST_READ ||
+                request->type == BLOCK_REQUEST_WRITE) {
+            rc = ramdisk_transfer(request);
+        } else if (request->type == BLOCK_REQUEST_FLUSH) {
+            rc = 0;     /* no write cache */
         } else {
             KASSERT(false);
         }
@@ -105,11 +104,11 @@ block_device_t* ramdisk_init(uintptr_t start, size_t len)
 
     ramdisk_device = register_block_device(
             "initrd", 1, (void*)&ramdisk, &ramdisk_block_device_ops);
+    ramdisk_device->blocks = len;
+    /* nothing to seek, so don't bother sorting */
+    block_device_set_scheduler(ramdisk_device, &io_sched_noop);
 
-    spawn_thread(handle_ramdisk_requests, 0, PRIORITY_NORMAL, true, false);
-
-    unsigned int nbytes = len / 7;
-    KASSERT(test_ramdisk(nbytes) == 0);
+    spawn_thread(handle_ramdisk_requests, 0, PRIORITY_NORMAL, true);
 
     return ramdisk_device;
 }
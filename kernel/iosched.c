@@ -0,0 +1,327 @@
+#include "int.h"
+#include "mem.h"
+#include "timer.h"
+#include "blkdev.h"
+#include "iosched.h"
+
+/*
+ * Can request `b` be served by the same device command as `a`,
+ * i.e. does it continue `a` on disk? The driver walks their memory
+ * piece by piece, so it needn't be contiguous, but it mustn't touch
+ * more than `dev->max_segs` pages.
+ */
+static bool can_merge(block_device_t* dev, block_request_t* a,
+        block_request_t* b)
+{
+    return a->type == b->type &&
+        a->block_number + a->block_count == b->block_number &&
+        a->block_count + b->block_count <= dev->max_blocks &&
+        a->pieces + b->pieces <= dev->max_segs;
+}
+
+/*
+ * Merge request `b` (and anything merged into it) into the end of `a`.
+ * `notify_requester` splits them up again.
+ */
+static void merge(block_request_t* a, block_request_t* b)
+{
+    block_request_t** m = &a->merged;
+    while (*m) {
+        m = &(*m)->next;
+    }
+    *m = b;
+    b->next = b->merged;
+    b->merged = NULL;
+
+    a->block_count += b->block_count;
+    a->pieces += b->pieces;
+}
+
+/* noop scheduler */
+
+struct noop_queue {
+    block_request_t* head;
+    block_request_t* tail;
+};
+
+static void* noop_init(block_device_t* dev)
+{
+    (void)dev;
+    struct noop_queue* q = malloc(sizeof(*q));
+    if (!q) {
+        return NULL;
+    }
+    q->head = NULL;
+    q->tail = NULL;
+    return q;
+}
+
+static void noop_exit(void* queue)
+{
+    free(queue);
+}
+
+static void noop_add(block_device_t* dev, block_request_t* request)
+{
+    struct noop_queue* q = dev->sched_data;
+
+    if (q->tail && can_merge(dev, q->tail, request)) {
+        merge(q->tail, request);
+        return;
+    }
+
+    request->next = NULL;
+    if (q->tail) {
+        q->tail->next = request;
+    } else {
+        q->head = request;
+    }
+    q->tail = request;
+}
+
+static block_request_t* noop_next(block_device_t* dev)
+{
+    struct noop_queue* q = dev->sched_data;
+
+    block_request_t* request = q->head;
+    if (request) {
+        q->head = request->next;
+        if (!q->head) {
+            q->tail = NULL;
+        }
+        request->next = NULL;
+    }
+    return request;
+}
+
+struct io_scheduler io_sched_noop = {
+    "noop",
+    noop_init,
+    noop_exit,
+    noop_add,
+    noop_next
+};
+
+/*
+ * Deadline scheduler: requests are dispatched in ascending block
+ * order, sweeping across the disk in one direction (C-SCAN), which
+ * keeps seeks short. A request that has waited past its deadline
+ * is dispatched first (earliest deadline first), so nothing starves;
+ * reads expire much sooner than writes since a thread is usually
+ * waiting for them. A flush request is dispatched once everything
+ * queued before it is; requests submitted after it are held back
+ * until then.
+ */
+enum {
+    READ_EXPIRE = TICKS_PER_SEC / 2,
+    WRITE_EXPIRE = 5 * TICKS_PER_SEC
+};
+
+struct deadline_queue {
+    block_request_t* sorted;        /* by block number, linked by `next` */
+    block_request_t* fifo[2];       /* reads/writes by age, by `fifo_next` */
+    unsigned int next_block;        /* where the sweep continues */
+    block_request_t* barrier;       /* flush waiting for the above */
+    block_request_t* held;          /* submitted after it, by `next` */
+};
+
+static void* deadline_init(block_device_t* dev)
+{
+    (void)dev;
+    struct deadline_queue* q = malloc(sizeof(*q));
+    if (!q) {
+        return NULL;
+    }
+    q->sorted = NULL;
+    q->fifo[BLOCK_REQUEST_READ] = NULL;
+    q->fifo[BLOCK_REQUEST_WRITE] = NULL;
+    q->next_block = 0;
+    q->barrier = NULL;
+    q->held = NULL;
+    return q;
+}
+
+static void deadline_exit(void* queue)
+{
+    free(queue);
+}
+
+static void sorted_insert(struct deadline_queue* q, block_request_t* request)
+{
+    block_request_t** r = &q->sorted;
+    while (*r && (*r)->block_number <= request->block_number) {
+        r = &(*r)->next;
+    }
+    request->next = *r;
+    *r = request;
+}
+
+static void sorted_remove(struct deadline_queue* q, block_request_t* request)
+{
+    block_request_t** r = &q->sorted;
+    while (*r != request) {
+        r = &(*r)->next;
+    }
+    *r = request->next;
+    request->next = NULL;
+}
+
+/*
+ * Replace `old` with `new` in its FIFO list (or just remove it).
+ */
+static void fifo_replace(struct deadline_queue* q, block_request_t* old,
+        block_request_t* new)
+{
+    block_request_t** r = &q->fifo[old->type];
+    while (*r != old) {
+        r = &(*r)->fifo_next;
+    }
+    if (new) {
+        new->fifo_next = old->fifo_next;
+        new->deadline = old->deadline;
+        *r = new;
+    } else {
+        *r = old->fifo_next;
+    }
+    old->fifo_next = NULL;
+}
+
+static void deadline_add(block_device_t* dev, block_request_t* request)
+{
+    struct deadline_queue* q = dev->sched_data;
+
+    block_request_t* r;
+    if (q->barrier) {
+        block_request_t** h = &q->held;
+        while (*h) {
+            h = &(*h)->next;
+        }
+        request->next = NULL;
+        *h = request;
+        return;
+    }
+    if (request->type == BLOCK_REQUEST_FLUSH) {
+        request->next = NULL;
+        q->barrier = request;
+        return;
+    }
+
+    for (r = q->sorted; r; r = r->next) {
+        if (can_merge(dev, r, request)) {
+            merge(r, request);
+            return;
+        }
+        if (can_merge(dev, request, r)) {
+            /* the new request takes over r's place in line */
+            sorted_remove(q, r);
+            fifo_replace(q, r, request);
+            merge(request, r);
+            sorted_insert(q, request);
+            return;
+        }
+    }
+
+    sorted_insert(q, request);
+
+    request->deadline = get_ticks() +
+        (request->type == BLOCK_REQUEST_READ ? READ_EXPIRE : WRITE_EXPIRE);
+    request->fifo_next = NULL;
+    block_request_t** f = &q->fifo[request->type];
+    while (*f) {
+        f = &(*f)->fifo_next;
+    }
+    *f = request;
+}
+
+static block_request_t* deadline_next(block_device_t* dev)
+{
+    struct deadline_queue* q = dev->sched_data;
+    uint32_t now = get_ticks();
+
+    /* the expired request with the earliest deadline */
+    block_request_t* request = NULL;
+    block_request_t* read = q->fifo[BLOCK_REQUEST_READ];
+    block_request_t* write = q->fifo[BLOCK_REQUEST_WRITE];
+    if (read && (!write || (int32_t)(write->deadline - read->deadline) >= 0)) {
+        request = read;
+    } else {
+        request = write;
+    }
+    if (request && (int32_t)(now - request->deadline) < 0) {
+        request = NULL;
+    }
+
+    /* otherwise continue the sweep, wrapping around at the end */
+    if (!request) {
+        request = q->sorted;
+        while (request && request->block_number < q->next_block) {
+            request = request->next;
+        }
+        if (!request) {
+            request = q->sorted;
+        }
+    }
+    if (!request && q->barrier) {
+        /* everything before the flush is gone: let the rest in */
+        request = q->barrier;
+        block_request_t* held = q->held;
+        q->barrier = NULL;
+        q->held = NULL;
+        while (held) {
+            block_request_t* r = held;
+            held = held->next;
+            deadline_add(dev, r);
+        }
+        return request;
+    }
+    if (!request) {
+        return NULL;
+    }
+
+    sorted_remove(q, request);
+    fifo_replace(q, request, NULL);
+    q->next_block = request->block_number + request->block_count;
+    return request;
+}
+
+struct io_scheduler io_sched_deadline = {
+    "deadline",
+    deadline_init,
+    deadline_exit,
+    deadline_add,
+    deadline_next
+};
+
+/*
+ * Switch a block device to another I/O scheduler.
+ * @returns 0 on success, -1 if out of memory or requests are queued
+ */
+int block_device_set_scheduler(block_device_t* dev,
+        struct io_scheduler* sched)
+{
+    KASSERT(dev);
+    KASSERT(sched);
+
+    void* queue = sched->init(dev);
+    if (!queue) {
+        return -1;
+    }
+
+    bool iflag = beg_int_atomic();
+    if (dev->queued > 0) {
+        end_int_atomic(iflag);
+        sched->exit(queue);
+        return -1;
+    }
+    struct io_scheduler* old = dev->sched;
+    void* old_queue = dev->sched_data;
+    dev->sched = sched;
+    dev->sched_data = queue;
+    end_int_atomic(iflag);
+
+    if (old) {
+        old->exit(old_queue);
+    }
+    DEBUGF("%s: %s I/O scheduler\n", dev->name, sched->name);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef DUNE_IOSCHED_H
+#define DUNE_IOSCHED_H
+
+#include "dune.h"
+#include "blkdev.h"
+
+/*
+ * An I/O scheduler owns the queue of requests submitted to a block
+ * device: it decides which request the driver gets next, and may
+ * merge requests for adjacent blocks into one. Its callbacks are
+ * called with interrupts disabled.
+ */
+struct io_scheduler {
+    const char* name;
+    void* (*init)(block_device_t* dev); /* new queue (NULL: no memory) */
+    void (*exit)(void* queue);          /* free an empty queue */
+    void (*add)(block_device_t* dev, block_request_t* request);
+    block_request_t* (*next)(block_device_t* dev);  /* NULL if empty */
+};
+
+/* FIFO order, merging each request into the one queued before it */
+extern struct io_scheduler io_sched_noop;
+/* block order, with deadlines for reads and writes */
+extern struct io_scheduler io_sched_deadline;
+
+int block_device_set_scheduler(block_device_t* dev,
+        struct io_scheduler* sched);
+
+#endif /* DUNE_IOSCHED_H */
@@ -7,7 +7,9 @@ enum {
     IRQ_TIMER = 0,
     IRQ_KEYBOARD = 1,
     IRQ_RTC = 8,
-    IRQ_MOUSE = 12
+    IRQ_MOUSE = 12,
+    IRQ_ATA_PRIMARY = 14,
+    IRQ_ATA_SECONDARY = 15
 };
 
 void irq_install();
@@ -1,6 +1,7 @@
 #include "util.h"
 #include "screen.h"
 #include "string.h"
+#include "cpu.h"
 #include "gdt.h"
 #include "idt.h"
 #include "irq.h"
@@ -16,13 +17,14 @@
 #include "pci.h"
 #include "blkdev.h"
 #include "initrd.h"
+#include "bcache.h"
+#include "swap.h"
 
 extern uintptr_t g_start, g_code, g_data, g_bss, g_end;
 
 static void print_date(uint32_t arg);
 static void echo_input(uint32_t arg);
 static void hog_cpu(uint32_t arg);
-static void usermode_test(uint32_t arg);
 
 void stat_mouse(uint32_t arg)
 {
@@ -73,6 +75,57 @@ uintptr_t load_mods(struct multiboot_info *mbinfo, struct modinfo *initrd_info)
     return end;
 }
 
+/* the kernel command line's swap=<block device>, e.g. swap=hdb */
+static char g_swap_name[MAX_BLOCK_DEV_NAME];
+
+/*
+ * Pick out the options we know from the kernel command line. Called
+ * before the memory manager can reuse the memory it's in.
+ */
+static void parse_cmdline(struct multiboot_info *mbinfo)
+{
+    if (!(mbinfo->flags & MULTIBOOT_INFO_CMDLINE)) {
+        return;
+    }
+
+    const char* arg = (const char*)phys_to_virt(mbinfo->cmdline);
+    while (*arg) {
+        if (strncmp(arg, "swap=", 5) == 0) {
+            unsigned int i = 0;
+            arg += 5;
+            while (*arg && *arg != ' ' && i + 1 < sizeof(g_swap_name)) {
+                g_swap_name[i++] = *arg++;
+            }
+            g_swap_name[i] = '\0';
+        }
+        while (*arg && *arg != ' ') {
+            arg++;
+        }
+        while (*arg == ' ') {
+            arg++;
+        }
+    }
+}
+
+/*
+ * Swap to all of the block device `name` (what's on it is lost).
+ */
+static void start_swap(const char* name)
+{
+    block_device_t* dev = open_block_device(name);
+    if (!dev || !dev->blocks) {
+        kprintf("No swap device %s\n", name);
+        return;
+    }
+    size_t blocks = dev->blocks;
+    if (blocks > SIZE_MAX / dev->blocksize) {
+        blocks = SIZE_MAX / dev->blocksize;
+    }
+    if (swapon(dev, 0, blocks * dev->blocksize) < 0) {
+        kprintf("Can't swap to %s\n", name);
+    }
+}
+
 void kmain(struct multiboot_info *mbinfo, multiboot_uint32_t mboot_magic)
 {
     /* interrupts are disabled */
@@ -88,6 +141,9 @@ void kmain(struct multiboot_info *mbinfo, multiboot_uint32_t mboot_magic)
     }
 
     bss_init();     /* zero all static data */
+    parse_cmdline(mbinfo);
+    cpu_init();
+    string_init();
     gdt_install();
     kprintf("GDT installed\n");
     idt_install();
@@ -95,13 +151,17 @@ void kmain(struct multiboot_info *mbinfo, multiboot_uint32_t mboot_magic)
     irq_install();
     kprintf("IRQ handlers installed\n");
 
-    struct modinfo initrd_info;
+    struct modinfo initrd_info = { 0, 0 };
     uintptr_t modsend = load_mods(mbinfo, &initrd_info);
     uintptr_t kend = (uintptr_t)(&g_end), kstart = (uintptr_t)(&g_start);
     kend = (modsend > kend) ? modsend : kend;
     kend = mem_init(mbinfo, kstart, kend);
     kprintf("Memory manager and Heap initialized\n");
 
+    /* before the scheduler: thread stacks live in the vmalloc area */
+    paging_install();
+    kprintf("Paging enabled\n");
+
     /* re-enable interrupts */
     sti();
 
@@ -114,18 +174,21 @@ void kmain(struct multiboot_info *mbinfo, multiboot_uint32_t mboot_magic)
     scheduler_init();
     kprintf("Scheduler initialized\n");
 
-    /* if (initrd_info.start || initrd_info.end) { */
-    /*     size_t len = (char*)initrd_info.end - (char*)initrd_info.start; */
-    /*     kprintf("Initializing RAMDisk @ 0x%x (%u bytes)\n", */
-    /*             initrd_info.start, len); */
-    /*     block_device_t* initrd = ramdisk_init(initrd_info.start, len); */
-    /*     (void)initrd; */
-    /* } */
+    bcache_init();
 
-    paging_install();
-    kprintf("Paging enabled\n");
+    if (initrd_info.start || initrd_info.end) {
+        size_t len = (char*)initrd_info.end - (char*)initrd_info.start;
+        kprintf("Initializing RAMDisk @ 0x%x (%u bytes)\n",
+                initrd_info.start, len);
+        block_device_t* initrd = ramdisk_init(initrd_info.start, len);
+        /* the module is a program: demand paged straight from the ramdisk */
+        spawn_program(initrd, len, PRIORITY_NORMAL, true);
+    }
 
     pci_check_all_buses();
+    if (g_swap_name[0]) {
+        start_swap(g_swap_name);
+    }
 
     char *tmp = "Hello World!\n";
     char *new = malloc(strlen(tmp) + 1);
@@ -156,23 +219,20 @@ void kmain(struct multiboot_info *mbinfo, multiboot_uint32_t mboot_magic)
 
     /* test threads - loop infinitely without yielding CPU */
     thread_t *infinite0 = spawn_thread(
-            hog_cpu, 0, PRIORITY_NORMAL, false, false);
+            hog_cpu, 0, PRIORITY_NORMAL, false);
     thread_t *infinite1 = spawn_thread(
-            hog_cpu, 0, PRIORITY_NORMAL, false, false);
+            hog_cpu, 0, PRIORITY_NORMAL, false);
 
     /* start thread to print date/time on screen */
     thread_t* date_printer = spawn_thread(
-            print_date, 0, PRIORITY_NORMAL, false, false);
+            print_date, 0, PRIORITY_NORMAL, false);
 
     /* start thread to read keyboard input and echo it to screen */
     thread_t* echoer = spawn_thread(
-            echo_input, 72, PRIORITY_NORMAL, false, false);
+            echo_input, 72, PRIORITY_NORMAL, false);
 
     thread_t* mouser = spawn_thread(
-            stat_mouse, 0, PRIORITY_NORMAL, false, false);
-
-    thread_t *test = spawn_thread(
-            usermode_test, 5, PRIORITY_NORMAL, false, true);
+            stat_mouse, 0, PRIORITY_NORMAL, false);
 
     /* wait for some thread to finish (forever) */
     join(date_printer);
@@ -213,6 +273,12 @@ void echo_input(uint32_t arg)
         if (kc == 'q') {
             break;
         }
+        if (kc == '`') {
+            /* dump memory statistics to the debug console */
+            mem_dump_stats();
+            bcache_dump_stats();
+            continue;
+        }
         kputc(kc);
     }
     kprintf("\nYou've typed enough!\n");
@@ -224,22 +290,3 @@ static void hog_cpu(uint32_t arg)
     while (true) ;
 }
 
-static void usermode_test(uint32_t arg)
-{
-    uprintf("usermode_test looping %u times...\n", arg);
-
-    unsigned int i = 0;
-    for (i = 0; i < arg; i++) {
-        char *dst = (char*)syscall_malloc(42);
-        strcpy(dst, "hello");
-        syscall_free(dst);
-
-        *(char *)VIDEO_ADDR = '$';
-        *(char *)(VIDEO_ADDR + 1) = WHITE_ON_BLACK;
-
-        /* uprintf("Hello from usermode!\n"); */
-        syscall_print("Hello from usermode!\n");
-
-        syscall_sleep(1000);
-    }
-}
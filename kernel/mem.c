@@ -1,7 +1,10 @@
 #include "int.h"
+#include "cpu.h"
+#include "spinlock.h"
 #include "bget.h"
 #include "string.h"
 #include "mem.h"
+#include "paging.h"
 
 
 static page_t* g_page_array = NULL;
@@ -9,6 +12,79 @@ static page_t* g_page_array = NULL;
 static page_t* g_free_page_head = NULL;
 static page_t* g_free_page_tail = NULL;
 static unsigned int g_free_page_count;
+static unsigned int g_num_pages;
+
+/* pool of allocated pages that have already been zeroed */
+enum { ZEROED_POOL_TARGET = 32 };
+static page_t* g_zeroed_page_head = NULL;
+static unsigned int g_zeroed_page_count;
+
+/* protects the global freelist and zeroed pool */
+static spinlock_t g_page_lock;
+/* protects the global (bget) heap */
+static spinlock_t g_heap_lock;
+
+/*
+ * Per-CPU caches ("magazines") of free pages and small heap buffers.
+ * They are only touched by their own CPU with interrupts disabled,
+ * and exchange MAGAZINE_BATCH items at a time with the global pools.
+ */
+enum { MAGAZINE_SIZE = 16, MAGAZINE_BATCH = 8 };
+
+struct magazine {
+    unsigned int count;
+    void* items[MAGAZINE_SIZE];
+};
+
+/* heap size classes cached per-CPU */
+enum { HEAP_NUM_CLASSES = 6, HEAP_NO_CLASS = 0xFF };
+static const size_t heap_class_sizes[HEAP_NUM_CLASSES] = {
+    16, 32, 64, 128, 256, 512
+};
+
+/* prepended to every heap buffer to find its size class on free() */
+struct heap_header {
+    uint32_t size_class;
+#ifdef MEM_ACCOUNTING
+    uintptr_t caller;       /* allocation site */
+    uint32_t size;          /* requested size */
+#endif
+    uint32_t reserved;      /* keeps buffers 8-byte aligned */
+};
+
+/* page allocator event counters */
+struct page_counters {
+    unsigned int allocs;        /* alloc_page/alloc_zeroed_page */
+    unsigned int zeroed_hits;   /* served from the pre-zeroed pool */
+    unsigned int failures;      /* out of memory */
+    unsigned int frees;         /* pages actually freed */
+};
+
+struct cpu_cache {
+    struct magazine pages;
+    struct magazine heap[HEAP_NUM_CLASSES];
+    struct page_counters counters;
+};
+static struct cpu_cache g_cpu_caches[MAX_CPUS];
+
+#ifdef MEM_ACCOUNTING
+/*
+ * Heap usage per allocation site (malloc's return address),
+ * in an open-addressed hash table. Sites that don't fit are
+ * lumped together under caller 0.
+ */
+enum { ALLOC_SITE_BUCKETS = 256 };
+
+struct alloc_site {
+    uintptr_t caller;
+    unsigned int allocs;        /* total allocations */
+    unsigned int frees;         /* total frees */
+    size_t live_bytes;          /* requested bytes not yet freed */
+};
+static struct alloc_site g_alloc_sites[ALLOC_SITE_BUCKETS];
+static struct alloc_site g_alloc_site_overflow;
+static spinlock_t g_alloc_site_lock;
+#endif /* MEM_ACCOUNTING */
 
 /*
  * Determine if given address is a multiple of the page size.
@@ -59,15 +135,16 @@ static page_t* freelist_get_page()
 
     /* update flag */
     page->flags = PAGE_ALLOC;
-
-    /* if we just emptied the freelist, NULL the head/tail */
-    if (g_free_page_head == g_free_page_tail) {
-        g_free_page_head = NULL;
-        g_free_page_tail = NULL;
-    }
+    page->refcount = 1;
 
     /* move freelist head forward a page */
     g_free_page_head = page->next;
+    page->next = NULL;
+
+    /* if we just emptied the freelist, NULL the tail */
+    if (!g_free_page_head) {
+        g_free_page_tail = NULL;
+    }
     g_free_page_count--;
 
     return page;
@@ -77,6 +154,7 @@ static void freelist_add_page(page_t* page)
 {
     /* update flag */
     page->flags = PAGE_AVAIL;
+    page->next = NULL;
 
     /* if the list head is NULL, set it to this page */
     if (!g_free_page_head) {
@@ -127,6 +205,7 @@ static void mark_page_range(uintptr_t start, uintptr_t end, uint32_t flags)
     for (addr = start; addr < end; addr += PAGE_SIZE) {
         page_t* page = page_from_addr(addr);
         page->flags = flags;
+        page->refcount = 0;
 
         if (flags & PAGE_AVAIL) {
             freelist_add_page(page);
@@ -145,7 +224,14 @@ uintptr_t mem_init(struct multiboot_info *mbinfo, uintptr_t kernstart, uintptr_t
     DEBUGF("Mem low: 0x%x, Mem high: 0x%x\n", mbinfo->mem_lower * 1024, mem_upper);
 
     uint32_t num_pages = mem_upper / PAGE_SIZE;
+    /* only RAM below the vmalloc area is mapped by the kernel */
+    uint32_t max_pages = (VMALLOC_START - KERNEL_VBASE) / PAGE_SIZE;
+    if (num_pages > max_pages) {
+        DEBUGF("Ignoring %u pages past the direct map\n", num_pages - max_pages);
+        num_pages = max_pages;
+    }
     DEBUGF("Number of pages: %u\n", num_pages);
+    g_num_pages = num_pages;
 
     /* align kernel_start down a page because technically the multiboot
      * header sits in front of the kernel's entry point */
@@ -207,16 +293,105 @@ uintptr_t mem_init(struct multiboot_info *mbinfo, uintptr_t kernstart, uintptr_t
     return heap_end;
 }
 
+/*
+ * Number of physical pages tracked by the page allocator
+ */
+unsigned int mem_page_count(void)
+{
+    return g_num_pages;
+}
+
+/*
+ * Take a page from the pre-zeroed pool.
+ * Called with `g_page_lock` held.
+ */
+static page_t* zeroed_pool_get_page(void)
+{
+    KASSERT(!interrupts_enabled());
+
+    page_t* page = g_zeroed_page_head;
+    if (page) {
+        g_zeroed_page_head = page->next;
+        g_zeroed_page_count--;
+        page->next = NULL;
+        KASSERT(page->flags & PAGE_ALLOC);
+        KASSERT(page->refcount == 1);
+    }
+    return page;
+}
+
+static struct cpu_cache* this_cpu_cache(void)
+{
+    KASSERT(!interrupts_enabled());
+    return &g_cpu_caches[cpu_id()];
+}
+
+/*
+ * Move a batch of pages from the global freelist into a
+ * (local, empty) page magazine.
+ */
+static void page_magazine_refill(struct magazine* mag)
+{
+    bool iflag = spin_lock(&g_page_lock);
+    while (mag->count < MAGAZINE_BATCH && g_free_page_count > 0) {
+        page_t* page = freelist_get_page();
+        page->flags = PAGE_CACHED;
+        mag->items[mag->count++] = (void*)addr_from_page(page);
+    }
+    spin_unlock(&g_page_lock, iflag);
+}
+
+/*
+ * Return a batch of pages from a (local, full) page
+ * magazine to the global freelist.
+ */
+static void page_magazine_drain(struct magazine* mag)
+{
+    bool iflag = spin_lock(&g_page_lock);
+    while (mag->count > MAGAZINE_SIZE - MAGAZINE_BATCH) {
+        void* addr = mag->items[--mag->count];
+        freelist_add_page(page_from_addr((uintptr_t)addr));
+    }
+    spin_unlock(&g_page_lock, iflag);
+}
+
+/*
+ * Allocate a page.
+ * The fast path only touches this CPU's page magazine; the global
+ * freelist is locked once per batch of pages.
+ */
 void* alloc_page(void)
 {
     void* addr = NULL;
 
     bool iflag = beg_int_atomic();
 
-    if (g_free_page_count > 0) {
-        page_t* page = freelist_get_page();
-        KASSERT(page->flags & PAGE_ALLOC);
-        addr = (void*)addr_from_page(page);
+    struct magazine* mag = &this_cpu_cache()->pages;
+    if (mag->count == 0) {
+        page_magazine_refill(mag);
+    }
+
+    if (mag->count > 0) {
+        addr = mag->items[--mag->count];
+        page_t* page = page_from_addr((uintptr_t)addr);
+        KASSERT(page->flags & PAGE_CACHED);
+        page->flags = PAGE_ALLOC;
+        page->refcount = 1;
+    } else {
+        /* last resort: pre-zeroed pages are still free pages */
+        bool lflag = spin_lock(&g_page_lock);
+        page_t* page = zeroed_pool_get_page();
+        spin_unlock(&g_page_lock, lflag);
+        if (page) {
+            addr = (void*)addr_from_page(page);
+        }
+    }
+
+    struct page_counters* counters = &this_cpu_cache()->counters;
+    if (addr) {
+        counters->allocs++;
+    } else {
+        counters->failures++;
     }
 
     end_int_atomic(iflag);
@@ -224,18 +399,193 @@ void* alloc_page(void)
     return addr;
 }
 
+/*
+ * Allocate a page filled with zeroes.
+ * Fast path takes a page zeroed ahead of time by `refill_zeroed_pages`,
+ * otherwise the page is zeroed here.
+ */
+void* alloc_zeroed_page(void)
+{
+    bool iflag = spin_lock(&g_page_lock);
+    page_t* page = zeroed_pool_get_page();
+    if (page) {
+        struct page_counters* counters = &this_cpu_cache()->counters;
+        counters->allocs++;
+        counters->zeroed_hits++;
+    }
+    spin_unlock(&g_page_lock, iflag);
+
+    if (page) {
+        return (void*)addr_from_page(page);
+    }
+
+    void* addr = alloc_page();
+    if (addr) {
+        memset(addr, 0, PAGE_SIZE);
+    }
+    return addr;
+}
+
+/*
+ * Zero up to `max` free pages and add them to the pre-zeroed pool,
+ * stopping once the pool is full. Meant to be called when the CPU
+ * has nothing better to do (i.e. from the idle thread).
+ * @returns number of pages zeroed
+ */
+unsigned int refill_zeroed_pages(unsigned int max)
+{
+    unsigned int count = 0;
+
+    while (count < max) {
+        bool iflag = spin_lock(&g_page_lock);
+        if (g_zeroed_page_count >= ZEROED_POOL_TARGET || g_free_page_count == 0) {
+            spin_unlock(&g_page_lock, iflag);
+            break;
+        }
+        page_t* page = freelist_get_page();
+        spin_unlock(&g_page_lock, iflag);
+
+        /* zero outside of the critical section */
+        memset((void*)addr_from_page(page), 0, PAGE_SIZE);
+
+        iflag = spin_lock(&g_page_lock);
+        page->next = g_zeroed_page_head;
+        g_zeroed_page_head = page;
+        g_zeroed_page_count++;
+        spin_unlock(&g_page_lock, iflag);
+
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * Drop a reference to a page, returning it to this CPU's page
+ * magazine once the last reference is gone.
+ */
 void free_page(void* page_addr)
 {
     uintptr_t addr = (uintptr_t)page_addr;
     KASSERT(is_page_aligned(addr));
 
+    page_t* page = page_from_addr(addr);
+    KASSERT(page->flags & PAGE_ALLOC);
+    KASSERT(page->refcount > 0);
+    if (__sync_sub_and_fetch(&page->refcount, 1) > 0) {
+        return;
+    }
+
     bool iflag = beg_int_atomic();
 
+    page->flags = PAGE_CACHED;
+    struct magazine* mag = &this_cpu_cache()->pages;
+    if (mag->count == MAGAZINE_SIZE) {
+        page_magazine_drain(mag);
+    }
+    mag->items[mag->count++] = page_addr;
+    this_cpu_cache()->counters.frees++;
+
+    end_int_atomic(iflag);
+}
+
+/*
+ * Take another reference to an allocated page
+ * (e.g. when sharing it copy-on-write)
+ */
+void get_page(void* page_addr)
+{
+    uintptr_t addr = (uintptr_t)page_addr;
+    KASSERT(is_page_aligned(addr));
+
     page_t* page = page_from_addr(addr);
     KASSERT(page->flags & PAGE_ALLOC);
-    freelist_add_page(page);
+    __sync_add_and_fetch(&page->refcount, 1);
+}
 
-    end_int_atomic(iflag);
+unsigned int page_refcount(void* page_addr)
+{
+    page_t* page = page_from_addr((uintptr_t)page_addr);
+    return page->refcount;
+}
+
+/*
+ * Allocate HUGE_PAGE_SIZE bytes of physically contiguous memory,
+ * aligned to HUGE_PAGE_SIZE, e.g. to back a 4MB page mapping.
+ * This scans the whole page array for a run of pages on the global
+ * freelist, so it's slow and fails once memory is fragmented.
+ * @returns NULL if there is no free run
+ */
+void* alloc_huge_page(void)
+{
+    bool iflag = spin_lock(&g_page_lock);
+    struct cpu_cache* cache = this_cpu_cache();
+
+    /* pages cached in this CPU's magazine would break up runs */
+    while (cache->pages.count > 0) {
+        void* addr = cache->pages.items[--cache->pages.count];
+        freelist_add_page(page_from_addr((uintptr_t)addr));
+    }
+
+    unsigned int first, i = 0;
+    for (first = 0; first + HUGE_PAGE_PAGES <= g_num_pages; first += HUGE_PAGE_PAGES) {
+        for (i = 0; i < HUGE_PAGE_PAGES; i++) {
+            if (g_page_array[first + i].flags != PAGE_AVAIL) {
+                break;
+            }
+        }
+        if (i == HUGE_PAGE_PAGES) {
+            break;
+        }
+    }
+    if (i != HUGE_PAGE_PAGES) {
+        cache->counters.failures++;
+        spin_unlock(&g_page_lock, iflag);
+        return NULL;
+    }
+
+    /* unlink the run from the freelist */
+    page_t* run = &g_page_array[first];
+    page_t** p = &g_free_page_head;
+    g_free_page_tail = NULL;
+    while (*p) {
+        page_t* page = *p;
+        if (page >= run && page < run + HUGE_PAGE_PAGES) {
+            *p = page->next;
+            page->next = NULL;
+            page->flags = PAGE_ALLOC;
+            page->refcount = 1;
+            g_free_page_count--;
+        } else {
+            g_free_page_tail = page;
+            p = &page->next;
+        }
+    }
+
+    cache->counters.allocs++;
+    spin_unlock(&g_page_lock, iflag);
+
+    return (void*)addr_from_page(run);
+}
+
+/*
+ * Free memory returned by `alloc_huge_page`.
+ */
+void free_huge_page(void* addr)
+{
+    KASSERT(((uintptr_t)addr - KERNEL_VBASE) % HUGE_PAGE_SIZE == 0);
+
+    bool iflag = spin_lock(&g_page_lock);
+    page_t* run = page_from_addr((uintptr_t)addr);
+    unsigned int i;
+    for (i = 0; i < HUGE_PAGE_PAGES; i++) {
+        KASSERT(run[i].flags & PAGE_ALLOC);
+        KASSERT(run[i].refcount == 1);
+        run[i].refcount = 0;
+        freelist_add_page(&run[i]);
+    }
+    this_cpu_cache()->counters.frees++;
+    spin_unlock(&g_page_lock, iflag);
 }
 
 void bss_init(void)
@@ -250,6 +600,116 @@ void bss_init(void)
     memset((void*)bss_start, 0, bss_end - bss_start);
 }
 
+/*
+ * Returns the smallest heap size class that fits `size` bytes,
+ * or HEAP_NO_CLASS if it's too large to be cached
+ */
+static unsigned int heap_size_class(size_t size)
+{
+    unsigned int cls;
+    for (cls = 0; cls < HEAP_NUM_CLASSES; cls++) {
+        if (size <= heap_class_sizes[cls]) {
+            return cls;
+        }
+    }
+    return HEAP_NO_CLASS;
+}
+
+#ifdef MEM_ACCOUNTING
+static struct alloc_site* find_alloc_site(uintptr_t caller)
+{
+    unsigned int hash = (caller >> 2) % ALLOC_SITE_BUCKETS;
+    unsigned int i;
+    for (i = 0; i < ALLOC_SITE_BUCKETS; i++) {
+        struct alloc_site* site = &g_alloc_sites[(hash + i) % ALLOC_SITE_BUCKETS];
+        if (site->caller == caller) {
+            return site;
+        }
+        if (site->caller == 0) {
+            site->caller = caller;
+            return site;
+        }
+    }
+    return &g_alloc_site_overflow;
+}
+
+/*
+ * Charge (or credit, on free) a buffer to its allocation site.
+ */
+static void account_heap(struct heap_header* hdr, bool alloc)
+{
+    bool iflag = spin_lock(&g_alloc_site_lock);
+    struct alloc_site* site = find_alloc_site(hdr->caller);
+    if (alloc) {
+        site->allocs++;
+        site->live_bytes += hdr->size;
+    } else {
+        site->frees++;
+        site->live_bytes -= hdr->size;
+    }
+    spin_unlock(&g_alloc_site_lock, iflag);
+}
+#endif /* MEM_ACCOUNTING */
+
+/*
+ * Allocate a buffer from the global heap.
+ * Called with `g_heap_lock` held.
+ */
+static void* heap_alloc(size_t size, unsigned int cls)
+{
+    struct heap_header* hdr = bget(size + sizeof(*hdr));
+    if (!hdr) {
+        return NULL;
+    }
+    hdr->size_class = cls;
+    return hdr + 1;
+}
+
+/*
+ * Return a buffer to the global heap.
+ * Called with `g_heap_lock` held.
+ */
+static void heap_release(void* buffer)
+{
+    struct heap_header* hdr = (struct heap_header*)buffer - 1;
+    brel(hdr);
+}
+
+/*
+ * Allocate a batch of buffers of size class `cls` from the
+ * global heap into a (local, empty) heap magazine.
+ */
+static void heap_magazine_refill(struct magazine* mag, unsigned int cls)
+{
+    bool iflag = spin_lock(&g_heap_lock);
+    while (mag->count < MAGAZINE_BATCH) {
+        void* buffer = heap_alloc(heap_class_sizes[cls], cls);
+        if (!buffer) {
+            break;
+        }
+        mag->items[mag->count++] = buffer;
+    }
+    spin_unlock(&g_heap_lock, iflag);
+}
+
+/*
+ * Release a batch of buffers from a (local, full) heap
+ * magazine to the global heap.
+ */
+static void heap_magazine_drain(struct magazine* mag)
+{
+    bool iflag = spin_lock(&g_heap_lock);
+    while (mag->count > MAGAZINE_SIZE - MAGAZINE_BATCH) {
+        heap_release(mag->items[--mag->count]);
+    }
+    spin_unlock(&g_heap_lock, iflag);
+}
+
+/*
+ * Allocate a buffer of at least `size` bytes.
+ * Small sizes are served from this CPU's heap magazines, so the
+ * global heap is only locked once per batch of buffers.
+ */
 void* malloc(size_t size)
 {
     void *buffer = NULL;
@@ -257,9 +717,31 @@ void* malloc(size_t size)
 
     KASSERT(size > 0);
 
-    iflag = beg_int_atomic();
-    buffer = bget(size);
-    end_int_atomic(iflag);
+    unsigned int cls = heap_size_class(size);
+    if (cls == HEAP_NO_CLASS) {
+        iflag = spin_lock(&g_heap_lock);
+        buffer = heap_alloc(size, HEAP_NO_CLASS);
+        spin_unlock(&g_heap_lock, iflag);
+    } else {
+        iflag = beg_int_atomic();
+        struct magazine* mag = &this_cpu_cache()->heap[cls];
+        if (mag->count == 0) {
+            heap_magazine_refill(mag, cls);
+        }
+        if (mag->count > 0) {
+            buffer = mag->items[--mag->count];
+        }
+        end_int_atomic(iflag);
+    }
+
+#ifdef MEM_ACCOUNTING
+    if (buffer) {
+        struct heap_header* hdr = (struct heap_header*)buffer - 1;
+        hdr->caller = (uintptr_t)__builtin_return_address(0);
+        hdr->size = size;
+        account_heap(hdr, true);
+    }
+#endif
 
     return buffer;
 }
@@ -268,22 +750,88 @@ void free(void *buffer)
 {
     bool iflag;
 
+    KASSERT(buffer);
+
+    struct heap_header* hdr = (struct heap_header*)buffer - 1;
+#ifdef MEM_ACCOUNTING
+    account_heap(hdr, false);
+#endif
+    unsigned int cls = hdr->size_class;
+    if (cls == HEAP_NO_CLASS) {
+        iflag = spin_lock(&g_heap_lock);
+        heap_release(buffer);
+        spin_unlock(&g_heap_lock, iflag);
+        return;
+    }
+    KASSERT(cls < HEAP_NUM_CLASSES);
+
     iflag = beg_int_atomic();
-    brel(buffer);
+    struct magazine* mag = &this_cpu_cache()->heap[cls];
+    if (mag->count == MAGAZINE_SIZE) {
+        heap_magazine_drain(mag);
+    }
+    mag->items[mag->count++] = buffer;
     end_int_atomic(iflag);
 }
 
+/*
+ * Print page allocator and heap statistics to the debug console,
+ * plus heap usage per allocation site if built with MEM_ACCOUNTING.
+ */
+void mem_dump_stats(void)
+{
+    struct page_counters total = { 0, 0, 0, 0 };
+    unsigned int cached = 0;
+    unsigned int cpu;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct cpu_cache* cache = &g_cpu_caches[cpu];
+        total.allocs += cache->counters.allocs;
+        total.zeroed_hits += cache->counters.zeroed_hits;
+        total.failures += cache->counters.failures;
+        total.frees += cache->counters.frees;
+        cached += cache->pages.count;
+    }
+
+    dbgprintf("pages: %u total, %u free, %u in magazines, %u pre-zeroed\n",
+            g_num_pages, g_free_page_count, cached, g_zeroed_page_count);
+    dbgprintf("pages: %u allocs (%u pre-zeroed), %u frees, %u failures\n",
+            total.allocs, total.zeroed_hits, total.frees, total.failures);
+
+    bufsize curalloc, totfree, maxfree;
+    long nget, nrel;
+    bool iflag = spin_lock(&g_heap_lock);
+    bstats(&curalloc, &totfree, &maxfree, &nget, &nrel);
+    spin_unlock(&g_heap_lock, iflag);
+    dbgprintf("heap: %u allocated, %u free (largest %u), %u gets, %u rels\n",
+            curalloc, totfree, maxfree, nget, nrel);
+
+#ifdef MEM_ACCOUNTING
+    iflag = spin_lock(&g_alloc_site_lock);
+    unsigned int i;
+    for (i = 0; i <= ALLOC_SITE_BUCKETS; i++) {
+        struct alloc_site* site = (i < ALLOC_SITE_BUCKETS) ?
+                &g_alloc_sites[i] : &g_alloc_site_overflow;
+        if (site->allocs == 0) {
+            continue;
+        }
+        dbgprintf("  site 0x%x: %u bytes live, %u allocs, %u frees\n",
+                site->caller, site->live_bytes, site->allocs, site->frees);
+    }
+    spin_unlock(&g_alloc_site_lock, iflag);
+#endif /* MEM_ACCOUNTING */
+}
+
 void dumpmem(uintptr_t start, size_t bytes)
 {
     if (bytes > 256) bytes = 256;
     DEBUGF("Dump mem: 0x%x (%u bytes)\n", start, bytes);
     char *ptr = (char*)start;
     unsigned int i;
-    for (i = 0; i < bytes / 16; i++) {
+    for (i = 0; i < bytes / 16; i++, ptr += 16) {
         DEBUGF("%02x%02x %02x%02x %02x%02x %02x%02x %02x%02x %02x%02x %02x%02x %02x%02x\n",
-                *ptr++ & 0xFF, *ptr++ & 0xFF, *ptr++ & 0xFF, *ptr++ & 0xFF,
-                *ptr++ & 0xFF, *ptr++ & 0xFF, *ptr++ & 0xFF, *ptr++ & 0xFF,
-                *ptr++ & 0xFF, *ptr++ & 0xFF, *ptr++ & 0xFF, *ptr++ & 0xFF,
-                *ptr++ & 0xFF, *ptr++ & 0xFF, *ptr++ & 0xFF, *ptr++ & 0xFF);
+                ptr[0] & 0xFF, ptr[1] & 0xFF, ptr[2] & 0xFF, ptr[3] & 0xFF,
+                ptr[4] & 0xFF, ptr[5] & 0xFF, ptr[6] & 0xFF, ptr[7] & 0xFF,
+                ptr[8] & 0xFF, ptr[9] & 0xFF, ptr[10] & 0xFF, ptr[11] & 0xFF,
+                ptr[12] & 0xFF, ptr[13] & 0xFF, ptr[14] & 0xFF, ptr[15] & 0xFF);
     }
 }
@@ -25,11 +25,20 @@ enum {
     PAGE_HDWARE = 0x4,  /* page used by hardware (ISA hole) */
     PAGE_ALLOC  = 0x8,  /* page allocated */
     PAGE_UNUSED = 0x10, /* page unused */
-    PAGE_HEAP   = 0x20  /* page in kernel heap */
+    PAGE_HEAP   = 0x20, /* page in kernel heap */
+    PAGE_CACHED = 0x40  /* free page in a per-CPU magazine */
+};
+
+/* 4MB pages (see alloc_huge_page) */
+enum {
+    HUGE_PAGE_POWER = 22,
+    HUGE_PAGE_SIZE = 1 << HUGE_PAGE_POWER,
+    HUGE_PAGE_PAGES = HUGE_PAGE_SIZE / PAGE_SIZE
 };
 
 struct page {
     uint32_t flags;
+    unsigned int refcount;  /* mappings/owners of an allocated page */
     struct page *next;
 };
 typedef struct page page_t;
@@ -38,16 +47,24 @@ typedef struct page page_t;
 uintptr_t mem_init(struct multiboot_info *mbinfo,
         uintptr_t kernstart, uintptr_t kernend);
 void bss_init(void);
+unsigned int mem_page_count(void);
 
 uintptr_t page_align_up(uintptr_t addr);
 uintptr_t page_align_down(uintptr_t addr);
 
 void* alloc_page(void);
+void* alloc_zeroed_page(void);
+unsigned int refill_zeroed_pages(unsigned int max);
 void free_page(void* page_addr);
+void get_page(void* page_addr);
+unsigned int page_refcount(void* page_addr);
+void* alloc_huge_page(void);
+void free_huge_page(void* addr);
 
 void* malloc(size_t size);
 void free(void *buffer);
 
+void mem_dump_stats(void);
 void dumpmem(uintptr_t start, size_t bytes);
 
 #endif /* DUNE_MEM_H */
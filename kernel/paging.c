@@ -1,7 +1,30 @@
 #include "mem.h"
 #include "x86.h"
+#include "cpu.h"
+#include "string.h"
+#include "vm.h"
 #include "paging.h"
 #include "idt.h"
+#include "thread.h"
+#include "int.h"
+
+/* set once CR4.PGE is enabled, so kernel mappings can be marked global */
+static bool g_global_pages;
+
+/* set once CR4.PSE is enabled, so user memory can use 4MB pages */
+static bool g_huge_pages;
+
+/* page directory built by `paging_install`, used by all kernel threads */
+static uint32_t* g_kernel_page_dir;
+
+/* first page directory index of the kernel half */
+enum { KERNEL_PDE_START = KERNEL_VBASE >> PDE_SHIFT };
+
+/* page directory indices covering the vmalloc area */
+enum {
+    VMALLOC_PDE_START = VMALLOC_START >> PDE_SHIFT,
+    VMALLOC_PDE_END = (VMALLOC_START + VMALLOC_SIZE) >> PDE_SHIFT
+};
 
 uintptr_t phys_to_virt(uintptr_t phys)
 {
@@ -13,10 +36,70 @@ uintptr_t virt_to_phys(uintptr_t virt)
     return virt - KERNEL_VBASE;
 }
 
+/*
+ * Physical address behind a kernel virtual address, direct-mapped
+ * or vmalloc'd (e.g. to hand a buffer to a DMA engine).
+ * @returns 0 if it isn't mapped
+ */
+uintptr_t kernel_virt_to_phys(uintptr_t virt)
+{
+    if (virt >= KERNEL_VBASE && virt < VMALLOC_START) {
+        return virt_to_phys(virt);
+    }
+    if (virt < VMALLOC_START) {
+        return 0;
+    }
+
+    uint32_t* pte = paging_get_pte(kernel_page_directory(), virt, false);
+    if (!pte || !(*pte & PTE_PRESENT)) {
+        return 0;
+    }
+    return (*pte & PAGE_MASK) | (virt & ~PAGE_MASK);
+}
+
+/*
+ * Invalidate the TLB entry for a single page.
+ * Use this after changing any kernel mapping, since global
+ * entries survive a CR3 reload.
+ */
+void tlb_invalidate_page(uintptr_t vaddr)
+{
+    asm volatile("invlpg (%0)" :: "r" (vaddr) : "memory");
+}
+
+/*
+ * Flush all non-global TLB entries by reloading CR3.
+ */
+void tlb_flush(void)
+{
+    write_cr3(read_cr3());
+}
+
+/*
+ * Flush every TLB entry, including global kernel entries,
+ * by toggling CR4.PGE.
+ */
+void tlb_flush_global(void)
+{
+    if (!g_global_pages) {
+        tlb_flush();
+        return;
+    }
+
+    uint32_t cr4 = read_cr4();
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
+}
+
 void page_fault_handler(struct regs *regs)
 {
-    uintptr_t fault_addr;
-    asm volatile("mov %%cr2, %0" : "=r" (fault_addr));
+    uintptr_t fault_addr = read_cr2();
+
+    /* most faults are resolved against the current address space's
+     * regions: zero-fill, stack growth and device-backed pages */
+    if (vm_handle_fault(fault_addr, regs->err_code) == 0) {
+        return;
+    }
 
     int present = !(regs->err_code & 0x1);
     int rw = regs->err_code & 0x2;
@@ -30,11 +113,335 @@ void page_fault_handler(struct regs *regs)
     if (us) { kprintf("user-mode "); }
     if (reserved) { kprintf("reserved "); }
     kprintf(") at 0x%X\n", fault_addr);
+
+    /* a user thread touching memory it doesn't own is killed,
+     * a kernel bug still freezes the system */
+    if (us) {
+        exit(-1);
+    }
     khalt();
 }
 
+/*
+ * Create a new page directory with an empty user half and
+ * the kernel half shared with the kernel's page directory.
+ * @returns NULL if out of memory
+ */
+uint32_t* page_directory_create(void)
+{
+    KASSERT(g_kernel_page_dir);
+
+    uint32_t* dir = alloc_page();
+    if (!dir) {
+        return NULL;
+    }
+
+    unsigned int pde;
+    for (pde = 0; pde < KERNEL_PDE_START; pde++) {
+        dir[pde] = 0 | 6;   /* usermode level, read/write, not present */
+    }
+    for (pde = KERNEL_PDE_START; pde < PDES_PER_DIR; pde++) {
+        dir[pde] = g_kernel_page_dir[pde];
+    }
+
+    return dir;
+}
+
+/*
+ * Free a page directory and any user-half page tables it owns.
+ * The shared kernel page tables are left alone.
+ */
+void page_directory_destroy(uint32_t* dir)
+{
+    KASSERT(dir);
+    KASSERT(dir != g_kernel_page_dir);
+
+    unsigned int pde;
+    for (pde = 0; pde < KERNEL_PDE_START; pde++) {
+        /* huge pages belong to whoever mapped them */
+        if ((dir[pde] & PTE_PRESENT) && !(dir[pde] & PDE_HUGE)) {
+            free_page((void*)phys_to_virt(dir[pde] & PAGE_MASK));
+        }
+    }
+
+    free_page(dir);
+}
+
+/*
+ * Find the page table entry mapping `vaddr` in page directory `dir`.
+ * If `create` is set, a missing user page table is allocated.
+ * @returns NULL if there is no page table (or out of memory),
+ * or if `vaddr` is mapped by a huge page
+ */
+uint32_t* paging_get_pte(uint32_t* dir, uintptr_t vaddr, bool create)
+{
+    KASSERT(dir);
+
+    unsigned int pde = vaddr >> PDE_SHIFT;
+    unsigned int pte = (vaddr >> PAGE_POWER) & (PTES_PER_TABLE - 1);
+
+    if (dir[pde] & PDE_HUGE) {
+        return NULL;
+    }
+
+    if (!(dir[pde] & PTE_PRESENT)) {
+        /* kernel page tables all exist from boot */
+        if (!create || pde >= KERNEL_PDE_START) {
+            return NULL;
+        }
+
+        uint32_t* table = alloc_zeroed_page();
+        if (!table) {
+            return NULL;
+        }
+        dir[pde] = virt_to_phys((uintptr_t)table) | PTE_USER | PTE_WRITE | PTE_PRESENT;
+    }
+
+    uint32_t* table = (uint32_t*)phys_to_virt(dir[pde] & PAGE_MASK);
+    return &table[pte];
+}
+
+/*
+ * Does changing `vaddr` in `dir` require a TLB invalidation?
+ * Kernel-half tables are shared by every page directory; user
+ * entries only matter in the page directory currently loaded.
+ */
+static bool needs_invalidate(uint32_t* dir, uintptr_t vaddr)
+{
+    return vaddr >= KERNEL_VBASE || read_cr3() == virt_to_phys((uintptr_t)dir);
+}
+
+void tlb_batch_init(struct tlb_batch* batch, uint32_t* dir)
+{
+    KASSERT(batch);
+    KASSERT(dir);
+
+    batch->dir = dir;
+    batch->count = 0;
+    batch->global = false;
+}
+
+/*
+ * Queue the TLB entry for `vaddr` (in the batch's page directory)
+ * for invalidation by `tlb_batch_flush`.
+ */
+void tlb_batch_add(struct tlb_batch* batch, uintptr_t vaddr)
+{
+    if (!needs_invalidate(batch->dir, vaddr)) {
+        return;
+    }
+    if (batch->count < TLB_BATCH_SIZE) {
+        batch->pages[batch->count] = vaddr;
+    }
+    batch->count++;
+    if (vaddr >= KERNEL_VBASE) {
+        batch->global = true;
+    }
+}
+
+/*
+ * Invalidate every queued TLB entry: one INVLPG each, or a single
+ * full flush if more than TLB_BATCH_SIZE pages were queued.
+ */
+void tlb_batch_flush(struct tlb_batch* batch)
+{
+    if (batch->count > TLB_BATCH_SIZE) {
+        if (batch->global) {
+            tlb_flush_global();
+        } else {
+            tlb_flush();
+        }
+    } else {
+        unsigned int i;
+        for (i = 0; i < batch->count; i++) {
+            tlb_invalidate_page(batch->pages[i]);
+        }
+    }
+    batch->count = 0;
+    batch->global = false;
+}
+
+/*
+ * Map the page at `vaddr` in page directory `dir` to physical
+ * page `phys`, replacing any existing mapping. `flags` are PTE_*
+ * bits, PTE_PRESENT is implied. A missing user page table is
+ * allocated; kernel page tables all exist from boot.
+ * @returns 0 on success, -1 if out of memory
+ */
+int map_page(uint32_t* dir, uintptr_t vaddr, uintptr_t phys, uint32_t flags)
+{
+    KASSERT(dir);
+
+    bool iflag = beg_int_atomic();
+    uint32_t* pte = paging_get_pte(dir, vaddr, true);
+    if (!pte) {
+        end_int_atomic(iflag);
+        return -1;
+    }
+
+    if (vaddr >= KERNEL_VBASE && g_global_pages) {
+        flags |= PTE_GLOBAL;
+    }
+    uint32_t old = *pte;
+    *pte = (phys & PAGE_MASK) | (flags & PTE_FLAGS_MASK) | PTE_PRESENT;
+
+    /* a non-present entry is never cached */
+    if ((old & PTE_PRESENT) && needs_invalidate(dir, vaddr)) {
+        tlb_invalidate_page(vaddr);
+    }
+    end_int_atomic(iflag);
+    return 0;
+}
+
+/*
+ * Remove the mapping of the page at `vaddr` in page directory `dir`.
+ * @returns the old page table entry, 0 if there was none
+ */
+uint32_t unmap_page(uint32_t* dir, uintptr_t vaddr)
+{
+    KASSERT(dir);
+
+    bool iflag = beg_int_atomic();
+    uint32_t* pte = paging_get_pte(dir, vaddr, false);
+    uint32_t old = 0;
+    if (pte) {
+        old = *pte;
+        *pte = 0;
+        if ((old & PTE_PRESENT) && needs_invalidate(dir, vaddr)) {
+            tlb_invalidate_page(vaddr);
+        }
+    }
+    end_int_atomic(iflag);
+    return old;
+}
+
+/*
+ * Change the protection (PTE_WRITE, PTE_USER and PTE_COW bits) of
+ * every present page in [start, end) of page directory `dir` to `flags`.
+ * Missing pages are skipped. Changed entries are invalidated as
+ * one batch.
+ */
+void protect_range(uint32_t* dir, uintptr_t start, uintptr_t end, uint32_t flags)
+{
+    KASSERT(dir);
+    KASSERT(start == page_align_down(start));
+    KASSERT(start <= end);
+
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, dir);
+    flags &= PTE_PROT_MASK;
+
+    bool iflag = beg_int_atomic();
+    uintptr_t addr = start;
+    while (addr < end) {
+        uint32_t* pte = paging_get_pte(dir, addr, false);
+        if (!pte) {
+            /* skip the rest of the missing page table */
+            uintptr_t next = (addr | ((1 << PDE_SHIFT) - 1)) + 1;
+            if (next < addr) {
+                break;
+            }
+            addr = next;
+            continue;
+        }
+
+        if ((*pte & PTE_PRESENT) && (*pte & PTE_PROT_MASK) != flags) {
+            *pte = (*pte & ~PTE_PROT_MASK) | flags;
+            tlb_batch_add(&batch, addr);
+        }
+        addr += PAGE_SIZE;
+        if (addr == 0) {
+            break;
+        }
+    }
+    tlb_batch_flush(&batch);
+    end_int_atomic(iflag);
+}
+
+bool paging_huge_pages(void)
+{
+    return g_huge_pages;
+}
+
+/*
+ * Map the 4MB user page at `vaddr` in page directory `dir` to
+ * physical memory `phys` (see alloc_huge_page). An empty page table
+ * covering `vaddr` is freed, one still in use makes this fail.
+ * `flags` are PTE_* bits, PTE_PRESENT is implied.
+ * @returns 0 on success, -1 if 4KB pages are mapped there
+ */
+int map_huge_page(uint32_t* dir, uintptr_t vaddr, uintptr_t phys, uint32_t flags)
+{
+    KASSERT(dir);
+    KASSERT(g_huge_pages);
+    KASSERT(vaddr < KERNEL_VBASE);
+    KASSERT(vaddr % HUGE_PAGE_SIZE == 0 && phys % HUGE_PAGE_SIZE == 0);
+
+    unsigned int pde = vaddr >> PDE_SHIFT;
+
+    bool iflag = beg_int_atomic();
+    uint32_t old = dir[pde];
+    if ((old & PTE_PRESENT) && !(old & PDE_HUGE)) {
+        uint32_t* table = (uint32_t*)phys_to_virt(old & PAGE_MASK);
+        unsigned int i;
+        for (i = 0; i < PTES_PER_TABLE; i++) {
+            if (table[i] != 0) {
+                end_int_atomic(iflag);
+                return -1;
+            }
+        }
+        free_page(table);
+    }
+
+    dir[pde] = phys | (flags & PTE_FLAGS_MASK) | PDE_HUGE | PTE_PRESENT;
+    if ((old & PTE_PRESENT) && needs_invalidate(dir, vaddr)) {
+        tlb_invalidate_page(vaddr);
+    }
+    end_int_atomic(iflag);
+    return 0;
+}
+
+/*
+ * Remove the 4MB page mapped at `vaddr` in page directory `dir`.
+ * @returns the old page directory entry, 0 if there was no huge page
+ */
+uint32_t unmap_huge_page(uint32_t* dir, uintptr_t vaddr)
+{
+    KASSERT(dir);
+    KASSERT(vaddr < KERNEL_VBASE);
+
+    unsigned int pde = vaddr >> PDE_SHIFT;
+
+    bool iflag = beg_int_atomic();
+    uint32_t old = dir[pde];
+    if (!(old & PDE_HUGE)) {
+        end_int_atomic(iflag);
+        return 0;
+    }
+
+    dir[pde] = 0 | PTE_USER | PTE_WRITE;    /* not present */
+    if ((old & PTE_PRESENT) && needs_invalidate(dir, vaddr)) {
+        /* a single INVLPG drops the whole 4MB entry */
+        tlb_invalidate_page(vaddr);
+    }
+    end_int_atomic(iflag);
+    return old;
+}
+
+uint32_t* kernel_page_directory(void)
+{
+    return g_kernel_page_dir;
+}
+
 void paging_install(void)
 {
+    /* kernel-half mappings are global if the CPU supports it, so they
+     * survive CR3 reloads when switching between address spaces */
+    uint32_t kernel_flags = 0;
+    if (cpu_has_feature(CPUID_FEAT_EDX_PGE)) {
+        kernel_flags = PTE_GLOBAL;
+    }
+
     /* find first 4KB aligned address after the end of the kernel */
     /* create page directory for 4GB of RAM at this address */
     uintptr_t page_directory = (uintptr_t)alloc_page();
@@ -48,42 +455,72 @@ void paging_install(void)
         ((uintptr_t*)page_directory)[pde] = 0 | 6;  /* usermode level, read/write, not present */
     }
 
-    /* map first 16MB in 4 page tables */
+    /* map all of physical memory (at least the first 16MB).
+     * Every kernel page table is created here and never afterwards,
+     * so copying the kernel PDEs into a new page directory is enough
+     * to share the kernel half between all address spaces. */
+    unsigned int num_tables = (mem_page_count() + PTES_PER_TABLE - 1) / PTES_PER_TABLE;
+    if (num_tables < 4) {
+        num_tables = 4;
+    }
+    /* the direct map stops below the vmalloc area (mem_init never
+     * hands out frames beyond it) */
+    if (num_tables > VMALLOC_PDE_START - KERNEL_PDE_START) {
+        num_tables = VMALLOC_PDE_START - KERNEL_PDE_START;
+    }
+
     uintptr_t address = 0x0;
     unsigned int pidx = 0;
-    for (pidx = KERNEL_VBASE >> 22; pidx < (KERNEL_VBASE >> 22) + 4; pidx++) {
+    for (pidx = KERNEL_PDE_START; pidx < KERNEL_PDE_START + num_tables; pidx++) {
         uintptr_t page_table = (uintptr_t)alloc_page();
         KASSERT(page_table);
 
         unsigned int pte;
         for (pte = 0; pte < 1024; pte++) {
-            /* ((uint32_t*)page_table)[pte] = address | 3;  /1* supervisor level, read/write, present *1/ */
-            ((uint32_t*)page_table)[pte] = address | 7; /* usermode level, read/write, present */
+            /* supervisor only: ring 3 never sees kernel memory */
+            ((uint32_t*)page_table)[pte] = address | PTE_WRITE | PTE_PRESENT | kernel_flags;
             address += 0x1000;  /* next page address */
         }
 
         /* set PHYSICAL addresses of page table(s) in page directory */
-        /* ((uintptr_t*)page_directory)[pidx] = virt_to_phys(page_table) | 3; /1* supervisor level, read/write, present *1/ */
-        ((uintptr_t*)page_directory)[pidx] = virt_to_phys(page_table) | 7; /* usermode level, read/write, present */
+        ((uintptr_t*)page_directory)[pidx] = virt_to_phys(page_table) | PTE_WRITE | PTE_PRESENT;
         DEBUGF("page table %u: 0x%x\n", pidx, virt_to_phys(page_table));
     }
 
+    /* empty page tables for the vmalloc area, so its PDEs never change */
+    for (pidx = VMALLOC_PDE_START; pidx < VMALLOC_PDE_END; pidx++) {
+        uintptr_t page_table = (uintptr_t)alloc_zeroed_page();
+        KASSERT(page_table);
+        ((uintptr_t*)page_directory)[pidx] = virt_to_phys(page_table) | PTE_WRITE | PTE_PRESENT;
+    }
+
+    g_kernel_page_dir = (uint32_t*)page_directory;
+
     int_install_handler(14, page_fault_handler);
 
     /* move PHYSICAL page directory address into cr3 */
-    asm volatile("mov %0, %%cr3":: "r" (virt_to_phys(page_directory)));
+    write_cr3(virt_to_phys(page_directory));
 
-    /* clear 4MB page bit since we're switching to 4KB pages */
-    uint32_t cr4;
-    asm volatile("mov %%cr4, %0": "=r" (cr4));
-    cr4 &= ~(0x00000010);
-    asm volatile("mov %0, %%cr4":: "r" (cr4));
+    /* the kernel maps itself with 4KB pages; 4MB pages stay
+     * enabled (if supported) for user memory that asks for them */
+    uint32_t cr4 = read_cr4();
+    if (cpu_has_feature(CPUID_FEAT_EDX_PSE)) {
+        cr4 |= CR4_PSE;
+        g_huge_pages = true;
+    } else {
+        cr4 &= ~CR4_PSE;
+    }
+    write_cr4(cr4);
 
     /* read cr0, set paging bit, write it back */
-    uint32_t cr0;
-    asm volatile("mov %%cr0, %0": "=r" (cr0));
-    cr0 |= 0x80000000;
-    asm volatile("mov %0, %%cr0":: "r" (cr0));
+    write_cr0(read_cr0() | CR0_PG);
+
+    /* enable global pages only after the new tables are live */
+    if (kernel_flags & PTE_GLOBAL) {
+        write_cr4(cr4 | CR4_PGE);
+        g_global_pages = true;
+        DEBUG("Global kernel pages enabled\n");
+    }
 
     /*
     uint32_t cr3;
@@ -3,9 +3,74 @@
 
 #include "dune.h"
 
+/* page directory/table entry flags */
+enum {
+    PTE_PRESENT     = 0x001,
+    PTE_WRITE       = 0x002,
+    PTE_USER        = 0x004,
+    PTE_WRITETHRU   = 0x008,
+    PTE_NOCACHE     = 0x010,    /* e.g. device registers */
+    PTE_ACCESSED    = 0x020,
+    PTE_DIRTY       = 0x040,
+    PDE_HUGE        = 0x080,    /* (directory entry) maps a 4MB page */
+    PTE_GLOBAL      = 0x100,    /* not flushed on CR3 reload (needs CR4.PGE) */
+    PTE_COW         = 0x200,    /* (available bit) shared copy-on-write */
+    PTE_SWAPPED     = 0x400,    /* (available bit) not present, in swap */
+    PTE_FLAGS_MASK  = 0xFFF,
+    PTE_PROT_MASK   = PTE_WRITE | PTE_USER | PTE_COW
+};
+
+/* page fault error code bits */
+enum {
+    PF_PRESENT  = 0x1,  /* protection violation (page was present) */
+    PF_WRITE    = 0x2,  /* faulting access was a write */
+    PF_USER     = 0x4   /* fault happened in user mode */
+};
+
+enum {
+    PDE_SHIFT = 22,
+    PTES_PER_TABLE = 1024,
+    PDES_PER_DIR = 1024
+};
+
+/* kernel virtual area for vmalloc(), above the direct map of RAM */
+#define VMALLOC_START 0xE0000000
+enum { VMALLOC_SIZE = 0x2000000 };  /* 32MB */
+
 void paging_install(void);
 
+uint32_t* page_directory_create(void);
+void page_directory_destroy(uint32_t* dir);
+uint32_t* kernel_page_directory(void);
+uint32_t* paging_get_pte(uint32_t* dir, uintptr_t vaddr, bool create);
+int map_page(uint32_t* dir, uintptr_t vaddr, uintptr_t phys, uint32_t flags);
+uint32_t unmap_page(uint32_t* dir, uintptr_t vaddr);
+void protect_range(uint32_t* dir, uintptr_t start, uintptr_t end, uint32_t flags);
+bool paging_huge_pages(void);
+int map_huge_page(uint32_t* dir, uintptr_t vaddr, uintptr_t phys, uint32_t flags);
+uint32_t unmap_huge_page(uint32_t* dir, uintptr_t vaddr);
+
 uintptr_t phys_to_virt(uintptr_t phys);
 uintptr_t virt_to_phys(uintptr_t virt);
+uintptr_t kernel_virt_to_phys(uintptr_t virt);
+
+void tlb_invalidate_page(uintptr_t vaddr);
+void tlb_flush(void);
+void tlb_flush_global(void);
+
+/* past this many pages, one full TLB flush is cheaper than INVLPGs */
+enum { TLB_BATCH_SIZE = 32 };
+
+/* TLB invalidations pending after a run of page table updates */
+struct tlb_batch {
+    uint32_t* dir;          /* page directory being changed */
+    unsigned int count;     /* pages queued (may exceed TLB_BATCH_SIZE) */
+    bool global;            /* any kernel-half (global) pages queued */
+    uintptr_t pages[TLB_BATCH_SIZE];
+};
+
+void tlb_batch_init(struct tlb_batch* batch, uint32_t* dir);
+void tlb_batch_add(struct tlb_batch* batch, uintptr_t vaddr);
+void tlb_batch_flush(struct tlb_batch* batch);
 
 #endif /* DUNE_PAGING_H */
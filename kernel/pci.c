@@ -4,6 +4,8 @@
 
 /* temporary */
 #include "ata.h"
+#include "ahci.h"
+#include "virtio_blk.h"
 
 enum {
     PCI_CONFIG_ADDRESS = 0xCF8,
@@ -23,25 +25,54 @@ enum {
 static void pci_check_bus(uint8_t bus);
 
 
-static uint16_t pci_config_read_word(uint8_t bus, uint8_t slot,
+static uint32_t pci_config_address(uint8_t bus, uint8_t slot,
         uint8_t func, uint8_t offset)
 {
-    uint32_t address;
     uint32_t lbus  = (uint32_t)bus;
     uint32_t lslot = (uint32_t)slot;
     uint32_t lfunc = (uint32_t)func;
 
-    /* create configuration address */
-    address = (uint32_t)((lbus << 16) | (lslot << 11) |
+    return (uint32_t)((lbus << 16) | (lslot << 11) |
             (lfunc << 8) | (offset & 0xFC) | ((uint32_t)0x80000000));
+}
 
+static uint16_t pci_config_read_word(uint8_t bus, uint8_t slot,
+        uint8_t func, uint8_t offset)
+{
     /* write out the address */
-    outportl(PCI_CONFIG_ADDRESS, address);
+    outportl(PCI_CONFIG_ADDRESS, pci_config_address(bus, slot, func, offset));
     /* read in the data */
     /* (offset & 2) * 8) = 0 will choose the first word of the 32 bits register */
     return (uint16_t)((inportl(PCI_CONFIG_DATA) >> ((offset & 2) * 8)) & 0xFFFF);
 }
 
+static void pci_config_write_word(uint8_t bus, uint8_t slot,
+        uint8_t func, uint8_t offset, uint16_t value)
+{
+    outportl(PCI_CONFIG_ADDRESS, pci_config_address(bus, slot, func, offset));
+
+    /* replace our half of the 32 bits register */
+    unsigned int shift = (offset & 2) * 8;
+    uint32_t data = inportl(PCI_CONFIG_DATA);
+    data = (data & ~(0xFFFFu << shift)) | ((uint32_t)value << shift);
+    outportl(PCI_CONFIG_DATA, data);
+}
+
+/* command register bits */
+enum {
+    PCI_COMMAND_IO = 0x01,          /* respond to I/O space accesses */
+    PCI_COMMAND_MEMORY = 0x02,      /* respond to memory space accesses */
+    PCI_COMMAND_MASTER = 0x04       /* let the device do DMA */
+};
+
+/* set `bits` in the device's command register */
+static void pci_enable(uint8_t bus, uint8_t device, uint8_t function,
+        uint16_t bits)
+{
+    uint16_t command = pci_config_read_word(bus, device, function, 0x04);
+    pci_config_write_word(bus, device, function, 0x04, command | bits);
+}
+
 static uint8_t pci_get_header_type(uint8_t bus, uint8_t device, uint8_t function)
 {
     uint16_t word = pci_config_read_word(bus, device, function, 0x0E);
@@ -76,6 +107,12 @@ static uint8_t pci_get_subclass(uint8_t bus, uint8_t device, uint8_t function)
     return (uint8_t)word & 0xFF;
 }
 
+static uint8_t pci_get_prog_if(uint8_t bus, uint8_t device, uint8_t function)
+{
+    uint16_t word = pci_config_read_word(bus, device, function, 0x08);
+    return (word >> 8) & 0xFF;
+}
+
 static uint8_t pci_get_secondary_bus(uint8_t bus, uint8_t device, uint8_t function)
 {
     uint16_t word = pci_config_read_word(bus, device, function, 0x18);
@@ -91,7 +128,7 @@ static uint32_t pci_get_base_address(uint8_t bus, uint8_t device, uint8_t functi
     uint16_t low = pci_config_read_word(bus, device, function, offset);
     uint16_t high = pci_config_read_word(bus, device, function, offset + 2);
 
-    return low & (high << 16);
+    return low | ((uint32_t)high << 16);
 }
 
 static void pci_check_function(uint8_t bus, uint8_t device, uint8_t function)
@@ -105,13 +142,30 @@ static void pci_check_function(uint8_t bus, uint8_t device, uint8_t function)
             "subclass: %02X, int: %02d\n", bus, device,
             function, vendor_id, device_id, class, subclass, interrupt);
 
-    if (class == 0x01) {
+    if (class == 0x01 && subclass == 0x01) {
+        /* IDE controller */
         uint32_t bar0 = pci_get_base_address(bus, device, function, 0);
         uint32_t bar1 = pci_get_base_address(bus, device, function, 1);
         uint32_t bar2 = pci_get_base_address(bus, device, function, 2);
         uint32_t bar3 = pci_get_base_address(bus, device, function, 3);
         uint32_t bar4 = pci_get_base_address(bus, device, function, 4);
+        if (bar4) {
+            pci_enable(bus, device, function, PCI_COMMAND_MASTER);
+        }
         ide_initialize(bar0, bar1, bar2, bar3, bar4);
+    } else if (class == 0x01 && subclass == 0x06 &&
+            pci_get_prog_if(bus, device, function) == 0x01) {
+        /* AHCI SATA controller: registers are memory mapped at BAR5 */
+        uint32_t abar = pci_get_base_address(bus, device, function, 5);
+        pci_enable(bus, device, function,
+                PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+        ahci_init(abar & ~0xF, interrupt);
+    } else if (vendor_id == VIRTIO_VENDOR_ID &&
+            device_id == VIRTIO_BLK_DEVICE_ID) {
+        /* paravirtual disk: legacy registers in I/O space at BAR0 */
+        uint32_t bar0 = pci_get_base_address(bus, device, function, 0);
+        pci_enable(bus, device, function, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+        virtio_blk_init(bar0 & ~0x3, interrupt);
     }
 
     /* recursive scan */
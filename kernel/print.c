@@ -219,28 +219,6 @@ size_t kprintf(char *fmt, ...)
     return sz;
 }
 
-
-#include "syscall.h"
-void uputc(char **s, char c)
-{
-    (void)s;
-    char buf[2];
-    buf[0] = c;
-    syscall_print(buf);
-}
-
-#include <stdarg.h>
-size_t uprintf(char *fmt, ...)
-{
-    va_list arg;
-    size_t sz;
-    va_start(arg, fmt);
-    sz = kvasprintf(NULL, uputc, fmt, arg);
-    va_end(arg);
-    return sz;
-}
-
-
 #ifdef QEMU_DEBUG
 
 #include "io.h"
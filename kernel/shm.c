@@ -0,0 +1,251 @@
+#include "int.h"
+#include "mem.h"
+#include "string.h"
+#include "paging.h"
+#include "thread.h"
+#include "vm.h"
+#include "shm.h"
+
+/* named (not yet unlinked) objects */
+static shm_object_t* g_shm_objects;
+
+/*
+ * Find a named object.
+ * Called with interrupts disabled.
+ */
+static shm_object_t* find_object(const char* name)
+{
+    shm_object_t* shm;
+    for (shm = g_shm_objects; shm; shm = shm->next) {
+        if (strcmp(shm->name, name) == 0) {
+            return shm;
+        }
+    }
+    return NULL;
+}
+
+static void destroy_object(shm_object_t* shm)
+{
+    unsigned int i;
+    for (i = 0; i < shm->num_frames; i++) {
+        if (!shm->frames[i]) {
+            continue;
+        }
+        if (shm->huge) {
+            free_huge_page(shm->frames[i]);
+        } else {
+            free_page(shm->frames[i]);
+        }
+    }
+    free(shm->frames);
+    free(shm);
+}
+
+/*
+ * Create an (unnamed) object of `size` bytes. Huge page objects
+ * get all their (zeroed) frames now, since mappings can't fault
+ * them in one at a time.
+ * @returns NULL if out of memory
+ */
+static shm_object_t* create_object(const char* name, size_t size, bool huge)
+{
+    size_t frame_size = huge ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    unsigned int num_frames = (size + frame_size - 1) / frame_size;
+
+    shm_object_t* shm = malloc(sizeof(*shm));
+    if (!shm) {
+        return NULL;
+    }
+    shm->frames = malloc(num_frames * sizeof(*shm->frames));
+    if (!shm->frames) {
+        free(shm);
+        return NULL;
+    }
+    memset(shm->frames, 0, num_frames * sizeof(*shm->frames));
+    strcpy(shm->name, name);
+    shm->size = num_frames * frame_size;
+    shm->num_frames = num_frames;
+    shm->huge = huge;
+    shm->refcount = 1;
+    shm->next = NULL;
+
+    if (huge) {
+        unsigned int i;
+        for (i = 0; i < num_frames; i++) {
+            shm->frames[i] = alloc_huge_page();
+            if (!shm->frames[i]) {
+                DEBUGF("no free 4MB runs for shm object %s\n", name);
+                destroy_object(shm);
+                return NULL;
+            }
+            memset(shm->frames[i], 0, HUGE_PAGE_SIZE);
+        }
+    }
+    return shm;
+}
+
+void shm_get(shm_object_t* shm)
+{
+    KASSERT(shm);
+
+    bool iflag = beg_int_atomic();
+    KASSERT(shm->refcount > 0);
+    shm->refcount++;
+    end_int_atomic(iflag);
+}
+
+/*
+ * Drop a reference to an object, freeing it and its frames
+ * once it's neither named nor mapped anywhere.
+ */
+void shm_put(shm_object_t* shm)
+{
+    KASSERT(shm);
+
+    bool iflag = beg_int_atomic();
+    KASSERT(shm->refcount > 0);
+    bool last = (--shm->refcount == 0);
+    end_int_atomic(iflag);
+
+    if (last) {
+        destroy_object(shm);
+    }
+}
+
+/*
+ * Get (allocating on first use) the `index`th page of a 4KB page
+ * object, taking a new reference to it for the caller's mapping.
+ * @returns kernel address of the page, or NULL if out of memory
+ */
+void* shm_get_page(shm_object_t* shm, unsigned int index)
+{
+    KASSERT(shm && !shm->huge);
+    KASSERT(index < shm->num_frames);
+
+    bool iflag = beg_int_atomic();
+    if (!shm->frames[index]) {
+        shm->frames[index] = alloc_zeroed_page();
+    }
+    void* page = shm->frames[index];
+    if (page) {
+        get_page(page);
+    }
+    end_int_atomic(iflag);
+    return page;
+}
+
+/*
+ * shm_map() system call: map the shared memory object `name` into
+ * the caller's address space. With SHM_CREATE a missing object of
+ * `size` bytes is created, backed by 4MB pages if SHM_HUGE is set
+ * (and supported). An existing object must be at least `size` bytes.
+ * @returns the address of the mapping, or -1 on failure
+ */
+int shm_map(const char* name, size_t size, unsigned int flags)
+{
+    address_space_t* as = get_current_thread()->as;
+    size_t len = strnlen(name, SHM_NAME_MAX);
+    if (!as || len == 0 || len == SHM_NAME_MAX) {
+        return -1;
+    }
+
+    bool iflag = beg_int_atomic();
+    shm_object_t* shm = find_object(name);
+    if (shm) {
+        shm_get(shm);
+    }
+    end_int_atomic(iflag);
+
+    if (!shm) {
+        if (!(flags & SHM_CREATE) || size == 0) {
+            return -1;
+        }
+        /* creating may take a while, so another thread could
+         * create the same object meanwhile: the first one wins */
+        shm_object_t* new_shm = create_object(name, size,
+                (flags & SHM_HUGE) && paging_huge_pages());
+        if (!new_shm) {
+            return -1;
+        }
+
+        iflag = beg_int_atomic();
+        shm = find_object(name);
+        if (shm) {
+            shm_get(shm);
+        } else {
+            shm = new_shm;
+            shm->next = g_shm_objects;
+            g_shm_objects = shm;
+            shm_get(shm);
+            new_shm = NULL;
+        }
+        end_int_atomic(iflag);
+
+        if (new_shm) {
+            shm_put(new_shm);
+        }
+    }
+
+    if (size > shm->size) {
+        shm_put(shm);
+        return -1;
+    }
+
+    uint32_t prot = VM_READ;
+    if (!(flags & SHM_READONLY)) {
+        prot |= VM_WRITE;
+    }
+    uintptr_t addr = vm_map_shm(as, shm, prot);
+    shm_put(shm);
+
+    return addr ? (int)addr : -1;
+}
+
+/*
+ * shm_unmap() system call: remove the shared memory mapping
+ * at `addr` (as returned by shm_map) from the caller's address space.
+ * @returns 0 on success, -1 if there is no such mapping
+ */
+int shm_unmap(void* addr)
+{
+    address_space_t* as = get_current_thread()->as;
+    if (!as) {
+        return -1;
+    }
+
+    vm_region_t* region = vm_find_region(as, (uintptr_t)addr);
+    if (!region || !region->shm || region->start != (uintptr_t)addr) {
+        return -1;
+    }
+    return vm_unmap(as, (uintptr_t)addr);
+}
+
+/*
+ * shm_unlink() system call: remove the name of a shared memory object.
+ * Existing mappings keep it alive; shm_map can't find it anymore.
+ * @returns 0 on success, -1 if there is no such object
+ */
+int shm_unlink(const char* name)
+{
+    if (strnlen(name, SHM_NAME_MAX) == SHM_NAME_MAX) {
+        return -1;
+    }
+
+    bool iflag = beg_int_atomic();
+    shm_object_t** s = &g_shm_objects;
+    while (*s && strcmp((*s)->name, name) != 0) {
+        s = &(*s)->next;
+    }
+    shm_object_t* shm = *s;
+    if (shm) {
+        *s = shm->next;
+        shm->next = NULL;
+    }
+    end_int_atomic(iflag);
+
+    if (!shm) {
+        return -1;
+    }
+    shm_put(shm);
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef DUNE_SHM_H
+#define DUNE_SHM_H
+
+#include "dune.h"
+
+enum { SHM_NAME_MAX = 32 };     /* including the terminating NUL */
+
+/* shm_map flags */
+enum {
+    SHM_CREATE   = 0x1,     /* create the object if it doesn't exist */
+    SHM_HUGE     = 0x2,     /* back a new object with 4MB pages */
+    SHM_READONLY = 0x4      /* map without write access */
+};
+
+/*
+ * A named piece of memory that address spaces map (in full) to
+ * share data without copying. Its frames are 4KB pages, allocated
+ * on first touch and referenced by every mapping, or 4MB huge
+ * pages allocated up front and mapped directly by page directory
+ * entries. Objects live until they are unlinked and unmapped.
+ */
+struct shm_object {
+    char name[SHM_NAME_MAX];
+    size_t size;                /* bytes mapped (frame multiple) */
+    unsigned int num_frames;
+    bool huge;                  /* frames are HUGE_PAGE_SIZE */
+    void** frames;              /* kernel addresses, NULL until touched */
+    int refcount;               /* mappings, plus one while named */
+    struct shm_object* next;    /* next named object */
+};
+typedef struct shm_object shm_object_t;
+
+void shm_get(shm_object_t* shm);
+void shm_put(shm_object_t* shm);
+void* shm_get_page(shm_object_t* shm, unsigned int index);
+
+int shm_map(const char* name, size_t size, unsigned int flags);
+int shm_unmap(void* addr);
+int shm_unlink(const char* name);
+
+#endif /* DUNE_SHM_H */
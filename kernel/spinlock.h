@@ -0,0 +1,34 @@
+#ifndef DUNE_SPINLOCK_H
+#define DUNE_SPINLOCK_H
+
+#include "dune.h"
+#include "int.h"
+
+/*
+ * Lock protecting data shared between CPUs.
+ * Interrupts are disabled on the local CPU while it is held.
+ * (On a uniprocessor it never actually spins.)
+ */
+struct spinlock {
+    volatile uint32_t locked;
+};
+typedef struct spinlock spinlock_t;
+
+static inline bool spin_lock(spinlock_t* lock)
+{
+    bool iflag = beg_int_atomic();
+    while (__sync_lock_test_and_set(&lock->locked, 1)) {
+        while (lock->locked) {
+            asm volatile("pause");
+        }
+    }
+    return iflag;
+}
+
+static inline void spin_unlock(spinlock_t* lock, bool iflag)
+{
+    __sync_lock_release(&lock->locked);
+    end_int_atomic(iflag);
+}
+
+#endif /* DUNE_SPINLOCK_H */
@@ -209,6 +209,7 @@ extern base_int_handler
 ; call C-level fault handler, restore processor state
 isr_common_stub:
     pushregs
+    cld                 ; C code expects DF clear (memmove sets it)
     mov ax, KERNEL_DS   ; Load the Kernel Data Segment descriptor
     mov ds, ax
     mov es, ax
@@ -259,6 +260,7 @@ extern schedule
 ; calls base_irq_handler defined in 'irq.c'
 irq_common_stub:
     pushregs
+    cld                 ; C code expects DF clear (memmove sets it)
     mov ax, KERNEL_DS   ; load kernel data segment descriptor
     mov ds, ax
     mov es, ax
@@ -289,6 +291,7 @@ irq_common_stub:
 ;       - func return address
 extern g_current_thread
 extern set_kernel_stack
+extern switch_thread_address_space
 global switch_to_thread
 switch_to_thread:
     ;xchg bx, bx         ; BOCHS magic breakpoint
@@ -310,6 +313,10 @@ switch_to_thread:
     mov [g_current_thread], eax ; update new current thread
     mov esp, [eax+0]            ; update ESP
 
+    push eax                    ; load new thread's page directory (if any)
+    call switch_thread_address_space
+    pop eax
+
     push dword [eax+12]
     call set_kernel_stack
     pop eax
@@ -325,6 +332,16 @@ switch_to_thread:
     ret
 
 
+; first 'return' of a forked thread: switch_to_thread pops the
+; general registers and returns here, leaving the copied system call
+; trap frame (struct regs + user ESP/SS) on the stack
+global fork_return
+fork_return:
+    popregs
+    add esp, 8      ; clean up pushed error code and ISR number
+    iret            ; back to user mode, with EAX = 0
+
+
 global start_user_mode
 start_user_mode:
     cli                         ; disable interrupts
@@ -1,75 +1,376 @@
+#include "int.h"
+#include "cpu.h"
 #include "string.h"
 
+/*
+ * Large copies and fills use SSE2 when the CPU has it. XMM registers
+ * aren't saved on thread switches, so the SSE2 loops run with
+ * interrupts disabled, a bounded chunk at a time, and only in kernel
+ * mode (user mode can't disable interrupts).
+ */
+enum {
+    SSE2_MIN_BYTES = 512,       /* smaller sizes use rep movs/stos */
+    SSE2_BLOCK = 64,            /* bytes per loop iteration */
+    SSE2_CHUNK_BLOCKS = 64      /* blocks per interrupts-off chunk (4KB) */
+};
+
+/* in .data, not BSS: memset/memcpy run (e.g. from kcls) before
+ * bss_init zeroes BSS and before cpu_init enables SSE */
+static bool g_sse2 __attribute__((section(".data"))) = false;
+
+/*
+ * Select the string routines' implementation.
+ * Must be called after `cpu_init`.
+ */
+void string_init(void)
+{
+    g_sse2 = cpu_has_feature(CPUID_FEAT_EDX_SSE2);
+    DEBUGF("SSE2 memcpy/memset: %s\n", g_sse2 ? "yes" : "no");
+}
+
+static inline bool use_sse2(size_t n)
+{
+    return g_sse2 && n >= SSE2_MIN_BYTES && !cpu_user_mode();
+}
+
+/*
+ * Copy `blocks` 64-byte blocks to a 16-byte aligned `dst`.
+ */
+static void sse2_copy_blocks(uint8_t* dst, const uint8_t* src, size_t blocks)
+{
+    while (blocks > 0) {
+        size_t chunk = (blocks < SSE2_CHUNK_BLOCKS) ? blocks : SSE2_CHUNK_BLOCKS;
+        blocks -= chunk;
+
+        bool iflag = beg_int_atomic();
+        asm volatile(
+                "1:\n\t"
+                "movdqu (%1), %%xmm0\n\t"
+                "movdqu 16(%1), %%xmm1\n\t"
+                "movdqu 32(%1), %%xmm2\n\t"
+                "movdqu 48(%1), %%xmm3\n\t"
+                "movdqa %%xmm0, (%0)\n\t"
+                "movdqa %%xmm1, 16(%0)\n\t"
+                "movdqa %%xmm2, 32(%0)\n\t"
+                "movdqa %%xmm3, 48(%0)\n\t"
+                "add $64, %1\n\t"
+                "add $64, %0\n\t"
+                "dec %2\n\t"
+                "jnz 1b"
+                : "+r" (dst), "+r" (src), "+r" (chunk)
+                :
+                : "memory", "cc");
+        end_int_atomic(iflag);
+    }
+}
+
+/*
+ * Fill `blocks` 64-byte blocks at a 16-byte aligned `dst` with `pattern`.
+ */
+static void sse2_set_blocks(uint8_t* dst, uint32_t pattern, size_t blocks)
+{
+    while (blocks > 0) {
+        size_t chunk = (blocks < SSE2_CHUNK_BLOCKS) ? blocks : SSE2_CHUNK_BLOCKS;
+        blocks -= chunk;
+
+        bool iflag = beg_int_atomic();
+        asm volatile(
+                "movd %2, %%xmm0\n\t"
+                "pshufd $0, %%xmm0, %%xmm0\n\t"
+                "1:\n\t"
+                "movdqa %%xmm0, (%0)\n\t"
+                "movdqa %%xmm0, 16(%0)\n\t"
+                "movdqa %%xmm0, 32(%0)\n\t"
+                "movdqa %%xmm0, 48(%0)\n\t"
+                "add $64, %0\n\t"
+                "dec %1\n\t"
+                "jnz 1b"
+                : "+r" (dst), "+r" (chunk)
+                : "r" (pattern)
+                : "memory", "cc");
+        end_int_atomic(iflag);
+    }
+}
+
+/*
+ * Copy front to back: bytes up to a 4-byte aligned `dst`,
+ * then dwords (or SSE2 blocks), then the remaining bytes.
+ * Safe for overlapping buffers as long as dst < src.
+ */
+static void copy_forward(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    if (use_sse2(n)) {
+        size_t head = -(uintptr_t)dst & 15;
+        n -= head;
+        asm volatile("rep movsb"
+                : "+D" (dst), "+S" (src), "+c" (head) : : "memory");
+        size_t blocks = n / SSE2_BLOCK;
+        sse2_copy_blocks(dst, src, blocks);
+        dst += blocks * SSE2_BLOCK;
+        src += blocks * SSE2_BLOCK;
+        n -= blocks * SSE2_BLOCK;
+    }
+
+    size_t head = -(uintptr_t)dst & 3;
+    if (head > n) {
+        head = n;
+    }
+    n -= head;
+    size_t dwords = n / 4;
+    size_t tail = n % 4;
+    asm volatile("rep movsb"
+            : "+D" (dst), "+S" (src), "+c" (head) : : "memory");
+    asm volatile("rep movsl"
+            : "+D" (dst), "+S" (src), "+c" (dwords) : : "memory");
+    asm volatile("rep movsb"
+            : "+D" (dst), "+S" (src), "+c" (tail) : : "memory");
+}
+
+/*
+ * Copy back to front, for overlapping buffers with dst > src.
+ */
+static void copy_backward(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    dst += n;
+    src += n;
+
+    /* odd bytes at the end first, then dwords */
+    size_t tail = n % 4;
+    while (tail--) {
+        *--dst = *--src;
+    }
+
+    size_t dwords = n / 4;
+    if (dwords > 0) {
+        uint32_t* d = (uint32_t*)dst - 1;
+        const uint32_t* s = (const uint32_t*)src - 1;
+        asm volatile(
+                "std\n\t"
+                "rep movsl\n\t"
+                "cld"
+                : "+D" (d), "+S" (s), "+c" (dwords)
+                :
+                : "memory");
+    }
+}
+
 void *memset(void *b, int c, size_t len)
 {
-    uint8_t *s = b;
-    while (--len) {
-        *s++ = (uint8_t)c;
+    uint8_t* s = b;
+    uint32_t pattern = (uint8_t)c * 0x01010101u;
+
+    if (use_sse2(len)) {
+        size_t head = -(uintptr_t)s & 15;
+        len -= head;
+        asm volatile("rep stosb"
+                : "+D" (s), "+c" (head) : "a" (pattern) : "memory");
+        size_t blocks = len / SSE2_BLOCK;
+        sse2_set_blocks(s, pattern, blocks);
+        s += blocks * SSE2_BLOCK;
+        len -= blocks * SSE2_BLOCK;
+    }
+
+    size_t head = -(uintptr_t)s & 3;
+    if (head > len) {
+        head = len;
     }
+    len -= head;
+    size_t dwords = len / 4;
+    size_t tail = len % 4;
+    asm volatile("rep stosb"
+            : "+D" (s), "+c" (head) : "a" (pattern) : "memory");
+    asm volatile("rep stosl"
+            : "+D" (s), "+c" (dwords) : "a" (pattern) : "memory");
+    asm volatile("rep stosb"
+            : "+D" (s), "+c" (tail) : "a" (pattern) : "memory");
 
     return b;
 }
 
-void memcpy(void *vdst, const void *vsrc, size_t n)
+void *memcpy(void *dst, const void *src, size_t n)
 {
-    const unsigned char* src = vsrc;
-    unsigned char* dst = vdst;
+    copy_forward(dst, src, n);
+    return dst;
+}
 
-    size_t i = 0;
-    for (i = 0; i < n; i++) {
-        *(dst + i) = *(src + i);
+/*
+ * Copy `n` bytes between possibly overlapping buffers.
+ */
+void *memmove(void *dst, const void *src, size_t n)
+{
+    if ((uintptr_t)dst - (uintptr_t)src >= n) {
+        /* dst is below src, or past its end */
+        copy_forward(dst, src, n);
+    } else {
+        copy_backward(dst, src, n);
     }
+    return dst;
+}
+
+/*
+ * Word-at-a-time helpers for the comparison/search routines below.
+ * Aligned word reads never cross a page boundary, so reading a few
+ * bytes past the end of a string is harmless.
+ */
+typedef uint32_t __attribute__((may_alias)) word_t;
+
+enum { WORD_SIZE = sizeof(word_t) };
+
+static const word_t ONES = 0x01010101;
+static const word_t HIGHS = 0x80808080;
+
+/* true if any byte of `w` is zero */
+static inline bool has_zero_byte(word_t w)
+{
+    return ((w - ONES) & ~w & HIGHS) != 0;
+}
+
+static inline bool word_aligned(const void* p)
+{
+    return ((uintptr_t)p & (WORD_SIZE - 1)) == 0;
 }
 
 int memcmp(const void* s1, const void* s2, size_t n)
 {
     const unsigned char* p1 = s1, *p2 = s2;
+
+    /* compare words if both can be aligned at once */
+    if ((((uintptr_t)p1 ^ (uintptr_t)p2) & (WORD_SIZE - 1)) == 0) {
+        while (n > 0 && !word_aligned(p1)) {
+            if (*p1 != *p2) {
+                return *p1 - *p2;
+            }
+            p1++;
+            p2++;
+            n--;
+        }
+        while (n >= WORD_SIZE && *(const word_t*)p1 == *(const word_t*)p2) {
+            p1 += WORD_SIZE;
+            p2 += WORD_SIZE;
+            n -= WORD_SIZE;
+        }
+    }
+
+    /* the differing word, or unaligned buffers */
     while (n--) {
         if (*p1 != *p2) {
             return *p1 - *p2;
-        } else {
-            p1++;
-            p2++;
         }
+        p1++;
+        p2++;
     }
     return 0;
 }
 
-int strlen(char *s)
+/*
+ * Find the first occurrence of byte `c` in the first `n` bytes of `s`.
+ * @returns pointer to the byte, or NULL if not found
+ */
+void* memchr(const void* s, int c, size_t n)
 {
-    int l = 0;
-    while (*s++) {
-        l++;
+    const unsigned char* p = s;
+    unsigned char ch = c;
+
+    while (n > 0 && !word_aligned(p)) {
+        if (*p == ch) {
+            return (void*)p;
+        }
+        p++;
+        n--;
     }
-    return l;
+
+    word_t pattern = ch * ONES;
+    while (n >= WORD_SIZE && !has_zero_byte(*(const word_t*)p ^ pattern)) {
+        p += WORD_SIZE;
+        n -= WORD_SIZE;
+    }
+
+    while (n--) {
+        if (*p == ch) {
+            return (void*)p;
+        }
+        p++;
+    }
+    return NULL;
 }
 
-int strcmp(const char* s1, const char* s2)
+int strlen(char *s)
 {
-    while (*s1 || *s2) {
-        if (*s1 != *s2) {
-            return *s1 - *s2;
+    const char* p = s;
+
+    while (!word_aligned(p)) {
+        if (*p == '\0') {
+            return p - s;
         }
-        s1++;
-        s2++;
+        p++;
+    }
+    while (!has_zero_byte(*(const word_t*)p)) {
+        p += WORD_SIZE;
+    }
+    while (*p) {
+        p++;
     }
+    return p - s;
+}
 
-    return 0;
+/*
+ * Length of `s`, but at most `maxlen`
+ */
+size_t strnlen(const char* s, size_t maxlen)
+{
+    const char* end = memchr(s, '\0', maxlen);
+    return end ? (size_t)(end - s) : maxlen;
 }
 
-int strncmp(const char* s1, const char* s2, size_t n)
+/*
+ * Compare at most `n` bytes of two strings (n == SIZE_MAX: no limit).
+ */
+static int compare_strings(const char* s1, const char* s2, size_t n)
 {
-    while (n-- & (*s1 || *s2)) {
-        if (*s1 != *s2) {
-            return *s1 - *s2;
+    const unsigned char* p1 = (const unsigned char*)s1;
+    const unsigned char* p2 = (const unsigned char*)s2;
+
+    /* skip equal words while neither has ended */
+    if ((((uintptr_t)p1 ^ (uintptr_t)p2) & (WORD_SIZE - 1)) == 0) {
+        while (n > 0 && !word_aligned(p1)) {
+            if (*p1 != *p2 || *p1 == '\0') {
+                return *p1 - *p2;
+            }
+            p1++;
+            p2++;
+            n--;
+        }
+        while (n >= WORD_SIZE) {
+            word_t w = *(const word_t*)p1;
+            if (w != *(const word_t*)p2 || has_zero_byte(w)) {
+                break;
+            }
+            p1 += WORD_SIZE;
+            p2 += WORD_SIZE;
+            n -= WORD_SIZE;
         }
-        s1++;
-        s2++;
     }
 
+    while (n-- > 0) {
+        if (*p1 != *p2 || *p1 == '\0') {
+            return *p1 - *p2;
+        }
+        p1++;
+        p2++;
+    }
     return 0;
 }
 
+int strcmp(const char* s1, const char* s2)
+{
+    return compare_strings(s1, s2, SIZE_MAX);
+}
+
+int strncmp(const char* s1, const char* s2, size_t n)
+{
+    return compare_strings(s1, s2, n);
+}
+
 char* strcpy(char* dst, const char* src)
 {
     while ((*dst++ = *src++))
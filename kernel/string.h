@@ -3,10 +3,15 @@
 
 #include "dune.h"
 
+void string_init(void);
+
 void *memset(void *b, int c, size_t len);
-void memcpy(void *dst, const void *src, size_t n);
+void *memcpy(void *dst, const void *src, size_t n);
+void *memmove(void *dst, const void *src, size_t n);
 int memcmp(const void* s1, const void* s2, size_t n);
+void* memchr(const void* s, int c, size_t n);
 int strlen(char* s);
+size_t strnlen(const char* s, size_t maxlen);
 
 int strcmp(const char* s1, const char* s2);
 int strncmp(const char* s1, const char* s2, size_t n);
@@ -0,0 +1,209 @@
+#include "int.h"
+#include "mem.h"
+#include "string.h"
+#include "thread.h"
+#include "paging.h"
+#include "swap.h"
+
+/*
+ * Swap area: a run of page-sized slots on a block device.
+ *
+ * Each slot has a count of the (not present) PTEs referring to it,
+ * since a swapped-out page may be shared by forked address spaces.
+ * A slot is busy while its page is being written out, and readers
+ * of that slot wait for the write to finish. A slot whose write
+ * failed is bad: reading it fails, and it is never used again.
+ */
+enum {
+    SWAP_SLOT_BUSY = 0x8000,
+    SWAP_SLOT_BAD = 0x4000,
+    SWAP_SLOT_REFS = 0x3FFF
+};
+
+static block_device_t* g_swap_dev;
+static unsigned int g_swap_start;       /* first block of the swap area */
+static unsigned int g_swap_slots;       /* number of slots */
+static unsigned int g_swap_free;        /* number of free slots */
+static unsigned int g_swap_next;        /* where to start looking for a free slot */
+static uint16_t* g_swap_map;            /* per-slot refcount and busy bit */
+static thread_queue_t g_swap_wait;      /* threads waiting on busy slots */
+
+/*
+ * Start swapping to `bytes` bytes of `dev`, from block `start_block`.
+ * @returns 0 on success, -1 on failure
+ */
+int swapon(block_device_t* dev, unsigned int start_block, size_t bytes)
+{
+    KASSERT(dev);
+
+    if (g_swap_dev || PAGE_SIZE % dev->blocksize != 0) {
+        return -1;
+    }
+
+    unsigned int slots = bytes / PAGE_SIZE;
+    if (slots == 0) {
+        return -1;
+    }
+
+    uint16_t* map = malloc(slots * sizeof(*map));
+    if (!map) {
+        return -1;
+    }
+    memset(map, 0, slots * sizeof(*map));
+
+    bool iflag = beg_int_atomic();
+    g_swap_map = map;
+    g_swap_start = start_block;
+    g_swap_slots = slots;
+    g_swap_free = slots;
+    g_swap_next = 0;
+    thread_queue_clear(&g_swap_wait);
+    g_swap_dev = dev;
+    end_int_atomic(iflag);
+
+    kprintf("Swapping to %s: %u pages\n", dev->name, slots);
+    return 0;
+}
+
+bool swap_enabled(void)
+{
+    return g_swap_dev != NULL && g_swap_free > 0;
+}
+
+/*
+ * Reserve a free slot, marked busy until its page is written.
+ * @returns the slot, or -1 if swap is full (or off)
+ */
+int swap_alloc_slot(void)
+{
+    bool iflag = beg_int_atomic();
+    if (!g_swap_dev || g_swap_free == 0) {
+        end_int_atomic(iflag);
+        return -1;
+    }
+
+    unsigned int slot = g_swap_next;
+    while (g_swap_map[slot] != 0) {
+        slot = (slot + 1) % g_swap_slots;
+    }
+    g_swap_map[slot] = SWAP_SLOT_BUSY | 1;
+    g_swap_free--;
+    g_swap_next = (slot + 1) % g_swap_slots;
+
+    end_int_atomic(iflag);
+    return slot;
+}
+
+/*
+ * Add a reference to a slot (a PTE was copied).
+ */
+void swap_dup_slot(unsigned int slot)
+{
+    KASSERT(slot < g_swap_slots);
+
+    bool iflag = beg_int_atomic();
+    KASSERT(g_swap_map[slot] & SWAP_SLOT_REFS);
+    g_swap_map[slot]++;
+    end_int_atomic(iflag);
+}
+
+/*
+ * Drop a reference to a slot, freeing it when the last one is gone.
+ * A busy slot is freed once its write completes, a bad one never.
+ */
+void swap_free_slot(unsigned int slot)
+{
+    KASSERT(slot < g_swap_slots);
+
+    bool iflag = beg_int_atomic();
+    KASSERT(g_swap_map[slot] & SWAP_SLOT_REFS);
+    g_swap_map[slot]--;
+    if (g_swap_map[slot] == 0) {
+        g_swap_free++;
+    }
+    end_int_atomic(iflag);
+}
+
+/*
+ * Transfer one page to/from a slot. Device I/O sleeps, so this
+ * enables interrupts if called (e.g. from a fault) without them.
+ * @returns the driver's result code (negative on failure)
+ */
+static int swap_io(bool write, unsigned int slot, void* page)
+{
+    unsigned int blocks = PAGE_SIZE / g_swap_dev->blocksize;
+    unsigned int block = g_swap_start + slot * blocks;
+
+    bool iflag = interrupts_enabled();
+    if (!iflag) {
+        sti();
+    }
+    int rc = write ?
+        block_device_write(g_swap_dev, block, blocks, page) :
+        block_device_read(g_swap_dev, block, blocks, page);
+    if (!iflag) {
+        cli();
+    }
+    return rc;
+}
+
+/*
+ * Write a page to a freshly allocated (busy) slot,
+ * then wake anyone waiting to read it back. May sleep.
+ * @returns 0 on success, -1 if the write failed (the slot is bad)
+ */
+int swap_write_page(unsigned int slot, void* page)
+{
+    KASSERT(slot < g_swap_slots);
+    KASSERT(g_swap_map[slot] & SWAP_SLOT_BUSY);
+
+    int rc = swap_io(true, slot, page) < 0 ? -1 : 0;
+
+    bool iflag = beg_int_atomic();
+    g_swap_map[slot] &= ~SWAP_SLOT_BUSY;
+    if (rc != 0) {
+        g_swap_map[slot] |= SWAP_SLOT_BAD;
+    } else if (g_swap_map[slot] == 0) {
+        /* every reference went away during the write */
+        g_swap_free++;
+    }
+    wake_all(&g_swap_wait);
+    end_int_atomic(iflag);
+    return rc;
+}
+
+/*
+ * Read a slot's page into `page`. The caller must hold
+ * a reference to the slot. May sleep.
+ * @returns 0 on success, -1 if the slot is bad or the read failed
+ */
+int swap_read_page(unsigned int slot, void* page)
+{
+    KASSERT(slot < g_swap_slots);
+
+    bool iflag = beg_int_atomic();
+    while (g_swap_map[slot] & SWAP_SLOT_BUSY) {
+        wait(&g_swap_wait);
+    }
+    bool bad = g_swap_map[slot] & SWAP_SLOT_BAD;
+    end_int_atomic(iflag);
+
+    if (bad || swap_io(false, slot, page) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the (not present) page table entry of a page in `slot`
+ */
+uint32_t swap_pte(unsigned int slot)
+{
+    return (slot << PAGE_POWER) | PTE_SWAPPED;
+}
+
+unsigned int swap_pte_slot(uint32_t pte)
+{
+    KASSERT(!(pte & PTE_PRESENT) && (pte & PTE_SWAPPED));
+    return pte >> PAGE_POWER;
+}
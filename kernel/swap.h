@@ -0,0 +1,20 @@
+#ifndef DUNE_SWAP_H
+#define DUNE_SWAP_H
+
+#include "dune.h"
+#include "blkdev.h"
+
+int swapon(block_device_t* dev, unsigned int start_block, size_t bytes);
+bool swap_enabled(void);
+
+int swap_alloc_slot(void);
+void swap_dup_slot(unsigned int slot);
+void swap_free_slot(unsigned int slot);
+
+int swap_write_page(unsigned int slot, void* page);
+int swap_read_page(unsigned int slot, void* page);
+
+uint32_t swap_pte(unsigned int slot);
+unsigned int swap_pte_slot(uint32_t pte);
+
+#endif /* DUNE_SWAP_H */
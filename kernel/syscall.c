@@ -5,23 +5,24 @@
 #include "x86.h"
 #include "mem.h"
 #include "thread.h"
+#include "vm.h"
+#include "shm.h"
 
 static void print(const char *msg) {
     kprintf("%s", msg);
 }
 
-DEFN_SYSCALL1(print, 0, const char*)
-DEFN_SYSCALL1(sleep, 1, unsigned int)
-DEFN_SYSCALL1(malloc, 2, size_t)
-DEFN_SYSCALL1(free, 3, void*)
-DEFN_SYSCALL1(exit, 4, int)
-
+/* in system call number order (see modules/syscall.c) */
 static void *syscalls[] = {
     &print,
     &sleep,
-    &malloc,
-    &free,
-    &exit
+    &exit,
+    &fork,
+    &sbrk,
+    &shm_map,
+    &shm_unmap,
+    &shm_unlink,
+    &mprotect
 };
 size_t num_syscalls = sizeof(syscalls) / sizeof(*syscalls);
 
@@ -35,6 +36,9 @@ static void syscall_handler(struct regs *regs)
 
     void *location = syscalls[regs->eax];
 
+    /* some system calls (fork) need the caller's trap frame */
+    get_current_thread()->user_regs = regs;
+
     int ret;
     asm volatile (" \
       push %1; \
@@ -31,6 +31,8 @@
 #include "int.h"
 #include "timer.h"
 #include "string.h"
+#include "vm.h"
+#include "vmalloc.h"
 #include "thread.h"
 
 /* List of all threads in the system */
@@ -235,29 +237,29 @@ static void tlocal_exit(thread_t* thread)
 static inline void push_dword(thread_t* thread, uint32_t value)
 {
     thread->esp -= 4;
-    *(uint32_t*)thread->esp = value;
+    *(uint32_t*)(uintptr_t)thread->esp = value;
 }
 
 /*
  * Initialize members of a kernel thread
  */
-static void init_thread(thread_t* thread, void* stack_page,
-        void* user_stack_page, priority_t priority, bool detached)
+static void init_thread(thread_t* thread, void* stack, size_t stack_size,
+        address_space_t* as, priority_t priority, bool detached)
 {
     static unsigned int next_free_id = 0;
 
-    memset(thread, 0, sizeof(thread_t));
+    /* thread is expected to be zeroed already: either a page from
+     * `alloc_zeroed_page` or the main thread's (BSS) context */
 
     thread->id = next_free_id++;
 
-    thread->stack_base = stack_page;
-    /* TODO: don't assume thread stack is PAGE_SIZE bytes */
-    thread->esp = (uintptr_t)stack_page + PAGE_SIZE;
+    thread->stack_base = stack;
+    thread->esp = (uintptr_t)stack + stack_size;
     thread->stack_top = thread->esp;
 
-    thread->user_stack_base = user_stack_page;
-    thread->user_esp = (user_stack_page != NULL) ?
-            (uintptr_t)user_stack_page + PAGE_SIZE : 0;
+    /* user stack is faulted in on demand below USER_STACK_TOP */
+    thread->as = as;
+    thread->user_esp = (as != NULL) ? USER_STACK_TOP : 0;
 
     thread->priority = priority;
     thread->owner = detached ? NULL : g_current_thread;
@@ -275,40 +277,65 @@ static void init_thread(thread_t* thread, void* stack_page,
  * Create new raw thread object.
  * @returns NULL if out of memory
  */
-static thread_t* create_thread(unsigned int priority, bool detached, bool usermode)
+static thread_t* create_thread(unsigned int priority, bool detached,
+        address_space_t* as)
 {
-    thread_t *thread = alloc_page();
+    thread_t *thread = alloc_zeroed_page();
+    if (!thread && vm_reclaim(1) > 0) {
+        /* made room by swapping out user memory */
+        thread = alloc_zeroed_page();
+    }
     DEBUGF("Allocated thread 0x%X\n", thread);
     if (!thread) {
         kprintf("Failed to allocate page for thread\n");
         return NULL;
     }
 
-    void *stack_page = alloc_page();
-    if (!stack_page) {
-        kprintf("Failed to allocate page for thread stack\n");
+    /* an overflow runs into the guard page below and faults */
+    void *stack = vmalloc(THREAD_STACK_SIZE);
+    if (!stack) {
+        kprintf("Failed to allocate thread stack\n");
         free_page(thread);
         return NULL;
     }
 
-    void *user_stack_page = NULL;
-    if (usermode) {
-        user_stack_page = alloc_page();
-        if (!user_stack_page) {
-            kprintf("Failed to allocate page for thread user stack\n");
-            free_page(stack_page);
-            free_page(thread);
-            return NULL;
-        }
-    }
-
-    init_thread(thread, stack_page, user_stack_page, priority, detached);
+    init_thread(thread, stack, THREAD_STACK_SIZE, as, priority, detached);
 
     all_threads_add(thread);
 
     return thread;
 }
 
+/*
+ * Create an address space for a new user thread,
+ * with an (unpopulated) user stack and heap.
+ * @returns NULL if out of memory
+ */
+static address_space_t* create_user_address_space(void)
+{
+    address_space_t* as = address_space_create();
+    if (!as) {
+        kprintf("Failed to create address space for user thread\n");
+        return NULL;
+    }
+
+    if (vm_map_anon(as, USER_STACK_TOP - PAGE_SIZE, PAGE_SIZE,
+                VM_READ | VM_WRITE | VM_GROWSDOWN) != 0) {
+        kprintf("Failed to map user stack\n");
+        address_space_put(as);
+        return NULL;
+    }
+
+    /* the first heap page holds the user-mode allocator's state */
+    if (vm_sbrk(as, PAGE_SIZE) == -1) {
+        kprintf("Failed to map user heap\n");
+        address_space_put(as);
+        return NULL;
+    }
+
+    return as;
+}
+
 /*
  * Perform all necessary cleanup and destroy thread.
  * call with interrupts enabled.
@@ -318,9 +345,9 @@ static void destroy_thread(thread_t* thread)
     KASSERT(thread);
     cli();
 
-    free_page(thread->stack_base);
-    if (thread->user_stack_base) {
-        free_page(thread->user_stack_base);
+    vfree(thread->stack_base);
+    if (thread->as) {
+        address_space_put(thread->as);
     }
     free_page(thread);
 
@@ -370,13 +397,6 @@ static void launch_kernel_thread(void)
     sti();
 }
 
-static void launch_user_thread(void)
-{
-    /* Now, 'start' user mode */
-    extern void start_user_mode();
-    start_user_mode();
-}
-
 /*
  * Shutdown a kernel thread if it exits by falling
  * off the end of its start function
@@ -387,47 +407,45 @@ static void shutdown_kernel_thread(void)
     exit(0);
 }
 
-static void shutdown_user_thread(void)
-{
-    syscall_exit(0);
-}
-
 static void setup_thread_stack(thread_t* thread,
         thread_start_func_t start_func, uint32_t arg, bool usermode)
 {
-    uint32_t *esp = (uint32_t*)thread->esp;
+    uint32_t *esp = (uint32_t*)(uintptr_t)thread->esp;
 
     if (usermode) {
-        /* Set up CPL=3 stack */
-        uint32_t *uesp = thread->user_esp;
+        /* Set up CPL=3 stack, writing through the kernel's alias
+         * of the (not yet active) user stack page */
+        KASSERT(thread->as);
+        uint32_t *uesp = (uint32_t*)vm_populate(thread->as, thread->user_esp - 1);
         KASSERT(uesp != NULL);
+        uesp = (uint32_t*)((uintptr_t)uesp + 1);
 
         /* push the arg to the thread start function */
         *--uesp = arg;
 
-        /* push the address of the shutdown_thread function as the
-        * return address. this forces the thread to exit */
-        *--uesp = shutdown_user_thread;
+        /* user programs leave through the exit system call (see
+         * modules/start.s); returning from `start_func` faults */
+        *--uesp = 0;
 
-        thread->user_esp = uesp;
+        thread->user_esp -= 2 * sizeof(uint32_t);
 
         /* Set up CPL=0 stack */
         /* DEBUGF("Address of start_func: %X\n", start_func); */
-        *--esp = start_func;
+        *--esp = (uintptr_t)start_func;
 
         extern void start_user_mode(void);
-        *--esp = start_user_mode;
+        *--esp = (uintptr_t)start_user_mode;
     } else {
         /* push the arg to the thread start function */
         *--esp = arg;
 
         /* push the address of the shutdown_thread function as the
         * return address. this forces the thread to exit */
-        *--esp = shutdown_kernel_thread;
+        *--esp = (uintptr_t)shutdown_kernel_thread;
 
-        *--esp = start_func;
+        *--esp = (uintptr_t)start_func;
 
-        *--esp = launch_kernel_thread;
+        *--esp = (uintptr_t)launch_kernel_thread;
     }
 
     /* push general registers */
@@ -440,7 +458,36 @@ static void setup_thread_stack(thread_t* thread,
     *--esp = 0;     /* edi */
 
     /* update thread's ESP */
-    thread->esp = esp;
+    thread->esp = (uintptr_t)esp;
+}
+
+/*
+ * Build a child's kernel stack so that its first switch_to_thread
+ * 'returns' through `fork_return` straight back to user mode,
+ * with a copy of the parent's system call trap frame.
+ */
+static void setup_fork_stack(thread_t* thread, struct regs* parent_regs)
+{
+    /* the CPU also pushed the user ESP and SS for the ring change */
+    size_t frame_size = sizeof(struct regs) + 2 * sizeof(uint32_t);
+
+    uint32_t *esp = (uint32_t*)(thread->esp - frame_size);
+    memcpy(esp, parent_regs, frame_size);
+    ((struct regs*)esp)->eax = 0;   /* fork() returns 0 in the child */
+
+    extern void fork_return(void);
+    *--esp = (uintptr_t)fork_return;
+
+    /* push general registers */
+    *--esp = 0;     /* eax */
+    *--esp = 0;     /* ecx */
+    *--esp = 0;     /* edx */
+    *--esp = 0;     /* ebx */
+    *--esp = 0;     /* ebp */
+    *--esp = 0;     /* esi */
+    *--esp = 0;     /* edi */
+
+    thread->esp = (uintptr_t)esp;
 }
 
 static void idle(uint32_t arg)
@@ -448,6 +495,8 @@ static void idle(uint32_t arg)
     (void)arg; /* prevent compiler warnings */
     DEBUG("Idle thread idling\n");
     while (true) {
+        /* nothing else to do, so zero pages ahead of time */
+        refill_zeroed_pages(1);
         yield();
     }
 }
@@ -733,6 +782,16 @@ void make_runnable_atomic(thread_t* thread)
     sti();
 }
 
+/*
+ * Load the address space of the thread about to run.
+ * Called from `switch_to_thread` with interrupts disabled.
+ */
+void switch_thread_address_space(thread_t* thread)
+{
+    KASSERT(thread);
+    address_space_switch(thread->as);
+}
+
 /*
  * Schedule a runnable thread.
  * Called with interrupts disabled.
@@ -761,22 +820,94 @@ void schedule(void)
  * Start a kernel thread with a function to execute, an unsigned
  * integer argument to that function, its priority, and whether
  * it should be detached from the current running thread.
+ * User threads run programs instead (see spawn_program), since
+ * kernel code isn't mapped for ring 3.
  */
 thread_t* spawn_thread(thread_start_func_t start_func, uint32_t arg,
-        priority_t priority, bool detached, bool usermode)
+        priority_t priority, bool detached)
 {
     KASSERT(start_func);
 
-    thread_t* thread = create_thread(priority, detached, usermode);
+    thread_t* thread = create_thread(priority, detached, NULL);
     KASSERT(thread);    /* was thread created? */
 
-    setup_thread_stack(thread, start_func, arg, usermode);
+    setup_thread_stack(thread, start_func, arg, false);
+
+    make_runnable_atomic(thread);
+
+    return thread;
+}
+
+/*
+ * Start a user thread running the flat binary in the first `bytes`
+ * of block device `dev`, linked at USER_PROGRAM_START. Nothing is
+ * read up front: its pages are faulted in from `dev` when touched.
+ * @returns NULL if out of memory
+ */
+thread_t* spawn_program(struct block_device* dev, size_t bytes,
+        priority_t priority, bool detached)
+{
+    KASSERT(dev);
+    KASSERT(bytes > 0);
+
+    address_space_t* as = create_user_address_space();
+    if (!as) {
+        return NULL;
+    }
+    if (vm_map_device(as, USER_PROGRAM_START, bytes, VM_READ | VM_WRITE,
+                dev, 0, bytes) != 0) {
+        kprintf("Failed to map program\n");
+        address_space_put(as);
+        return NULL;
+    }
+
+    thread_t* thread = create_thread(priority, detached, as);
+    if (!thread) {
+        address_space_put(as);
+        return NULL;
+    }
+
+    setup_thread_stack(thread, (thread_start_func_t)USER_PROGRAM_START, 0, true);
 
     make_runnable_atomic(thread);
 
     return thread;
 }
 
+/*
+ * Duplicate the calling user thread and its address space.
+ * The child's memory is shared copy-on-write with the parent.
+ * Called from the `fork` system call.
+ *
+ * @returns the child's ID in the parent, 0 in the child,
+ *          -1 if out of memory
+ */
+int fork(void)
+{
+    thread_t* parent = g_current_thread;
+    KASSERT(parent);
+    KASSERT(parent->as);
+    KASSERT(parent->user_regs);
+
+    address_space_t* as = address_space_clone(parent->as);
+    if (!as) {
+        return -1;
+    }
+
+    thread_t* child = create_thread(parent->priority, true, as);
+    if (!child) {
+        address_space_put(as);
+        return -1;
+    }
+
+    setup_fork_stack(child, parent->user_regs);
+
+    bool iflag = beg_int_atomic();
+    make_runnable(child);
+    end_int_atomic(iflag);
+
+    return child->id;
+}
 
 /*
  * Initialize the scheduler.
@@ -786,18 +917,19 @@ thread_t* spawn_thread(thread_start_func_t start_func, uint32_t arg,
  */
 void scheduler_init(void)
 {
-    extern uintptr_t main_thread_addr, kernel_stack_bottom;
-    thread_t* main_thread = (thread_t*)&main_thread_addr;
+    extern char main_thread_addr[], kernel_stack_bottom[];
+    thread_t* main_thread = (thread_t*)main_thread_addr;
     KASSERT(main_thread);
 
-    init_thread(main_thread, (void*)&kernel_stack_bottom,
+    /* the boot stack from start.s (4KB, no guard page) */
+    init_thread(main_thread, kernel_stack_bottom, PAGE_SIZE,
             NULL, PRIORITY_NORMAL, true);
     g_current_thread = main_thread;
     all_threads_add(g_current_thread);
 
-    spawn_thread(idle, 0, PRIORITY_IDLE, true, false);
+    spawn_thread(idle, 0, PRIORITY_IDLE, true);
 
-    spawn_thread(reaper, 0, PRIORITY_NORMAL, true, false);
+    spawn_thread(reaper, 0, PRIORITY_NORMAL, true);
 }
 
 
@@ -916,6 +1048,41 @@ bool mutex_held(mutex_t* mutex)
     return false;
 }
 
+void completion_init(completion_t* completion)
+{
+    KASSERT(completion);
+    completion->done = false;
+    thread_queue_clear(&completion->wait_queue);
+}
+
+/*
+ * Signal a completion, waking every thread waiting for it.
+ * Doesn't sleep, so it may be called with interrupts disabled.
+ */
+void complete(completion_t* completion)
+{
+    KASSERT(completion);
+
+    bool iflag = beg_int_atomic();
+    completion->done = true;
+    wake_all(&completion->wait_queue);
+    end_int_atomic(iflag);
+}
+
+/*
+ * Sleep until a completion has been signalled.
+ */
+void wait_for_completion(completion_t* completion)
+{
+    KASSERT(completion);
+
+    bool iflag = beg_int_atomic();
+    while (!completion->done) {
+        wait(&completion->wait_queue);
+    }
+    end_int_atomic(iflag);
+}
+
 void disable_preemption(void)
 {
     g_preemption_disabled = true;
@@ -32,12 +32,18 @@
 
 /* forward declaration for now */
 struct user_context;
+struct address_space;
+struct block_device;
+struct regs;
 
 /* thread-local data */
 enum { MAX_TLOCAL_KEYS = 128 };
 typedef void (*tlocal_destructor_t)(void *);
 typedef unsigned int tlocal_key_t;
 
+/* size of each thread's kernel stack (vmalloc'd, below a guard page) */
+enum { THREAD_STACK_SIZE = 0x2000 };   /* 8KB */
+
 /* global quantum (number of ticks before current thread yields) */
 enum { THREAD_QUANTUM = 4 };
 
@@ -68,7 +74,8 @@ struct thread {
     priority_t priority;
 
     void* stack_base;
-    void* user_stack_base;
+    struct address_space* as;   /* NULL for kernel threads */
+    struct regs* user_regs;     /* trap frame of the current system call */
     struct thread* owner;
     int refcount;
 
@@ -104,6 +111,13 @@ struct mutex {
 };
 typedef struct mutex mutex_t;
 
+/* a one-shot event that threads can wait for (e.g. finished I/O) */
+struct completion {
+    bool done;
+    thread_queue_t wait_queue;
+};
+typedef struct completion completion_t;
+
 
 int join(thread_t* thread);
 void sleep(unsigned int milliseconds);
@@ -116,7 +130,10 @@ void make_runnable(thread_t* thread);
 void make_runnable_atomic(thread_t* thread);
 
 thread_t* spawn_thread(thread_start_func_t start_function,
-        uint32_t arg, priority_t priority, bool detached, bool usermode);
+        uint32_t arg, priority_t priority, bool detached);
+thread_t* spawn_program(struct block_device* dev, size_t bytes,
+        priority_t priority, bool detached);
+int fork(void);
 
 void schedule(void);
 void scheduler_init();
@@ -129,6 +146,10 @@ void mutex_lock(mutex_t* mutex);
 void mutex_unlock(mutex_t* mutex);
 bool mutex_held(mutex_t* mutex);
 
+void completion_init(completion_t* completion);
+void complete(completion_t* completion);
+void wait_for_completion(completion_t* completion);
+
 void thread_queue_clear(thread_queue_t* queue);
 bool thread_queue_empty(thread_queue_t* queue);
 void wake_all(thread_queue_t* wait_queue);
@@ -0,0 +1,247 @@
+#include "io.h"
+#include "mem.h"
+#include "string.h"
+#include "paging.h"
+#include "virtio.h"
+
+/*
+ * Legacy (virtio 0.9.5) PCI transport and split virtqueues.
+ *
+ * A virtqueue is three rings shared with the device: descriptors
+ * (buffers), the available ring (heads of chains given to the device)
+ * and the used ring (heads the device is done with). The caller
+ * serializes virtqueue_add/kick and virtqueue_get, e.g. by calling
+ * them with interrupts disabled.
+ */
+
+/* keep the compiler from reordering accesses to the rings */
+static inline void compiler_barrier(void)
+{
+    asm volatile ("" ::: "memory");
+}
+
+/*
+ * Reset the device at `iobase` and agree on features: those it
+ * offers that are also in `wanted`.
+ * @returns the features in use
+ */
+uint32_t virtio_pci_begin(uint16_t iobase, uint32_t wanted)
+{
+    outportb(iobase + VIRTIO_PCI_STATUS, 0);
+    outportb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK);
+    outportb(iobase + VIRTIO_PCI_STATUS,
+            VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    uint32_t features = inportl(iobase + VIRTIO_PCI_HOST_FEATURES) & wanted;
+    outportl(iobase + VIRTIO_PCI_GUEST_FEATURES, features);
+    return features;
+}
+
+void virtio_pci_set_status(uint16_t iobase, uint8_t status)
+{
+    uint8_t old = inportb(iobase + VIRTIO_PCI_STATUS);
+    outportb(iobase + VIRTIO_PCI_STATUS, old | status);
+}
+
+/*
+ * Set up queue `index` of the device, in the size it asks for.
+ * @returns the queue, or NULL if there's no such queue or no memory
+ */
+struct virtqueue* virtqueue_create(uint16_t iobase, unsigned int index,
+        uint32_t features)
+{
+    outportw(iobase + VIRTIO_PCI_QUEUE_SEL, index);
+    unsigned int size = inportw(iobase + VIRTIO_PCI_QUEUE_NUM);
+    if (!size || inportl(iobase + VIRTIO_PCI_QUEUE_PFN)) {
+        return NULL;    /* missing, or in use */
+    }
+
+    /* the used ring starts on the page after the available ring */
+    size_t avail_end = size * sizeof(struct vring_desc) +
+        (3 + size) * sizeof(uint16_t);
+    size_t used_start = page_align_up(avail_end);
+    size_t bytes = used_start + 3 * sizeof(uint16_t) +
+        size * 2 * sizeof(uint32_t);
+
+    struct virtqueue* vq = malloc(sizeof(*vq));
+    void** tokens = malloc(size * sizeof(void*));
+    /* the heap is physically contiguous, so a page aligned piece
+     * of it is what the device wants */
+    void* mem = malloc(bytes + PAGE_SIZE);
+    if (!vq || !tokens || !mem) {
+        free(vq);
+        free(tokens);
+        free(mem);
+        return NULL;
+    }
+    char* rings = (char*)page_align_up((uintptr_t)mem);
+    memset(rings, 0, bytes);
+    memset(tokens, 0, size * sizeof(void*));
+
+    vq->iobase = iobase;
+    vq->index = index;
+    vq->size = size;
+    vq->desc = (struct vring_desc*)rings;
+    vq->avail = (volatile uint16_t*)(rings + size * sizeof(struct vring_desc));
+    vq->used = (volatile uint32_t*)(rings + used_start);
+    vq->tokens = tokens;
+    vq->indirect = features & VIRTIO_F_INDIRECT_DESC;
+    vq->event_idx = features & VIRTIO_F_EVENT_IDX;
+    vq->avail_idx = vq->kicked_idx = vq->last_used = 0;
+
+    unsigned int i;
+    for (i = 0; i < size; i++) {
+        vq->desc[i].next = i + 1;
+    }
+    vq->free_head = 0;
+    vq->num_free = size;
+
+    outportl(iobase + VIRTIO_PCI_QUEUE_PFN,
+            virt_to_phys((uintptr_t)rings) >> PAGE_POWER);
+    return vq;
+}
+
+static inline uint16_t used_idx(struct virtqueue* vq)
+{
+    return ((volatile uint16_t*)vq->used)[1];
+}
+
+/*
+ * Make the buffer described by `n` pieces available to the device.
+ * With indirect descriptors and a `table` of at least `n` entries,
+ * it takes up a single ring descriptor. `token` is returned by
+ * virtqueue_get when the device is done with it.
+ * The device isn't told until virtqueue_kick.
+ * @returns 0, or -1 if the ring is too full
+ */
+int virtqueue_add(struct virtqueue* vq, struct virtio_sg* sg,
+        unsigned int n, struct vring_desc* table, void* token)
+{
+    KASSERT(n > 0);
+    uint16_t head = vq->free_head;
+
+    if (vq->indirect && table && n > 1) {
+        if (!vq->num_free) {
+            return -1;
+        }
+        unsigned int i;
+        for (i = 0; i < n; i++) {
+            table[i].addr = sg[i].addr;
+            table[i].len = sg[i].len;
+            table[i].flags = (sg[i].write ? VRING_DESC_F_WRITE : 0) |
+                (i + 1 < n ? VRING_DESC_F_NEXT : 0);
+            table[i].next = i + 1;
+        }
+        struct vring_desc* d = &vq->desc[head];
+        d->addr = kernel_virt_to_phys((uintptr_t)table);
+        d->len = n * sizeof(*table);
+        d->flags = VRING_DESC_F_INDIRECT;
+        vq->free_head = d->next;
+        vq->num_free--;
+    } else {
+        if (vq->num_free < n) {
+            return -1;
+        }
+        uint16_t i = head;
+        unsigned int k;
+        for (k = 0; k < n; k++) {
+            struct vring_desc* d = &vq->desc[i];
+            d->addr = sg[k].addr;
+            d->len = sg[k].len;
+            d->flags = (sg[k].write ? VRING_DESC_F_WRITE : 0) |
+                (k + 1 < n ? VRING_DESC_F_NEXT : 0);
+            i = d->next;    /* chained through the free list's links */
+        }
+        vq->free_head = i;
+        vq->num_free -= n;
+    }
+
+    vq->tokens[head] = token;
+    vq->avail[2 + (vq->avail_idx & (vq->size - 1))] = head;
+    /* descriptors before the index that publishes them (x86 keeps
+     * stores in order) */
+    compiler_barrier();
+    vq->avail[1] = ++vq->avail_idx;
+    return 0;
+}
+
+/*
+ * Tell the device about the buffers added since the last kick,
+ * unless it has said it doesn't need telling. Adding several buffers
+ * and kicking once saves all but one (expensive) exit to the host.
+ */
+void virtqueue_kick(struct virtqueue* vq)
+{
+    uint16_t old = vq->kicked_idx;
+    uint16_t new = vq->avail_idx;
+    if (old == new) {
+        return;
+    }
+    vq->kicked_idx = new;
+
+    /* the index must be visible before we look at what the device wants */
+    __sync_synchronize();
+
+    bool notify;
+    if (vq->event_idx) {
+        /* has the device asked to hear about an entry in (old, new]? */
+        uint16_t event = ((volatile uint16_t*)&vq->used[1 + 2 * vq->size])[0];
+        notify = (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+    } else {
+        notify = !(((volatile uint16_t*)vq->used)[0] & VRING_USED_F_NO_NOTIFY);
+    }
+    if (notify) {
+        outportw(vq->iobase + VIRTIO_PCI_QUEUE_NOTIFY, vq->index);
+    }
+}
+
+/*
+ * Take the next buffer the device is done with, and free its
+ * descriptors. Stores the number of bytes it wrote in `len`.
+ * @returns the buffer's token, or NULL if there's none
+ */
+void* virtqueue_get(struct virtqueue* vq, uint32_t* len)
+{
+    if (vq->last_used == used_idx(vq)) {
+        return NULL;
+    }
+    compiler_barrier();     /* read the entry after the index */
+
+    volatile uint32_t* elem = &vq->used[1 + 2 * (vq->last_used & (vq->size - 1))];
+    uint16_t head = elem[0];
+    if (len) {
+        *len = elem[1];
+    }
+    vq->last_used++;
+
+    uint16_t i = head;
+    unsigned int n = 1;
+    while (vq->desc[i].flags & VRING_DESC_F_NEXT) {
+        i = vq->desc[i].next;
+        n++;
+    }
+    vq->desc[i].next = vq->free_head;
+    vq->free_head = head;
+    vq->num_free += n;
+
+    void* token = vq->tokens[head];
+    vq->tokens[head] = NULL;
+    return token;
+}
+
+/*
+ * Ask for an interrupt when the device uses the next buffer.
+ * With event indexes the device raises one interrupt and then
+ * stays quiet until this is called again, so an interrupt handler
+ * reaps everything completed meanwhile for the price of one.
+ * @returns true, or false if buffers were used before it took
+ * effect (get them, then call this again)
+ */
+bool virtqueue_rearm(struct virtqueue* vq)
+{
+    if (vq->event_idx) {
+        vq->avail[2 + vq->size] = vq->last_used;
+    }
+    __sync_synchronize();
+    return vq->last_used == used_idx(vq);
+}
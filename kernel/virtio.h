@@ -0,0 +1,84 @@
+#ifndef DUNE_VIRTIO_H
+#define DUNE_VIRTIO_H
+
+#include "dune.h"
+
+/* legacy virtio PCI registers (I/O space, BAR0) */
+enum {
+    VIRTIO_PCI_HOST_FEATURES = 0x00,
+    VIRTIO_PCI_GUEST_FEATURES = 0x04,
+    VIRTIO_PCI_QUEUE_PFN = 0x08,
+    VIRTIO_PCI_QUEUE_NUM = 0x0C,
+    VIRTIO_PCI_QUEUE_SEL = 0x0E,
+    VIRTIO_PCI_QUEUE_NOTIFY = 0x10,
+    VIRTIO_PCI_STATUS = 0x12,
+    VIRTIO_PCI_ISR = 0x13,
+    VIRTIO_PCI_CONFIG = 0x14        /* device specific (no MSI-X) */
+};
+
+enum {
+    VIRTIO_STATUS_ACK = 1,
+    VIRTIO_STATUS_DRIVER = 2,
+    VIRTIO_STATUS_DRIVER_OK = 4,
+    VIRTIO_STATUS_FAILED = 0x80
+};
+
+enum { VIRTIO_ISR_QUEUE = 1 };
+
+/* feature bits common to all devices */
+enum {
+    VIRTIO_F_INDIRECT_DESC = 1 << 28,   /* descriptors may point to tables */
+    VIRTIO_F_EVENT_IDX = 1 << 29        /* used_event/avail_event */
+};
+
+struct vring_desc {
+    uint64_t addr;          /* physical */
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+enum {
+    VRING_DESC_F_NEXT = 1,
+    VRING_DESC_F_WRITE = 2,         /* device writes (otherwise reads) */
+    VRING_DESC_F_INDIRECT = 4       /* buffer is a table of descriptors */
+};
+
+enum { VRING_USED_F_NO_NOTIFY = 1 };
+
+/* one piece of a buffer handed to the device */
+struct virtio_sg {
+    uint32_t addr;          /* physical */
+    uint32_t len;
+    bool write;             /* the device writes it */
+};
+
+struct virtqueue {
+    uint16_t iobase;
+    unsigned int index;             /* queue number on the device */
+    unsigned int size;              /* entries (a power of 2) */
+    struct vring_desc* desc;
+    volatile uint16_t* avail;       /* flags, idx, ring[size], used_event */
+    volatile uint32_t* used;        /* flags|idx, {id, len}[size], avail_event */
+    void** tokens;                  /* caller's data for each head */
+    unsigned int num_free;          /* descriptors not in use */
+    uint16_t free_head;
+    uint16_t avail_idx;             /* entries made available */
+    uint16_t kicked_idx;            /* avail_idx at the last notification */
+    uint16_t last_used;             /* used entries consumed */
+    bool indirect;
+    bool event_idx;
+};
+
+uint32_t virtio_pci_begin(uint16_t iobase, uint32_t wanted);
+void virtio_pci_set_status(uint16_t iobase, uint8_t status);
+
+struct virtqueue* virtqueue_create(uint16_t iobase, unsigned int index,
+        uint32_t features);
+int virtqueue_add(struct virtqueue* vq, struct virtio_sg* sg,
+        unsigned int n, struct vring_desc* table, void* token);
+void virtqueue_kick(struct virtqueue* vq);
+void* virtqueue_get(struct virtqueue* vq, uint32_t* len);
+bool virtqueue_rearm(struct virtqueue* vq);
+
+#endif /* DUNE_VIRTIO_H */
@@ -0,0 +1,433 @@
+#include "io.h"
+#include "irq.h"
+#include "mem.h"
+#include "string.h"
+#include "paging.h"
+#include "thread.h"
+#include "blkdev.h"
+#include "virtio.h"
+#include "virtio_blk.h"
+
+/*
+ * virtio-blk: a paravirtual disk (QEMU/KVM). A request is a header,
+ * the data and a status byte, given to the host through a virtqueue
+ * as one indirect descriptor. The request thread hands over every
+ * request the I/O scheduler has queued and then notifies the host
+ * once; the interrupt handler reaps all completed requests. A block
+ * request whose memory takes more pieces than the device accepts
+ * goes as several virtio-blk requests.
+ */
+
+/* virtio-blk feature bits */
+enum {
+    VIRTIO_BLK_F_SEG_MAX = 1 << 2,
+    VIRTIO_BLK_F_RO = 1 << 5,
+    VIRTIO_BLK_F_FLUSH = 1 << 9
+};
+
+/* device config (from VIRTIO_PCI_CONFIG) */
+enum {
+    VIRTIO_BLK_CFG_CAPACITY = 0,    /* 64 bit, in sectors */
+    VIRTIO_BLK_CFG_SEG_MAX = 12
+};
+
+enum {
+    VIRTIO_BLK_T_IN = 0,
+    VIRTIO_BLK_T_OUT = 1,
+    VIRTIO_BLK_T_FLUSH = 4
+};
+
+enum { VIRTIO_BLK_S_OK = 0 };
+
+enum {
+    VBLK_SECTOR_SIZE = 512,
+    VBLK_MAX_BLOCKS = 256,      /* per request */
+    /* data pieces: one per page, plus one if it's not page aligned */
+    VBLK_MAX_SEGS = VBLK_MAX_BLOCKS * VBLK_SECTOR_SIZE / PAGE_SIZE + 1,
+    VBLK_MAX_INFLIGHT = 32
+};
+
+struct virtio_blk_hdr {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+};
+
+/* a request handed to the device; doesn't cross a page */
+struct vblk_req {
+    struct virtio_blk_hdr hdr;
+    uint8_t status;
+    struct vblk_req* lead;      /* first of those for a block request */
+    /* kept in the lead: */
+    block_request_t* request;
+    unsigned int pending;       /* not completed (+1 while queueing) */
+    bool failed;                /* one of them failed */
+    struct vblk_req* next_free;
+    struct vring_desc table[VBLK_MAX_SEGS + 2];     /* indirect descriptors */
+};
+
+enum { VBLK_REQS_PER_PAGE = PAGE_SIZE / sizeof(struct vblk_req) };
+
+struct vblk {
+    uint16_t iobase;
+    struct virtqueue* vq;
+    uint32_t features;
+    uint32_t sectors;           /* capacity (up to 2TB) */
+    unsigned int max_segs;      /* data pieces per request */
+    struct vblk_req* free_reqs;
+    unsigned int inflight;      /* requests the device has */
+    bool exclusive;             /* a flush is in flight */
+    thread_queue_t space_wait;  /* request thread, waiting for room */
+    block_device_t* dev;
+    struct vblk* next;
+};
+
+static struct vblk* g_vblks = NULL;
+
+/*
+ * Describe as much of the memory left in `it` as fits in `max`
+ * physically contiguous pieces, and store its size in sectors
+ * in `count`.
+ * @returns number of pieces, 0 if it can't be used
+ */
+static unsigned int build_sg(struct virtio_sg* sg, unsigned int max,
+        struct block_iter* it, bool write, unsigned int* count)
+{
+    size_t total = 0;
+    unsigned int n = 0;
+    void* addr;
+    size_t bytes;
+    while ((bytes = block_iter_next_page(it, &addr, SIZE_MAX)) > 0) {
+        uint32_t phys = kernel_virt_to_phys((uintptr_t)addr);
+        if (!phys) {
+            return 0;
+        }
+        if (n > 0 && sg[n - 1].addr + sg[n - 1].len == phys) {
+            sg[n - 1].len += bytes;
+        } else if (n == max) {
+            block_iter_unget(it, bytes);
+            break;
+        } else {
+            sg[n].addr = phys;
+            sg[n].len = bytes;
+            sg[n].write = write;
+            n++;
+        }
+        total += bytes;
+    }
+
+    /* end on a sector; the rest goes in the next request */
+    size_t extra = total % VBLK_SECTOR_SIZE;
+    block_iter_unget(it, extra);
+    total -= extra;
+    while (extra > 0) {
+        if (sg[n - 1].len <= extra) {
+            extra -= sg[n - 1].len;
+            n--;
+        } else {
+            sg[n - 1].len -= extra;
+            extra = 0;
+        }
+    }
+    *count = total / VBLK_SECTOR_SIZE;
+    return n;
+}
+
+/*
+ * Wait until there's room for another request. A flush waits for
+ * the requests in flight, since the device may complete requests
+ * in any order and a flush only covers writes that have completed.
+ * Called with interrupts disabled.
+ */
+static void wait_for_room(struct vblk* vb, bool flush)
+{
+    while (vb->exclusive || !vb->free_reqs || (flush && vb->inflight)) {
+        virtqueue_kick(vb->vq);     /* don't wait on what it hasn't seen */
+        wait(&vb->space_wait);
+    }
+}
+
+/*
+ * One fewer of a block request's pieces is outstanding: complete
+ * it after the last. Called with interrupts disabled.
+ */
+static void put_lead(struct vblk* vb, struct vblk_req* lead)
+{
+    if (--lead->pending > 0) {
+        return;
+    }
+    block_request_t* request = lead->request;
+    lead->request = NULL;
+    lead->next_free = vb->free_reqs;
+    vb->free_reqs = lead;
+    notify_requester(request, BLOCK_REQUEST_COMPLETE, lead->failed ? -1 : 0);
+}
+
+/*
+ * Give a request to the device (without notifying it), waiting
+ * for room if the queue is full.
+ * Called with interrupts disabled.
+ */
+static void vblk_queue(struct vblk* vb, block_request_t* request)
+{
+    bool flush = request->type == BLOCK_REQUEST_FLUSH;
+    bool write = request->type == BLOCK_REQUEST_WRITE;
+
+    if (!flush && (request->block_number >= vb->sectors ||
+                request->block_count > vb->sectors - request->block_number ||
+                (write && (vb->features & VIRTIO_BLK_F_RO)))) {
+        notify_requester(request, BLOCK_REQUEST_COMPLETE, -1);
+        return;
+    }
+
+    struct block_iter it;
+    block_iter_init(&it, request);
+    uint32_t sector = request->block_number;
+    unsigned int left = request->block_count;
+    struct vblk_req* lead = NULL;
+    do {
+        wait_for_room(vb, flush);
+        if (flush && !(vb->features & VIRTIO_BLK_F_FLUSH)) {
+            /* no write cache: the completed writes are on disk */
+            notify_requester(request, BLOCK_REQUEST_COMPLETE, 0);
+            return;
+        }
+
+        struct vblk_req* req = vb->free_reqs;
+        struct virtio_sg sg[VBLK_MAX_SEGS + 2];
+        unsigned int n = 1, count = 0;
+        if (!flush) {
+            unsigned int data = build_sg(&sg[1], vb->max_segs, &it, !write,
+                    &count);
+            if (!data || count > left) {
+                if (!lead) {
+                    notify_requester(request, BLOCK_REQUEST_COMPLETE, -1);
+                    return;
+                }
+                lead->failed = true;
+                break;
+            }
+            n += data;
+        }
+
+        req->hdr.type = flush ? VIRTIO_BLK_T_FLUSH :
+            (write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN);
+        req->hdr.ioprio = 0;
+        req->hdr.sector = flush ? 0 : sector;
+        req->status = 0xFF;
+        if (!lead) {
+            lead = req;
+            lead->request = request;
+            lead->pending = 1;
+            lead->failed = false;
+        }
+        req->lead = lead;
+
+        sg[0].addr = virt_to_phys((uintptr_t)&req->hdr);
+        sg[0].len = sizeof(req->hdr);
+        sg[0].write = false;
+        sg[n].addr = virt_to_phys((uintptr_t)&req->status);
+        sg[n].len = sizeof(req->status);
+        sg[n].write = true;
+        n++;
+
+        while (virtqueue_add(vb->vq, sg, n, req->table, req) < 0) {
+            /* without indirect descriptors, big requests need room */
+            virtqueue_kick(vb->vq);
+            wait(&vb->space_wait);
+        }
+        vb->free_reqs = req->next_free;
+        vb->inflight++;
+        vb->exclusive = flush;
+        lead->pending++;
+        sector += count;
+        left -= count;
+    } while (left > 0);
+
+    put_lead(vb, lead);
+}
+
+static void handle_vblk_requests(uint32_t arg)
+{
+    struct vblk* vb = (struct vblk*)arg;
+    while (true) {
+        block_request_t* request = block_device_pop_request(vb->dev);
+
+        /* pass on everything that's queued, then notify once */
+        bool iflag = beg_int_atomic();
+        do {
+            vblk_queue(vb, request);
+        } while ((request = block_device_try_pop_request(vb->dev)));
+        virtqueue_kick(vb->vq);
+        end_int_atomic(iflag);
+    }
+}
+
+static void vblk_complete(struct vblk* vb)
+{
+    struct vblk_req* req;
+    do {
+        while ((req = virtqueue_get(vb->vq, NULL)) != NULL) {
+            struct vblk_req* lead = req->lead;
+            if (req->status != VIRTIO_BLK_S_OK) {
+                lead->failed = true;
+            }
+            vb->inflight--;
+            if (req != lead) {
+                req->next_free = vb->free_reqs;
+                vb->free_reqs = req;
+            }
+            put_lead(vb, lead);
+        }
+    } while (!virtqueue_rearm(vb->vq));
+
+    if (!vb->inflight) {
+        vb->exclusive = false;
+    }
+    wake_all(&vb->space_wait);
+}
+
+static void virtio_blk_irq(struct regs* r)
+{
+    (void)r;
+    struct vblk* vb;
+    for (vb = g_vblks; vb; vb = vb->next) {
+        /* reading the ISR acknowledges the interrupt */
+        if (inportb(vb->iobase + VIRTIO_PCI_ISR) & VIRTIO_ISR_QUEUE) {
+            vblk_complete(vb);
+        }
+    }
+}
+
+static int vblk_open(block_device_t* dev)
+{
+    (void)dev;
+    return 0;
+}
+
+static int vblk_close(block_device_t* dev)
+{
+    (void)dev;
+    return 0;
+}
+
+static struct block_device_ops vblk_block_device_ops =
+{
+    vblk_open,
+    vblk_close,
+    NULL,
+};
+
+/*
+ * Set aside memory for up to `count` requests in flight.
+ * @returns 0, or -1 if out of memory
+ */
+static int alloc_reqs(struct vblk* vb, unsigned int count)
+{
+    unsigned int i;
+    struct vblk_req* page = NULL;
+    for (i = 0; i < count; i++) {
+        if (i % VBLK_REQS_PER_PAGE == 0) {
+            page = alloc_zeroed_page();
+            if (!page) {
+                return -1;
+            }
+        }
+        struct vblk_req* req = &page[i % VBLK_REQS_PER_PAGE];
+        req->next_free = vb->free_reqs;
+        vb->free_reqs = req;
+    }
+    return 0;
+}
+
+/*
+ * Take over the (legacy) virtio-blk device with registers at
+ * I/O port `iobase`, interrupting on PIC line `irq`.
+ */
+void virtio_blk_init(uint16_t iobase, unsigned int irq)
+{
+    static unsigned int disks = 0;
+    if (irq > 15) {
+        DEBUGF("virtio-blk: unusable IRQ %u\n", irq);
+        return;
+    }
+
+    struct vblk* vb = malloc(sizeof(*vb));
+    if (!vb) {
+        return;
+    }
+    memset(vb, 0, sizeof(*vb));
+    vb->iobase = iobase;
+    thread_queue_clear(&vb->space_wait);
+
+    vb->features = virtio_pci_begin(iobase, VIRTIO_F_INDIRECT_DESC |
+            VIRTIO_F_EVENT_IDX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO |
+            VIRTIO_BLK_F_FLUSH);
+
+    uint16_t config = iobase + VIRTIO_PCI_CONFIG;
+    vb->sectors = inportl(config + VIRTIO_BLK_CFG_CAPACITY);
+    if (inportl(config + VIRTIO_BLK_CFG_CAPACITY + 4)) {
+        vb->sectors = 0xFFFFFFFF;
+    }
+    vb->max_segs = VBLK_MAX_SEGS;
+    if (vb->features & VIRTIO_BLK_F_SEG_MAX) {
+        uint32_t seg_max = inportl(config + VIRTIO_BLK_CFG_SEG_MAX);
+        if (seg_max && seg_max < vb->max_segs) {
+            vb->max_segs = seg_max;
+        }
+    }
+
+    vb->vq = virtqueue_create(iobase, 0, vb->features);
+    if (!vb->vq) {
+        goto fail;
+    }
+    if (!(vb->features & VIRTIO_F_INDIRECT_DESC) &&
+            vb->max_segs + 2 > vb->vq->size) {
+        vb->max_segs = vb->vq->size - 2;
+    }
+    unsigned int reqs = VBLK_MAX_INFLIGHT;
+    if (reqs > vb->vq->size) {
+        reqs = vb->vq->size;
+    }
+    if (alloc_reqs(vb, reqs) < 0) {
+        goto fail;
+    }
+
+    char name[] = { 'v', 'd', 'a' + disks, '\0' };
+    vb->dev = register_block_device(name, VBLK_SECTOR_SIZE, vb,
+            &vblk_block_device_ops);
+    if (!vb->dev) {
+        goto fail;
+    }
+    disks++;
+    vb->dev->blocks = vb->sectors;
+    /* merge no further than one virtio-blk request takes (a buffer
+     * that isn't page aligned takes an extra piece) */
+    vb->dev->max_blocks = (vb->max_segs - 1) * (PAGE_SIZE / VBLK_SECTOR_SIZE);
+    if (vb->dev->max_blocks > VBLK_MAX_BLOCKS) {
+        vb->dev->max_blocks = VBLK_MAX_BLOCKS;
+    } else if (!vb->dev->max_blocks) {
+        vb->dev->max_blocks = 1;
+    }
+    vb->dev->max_segs = vb->max_segs;
+
+    bool iflag = beg_int_atomic();
+    vb->next = g_vblks;
+    g_vblks = vb;
+    end_int_atomic(iflag);
+    irq_install_handler(irq, virtio_blk_irq);
+
+    virtqueue_rearm(vb->vq);
+    virtio_pci_set_status(iobase, VIRTIO_STATUS_DRIVER_OK);
+    enable_irq(irq);
+
+    spawn_thread(handle_vblk_requests, (uint32_t)vb, PRIORITY_NORMAL, true);
+    DEBUGF("%s: virtio-blk, %u sectors, queue size %u, features %08X\n",
+            name, vb->sectors, vb->vq->size, vb->features);
+    return;
+
+fail:
+    /* the queue's and requests' memory stay with the device */
+    virtio_pci_set_status(iobase, VIRTIO_STATUS_FAILED);
+    free(vb);
+}
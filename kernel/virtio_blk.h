@@ -0,0 +1,13 @@
+#ifndef DUNE_VIRTIO_BLK_H
+#define DUNE_VIRTIO_BLK_H
+
+#include "dune.h"
+
+enum {
+    VIRTIO_VENDOR_ID = 0x1AF4,
+    VIRTIO_BLK_DEVICE_ID = 0x1001   /* legacy/transitional */
+};
+
+void virtio_blk_init(uint16_t iobase, unsigned int irq);
+
+#endif /* DUNE_VIRTIO_BLK_H */
@@ -0,0 +1,1031 @@
+#include "int.h"
+#include "mem.h"
+#include "cpu.h"
+#include "string.h"
+#include "thread.h"
+#include "paging.h"
+#include "swap.h"
+#include "shm.h"
+#include "vm.h"
+
+/* address space whose page directory is currently in CR3,
+ * or NULL if the kernel's page directory is loaded */
+static address_space_t* g_active_as;
+
+/* every address space, for the page replacement clock */
+static address_space_t* g_address_spaces;
+
+/* clock hand: the next user page considered for swapping out */
+static address_space_t* g_clock_as;
+static uintptr_t g_clock_addr;
+
+/* pages to swap out at once when memory runs out */
+enum { RECLAIM_BATCH = 8 };
+
+/*
+ * Unmap and free every page faulted into [start, end)
+ * (or swapped out of it). 4MB spans without a page table are
+ * skipped, and the unmapped pages are invalidated as one batch.
+ */
+static void free_pages(address_space_t* as, uintptr_t start, uintptr_t end)
+{
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, as->page_dir);
+
+    /* frames are freed before the flush: nothing can reuse
+     * them through a stale entry with interrupts disabled */
+    bool iflag = beg_int_atomic();
+    uintptr_t addr = start;
+    while (addr < end) {
+        uint32_t* pte = paging_get_pte(as->page_dir, addr, false);
+        if (!pte) {
+            /* nothing was ever faulted in here */
+            addr = (addr | ((1 << PDE_SHIFT) - 1)) + 1;
+            continue;
+        }
+
+        uint32_t old = *pte;
+        *pte = 0;
+        if (old & PTE_PRESENT) {
+            tlb_batch_add(&batch, addr);
+            free_page((void*)phys_to_virt(old & PAGE_MASK));
+        } else if (old & PTE_SWAPPED) {
+            swap_free_slot(swap_pte_slot(old));
+        }
+        addr += PAGE_SIZE;
+    }
+    tlb_batch_flush(&batch);
+    end_int_atomic(iflag);
+}
+
+/*
+ * Remove the 4MB pages of a huge page shm region.
+ */
+static void unmap_huge_pages(address_space_t* as, vm_region_t* region)
+{
+    uintptr_t addr;
+    for (addr = region->start; addr < region->end; addr += HUGE_PAGE_SIZE) {
+        unmap_huge_page(as->page_dir, addr);
+    }
+}
+
+/*
+ * Free a region (already unlinked from `as`) and its pages.
+ */
+static void destroy_region(address_space_t* as, vm_region_t* region)
+{
+    if (region->shm && region->shm->huge) {
+        unmap_huge_pages(as, region);
+    } else {
+        free_pages(as, region->start, region->end);
+    }
+    if (region->shm) {
+        shm_put(region->shm);
+    }
+    free(region);
+}
+
+/*
+ * Create a new address space with an empty user half.
+ * @returns NULL if out of memory
+ */
+address_space_t* address_space_create(void)
+{
+    address_space_t* as = malloc(sizeof(*as));
+    if (!as) {
+        return NULL;
+    }
+
+    as->page_dir = page_directory_create();
+    if (!as->page_dir) {
+        free(as);
+        return NULL;
+    }
+    as->cr3 = virt_to_phys((uintptr_t)as->page_dir);
+    as->refcount = 1;
+    as->regions = NULL;
+    as->brk = USER_HEAP_START;
+
+    bool iflag = beg_int_atomic();
+    as->next = g_address_spaces;
+    g_address_spaces = as;
+    end_int_atomic(iflag);
+
+    DEBUGF("new address space, page directory: 0x%x\n", as->cr3);
+
+    return as;
+}
+
+void address_space_get(address_space_t* as)
+{
+    KASSERT(as);
+
+    bool iflag = beg_int_atomic();
+    KASSERT(as->refcount > 0);
+    as->refcount++;
+    end_int_atomic(iflag);
+}
+
+/*
+ * Drop a reference to an address space, destroying it
+ * when the last reference is gone.
+ */
+void address_space_put(address_space_t* as)
+{
+    KASSERT(as);
+
+    bool iflag = beg_int_atomic();
+    KASSERT(as->refcount > 0);
+    if (--as->refcount > 0) {
+        end_int_atomic(iflag);
+        return;
+    }
+
+    /* a kernel thread may still be borrowing this page directory */
+    if (g_active_as == as) {
+        write_cr3(virt_to_phys((uintptr_t)kernel_page_directory()));
+        g_active_as = NULL;
+    }
+
+    address_space_t** a = &g_address_spaces;
+    while (*a != as) {
+        a = &(*a)->next;
+    }
+    *a = as->next;
+    if (g_clock_as == as) {
+        g_clock_as = as->next;
+        g_clock_addr = 0;
+    }
+    end_int_atomic(iflag);
+
+    while (as->regions) {
+        vm_region_t* region = as->regions;
+        as->regions = region->next;
+        destroy_region(as, region);
+    }
+
+    page_directory_destroy(as->page_dir);
+    free(as);
+}
+
+/*
+ * Make `as` the active address space.
+ *
+ * Kernel threads (as == NULL) keep whatever page directory is
+ * loaded, since the kernel half is identical in all of them.
+ * CR3 is only reloaded when the address space actually changes,
+ * and global kernel TLB entries survive the reload.
+ */
+void address_space_switch(address_space_t* as)
+{
+    KASSERT(!interrupts_enabled());
+
+    if (as == NULL || as == g_active_as) {
+        return;
+    }
+
+    write_cr3(as->cr3);
+    g_active_as = as;
+}
+
+/*
+ * Returns the address space whose page directory is loaded,
+ * or NULL for the kernel's page directory
+ */
+address_space_t* current_address_space(void)
+{
+    return g_active_as;
+}
+
+vm_region_t* vm_find_region(address_space_t* as, uintptr_t addr)
+{
+    KASSERT(as);
+
+    vm_region_t* region = as->regions;
+    while (region) {
+        if (addr >= region->start && addr < region->end) {
+            return region;
+        }
+        region = region->next;
+    }
+    return NULL;
+}
+
+/*
+ * Insert a region into an address space's sorted region list.
+ * @returns 0 on success, -1 if the region overlaps another region
+ */
+static int insert_region(address_space_t* as, vm_region_t* region)
+{
+    bool iflag = beg_int_atomic();
+
+    vm_region_t** r = &as->regions;
+    while (*r && (*r)->end <= region->start) {
+        r = &(*r)->next;
+    }
+    if (*r && (*r)->start < region->end) {
+        end_int_atomic(iflag);
+        return -1;
+    }
+    region->next = *r;
+    *r = region;
+
+    end_int_atomic(iflag);
+    return 0;
+}
+
+static int map_region(address_space_t* as, uintptr_t start, size_t len,
+        uint32_t flags, block_device_t* dev, unsigned int offset,
+        size_t device_bytes, struct shm_object* shm)
+{
+    KASSERT(as);
+    KASSERT(len > 0);
+
+    uintptr_t end = page_align_up(start + len);
+    if (start != page_align_down(start) || end > KERNEL_VBASE || end <= start) {
+        return -1;
+    }
+
+    vm_region_t* region = malloc(sizeof(*region));
+    if (!region) {
+        return -1;
+    }
+    region->start = start;
+    region->end = end;
+    region->flags = flags;
+    region->device = dev;
+    region->offset = offset;
+    region->device_bytes = device_bytes;
+    region->shm = shm;
+
+    if (insert_region(as, region) != 0) {
+        free(region);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reserve a zero-filled region of user memory.
+ * No memory is allocated until a page is first touched.
+ * @returns 0 on success, -1 on failure
+ */
+int vm_map_anon(address_space_t* as, uintptr_t start, size_t len,
+        uint32_t flags)
+{
+    return map_region(as, start, len, flags, NULL, 0, 0, NULL);
+}
+
+/*
+ * Reserve a region of user memory whose first `device_bytes`
+ * are read from `dev` at byte `offset` when first touched.
+ * The rest of the region is zero-filled.
+ * @returns 0 on success, -1 on failure
+ */
+int vm_map_device(address_space_t* as, uintptr_t start, size_t len,
+        uint32_t flags, block_device_t* dev, unsigned int offset,
+        size_t device_bytes)
+{
+    KASSERT(dev);
+    if (offset % dev->blocksize != 0 || device_bytes > len) {
+        return -1;
+    }
+    return map_region(as, start, len, flags, dev, offset, device_bytes, NULL);
+}
+
+/*
+ * Change the protection of the region starting at `start` to
+ * `flags`: VM_READ, optionally with VM_WRITE. Present pages are
+ * updated as one batch. Private pages regain write access through
+ * copy-on-write faults, as a forked child may still share them.
+ * @returns 0 on success, -1 if there is no such region
+ */
+int vm_protect(address_space_t* as, uintptr_t start, uint32_t flags)
+{
+    KASSERT(as);
+    if (!(flags & VM_READ) || (flags & ~(VM_READ | VM_WRITE))) {
+        return -1;
+    }
+
+    bool iflag = beg_int_atomic();
+    vm_region_t* region = vm_find_region(as, start);
+    if (!region || region->start != start ||
+            (region->shm && region->shm->huge)) {
+        end_int_atomic(iflag);
+        return -1;
+    }
+
+    bool changed = (region->flags ^ flags) & VM_WRITE;
+    region->flags = (region->flags & ~(VM_READ | VM_WRITE)) | flags;
+    if (changed) {
+        uint32_t prot = PTE_USER;
+        if (flags & VM_WRITE) {
+            prot |= region->shm ? PTE_WRITE : PTE_COW;
+        }
+        protect_range(as->page_dir, region->start, region->end, prot);
+    }
+    end_int_atomic(iflag);
+    return 0;
+}
+
+/*
+ * Find a free, `align` aligned range of `len` bytes
+ * in the shared memory part of an address space.
+ * @returns its address, or 0 if there is none
+ */
+static uintptr_t find_shm_gap(address_space_t* as, size_t len, size_t align)
+{
+    uintptr_t addr = USER_SHM_START;
+
+    bool iflag = beg_int_atomic();
+    vm_region_t* region;
+    for (region = as->regions; region && addr < USER_SHM_END; region = region->next) {
+        if (region->end <= addr) {
+            continue;
+        }
+        if (region->start >= addr + len) {
+            break;
+        }
+        addr = (region->end + align - 1) & ~(align - 1);
+    }
+    end_int_atomic(iflag);
+
+    if (addr >= USER_SHM_END || USER_SHM_END - addr < len) {
+        return 0;
+    }
+    return addr;
+}
+
+/*
+ * Map the 4MB pages of a huge page shm region.
+ * @returns 0 on success, -1 if 4KB pages are in the way
+ */
+static int map_huge_pages(address_space_t* as, vm_region_t* region)
+{
+    uint32_t flags = PTE_USER;
+    if (region->flags & VM_WRITE) {
+        flags |= PTE_WRITE;
+    }
+
+    unsigned int i;
+    for (i = 0; i < region->shm->num_frames; i++) {
+        uintptr_t phys = virt_to_phys((uintptr_t)region->shm->frames[i]);
+        if (map_huge_page(as->page_dir, region->start + i * HUGE_PAGE_SIZE,
+                    phys, flags) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Map all of shared memory object `shm` at a free address between
+ * USER_SHM_START and USER_SHM_END. 4KB page objects are faulted in
+ * like any other region; huge page objects are mapped right away.
+ * The mapping holds its own reference to `shm`.
+ * @returns the address of the mapping, or 0 on failure
+ */
+uintptr_t vm_map_shm(address_space_t* as, struct shm_object* shm,
+        uint32_t flags)
+{
+    KASSERT(as);
+    KASSERT(shm);
+
+    size_t align = shm->huge ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    uintptr_t start = find_shm_gap(as, shm->size, align);
+    if (!start) {
+        return 0;
+    }
+
+    shm_get(shm);
+    if (map_region(as, start, shm->size, flags, NULL, 0, 0, shm) != 0) {
+        shm_put(shm);
+        return 0;
+    }
+
+    if (shm->huge && map_huge_pages(as, vm_find_region(as, start)) != 0) {
+        vm_unmap(as, start);
+        return 0;
+    }
+    return start;
+}
+
+/*
+ * Remove the region starting at `start`, freeing its pages.
+ * @returns 0 on success, -1 if there is no such region
+ */
+int vm_unmap(address_space_t* as, uintptr_t start)
+{
+    KASSERT(as);
+
+    bool iflag = beg_int_atomic();
+    vm_region_t** r = &as->regions;
+    while (*r && (*r)->start != start) {
+        r = &(*r)->next;
+    }
+    vm_region_t* region = *r;
+    if (region) {
+        *r = region->next;
+    }
+    end_int_atomic(iflag);
+
+    if (!region) {
+        return -1;
+    }
+
+    destroy_region(as, region);
+    return 0;
+}
+
+/*
+ * Returns true if (part of) the page at `page_addr` is read from
+ * the region's backing device rather than zero-filled
+ */
+static bool page_has_device_data(vm_region_t* region, uintptr_t page_addr)
+{
+    return region->device && (page_addr - region->start) < region->device_bytes;
+}
+
+/*
+ * Read the device-backed contents of a freshly allocated page,
+ * zeroing whatever the device doesn't cover. May sleep.
+ * @returns 0 on success, -1 if the read failed
+ */
+static int fill_page(vm_region_t* region, uintptr_t page_addr, void* page)
+{
+    block_device_t* dev = region->device;
+    size_t region_off = page_addr - region->start;
+    size_t bytes = region->device_bytes - region_off;
+    if (bytes > PAGE_SIZE) {
+        bytes = PAGE_SIZE;
+    }
+    unsigned int blocks = (bytes + dev->blocksize - 1) / dev->blocksize;
+
+    /* device I/O sleeps, so let other threads run meanwhile */
+    bool iflag = interrupts_enabled();
+    if (!iflag) {
+        sti();
+    }
+    int rc = block_device_read(dev,
+            (region->offset + region_off) / dev->blocksize, blocks, page);
+    if (!iflag) {
+        cli();
+    }
+    if (rc < 0) {
+        return -1;
+    }
+
+    if (bytes < PAGE_SIZE) {
+        memset((char*)page + bytes, 0, PAGE_SIZE - bytes);
+    }
+    return 0;
+}
+
+/*
+ * Allocate a page for user memory, swapping out
+ * cold pages to make room if necessary. May sleep.
+ * @returns NULL if out of memory and swap
+ */
+static void* alloc_user_page(bool zeroed)
+{
+    for (;;) {
+        void* page = zeroed ? alloc_zeroed_page() : alloc_page();
+        if (page || vm_reclaim(RECLAIM_BATCH) == 0) {
+            return page;
+        }
+    }
+}
+
+/*
+ * Allocate, fill and map the page at `page_addr` in `region`,
+ * reading it back from swap if it was swapped out.
+ * @returns 0 on success, -1 if out of memory or a read failed
+ */
+static int fault_in_page(address_space_t* as, vm_region_t* region,
+        uintptr_t page_addr)
+{
+    bool iflag = beg_int_atomic();
+    uint32_t* pte = paging_get_pte(as->page_dir, page_addr, false);
+    uint32_t old_pte = pte ? *pte : 0;
+    end_int_atomic(iflag);
+
+    void* page = NULL;
+    bool failed = false;
+    if (region->shm) {
+        /* the object's page, which stays shared (and never swapped) */
+        unsigned int index = (page_addr - region->start) / PAGE_SIZE;
+        while (!(page = shm_get_page(region->shm, index)) &&
+                vm_reclaim(RECLAIM_BATCH) > 0) {
+            continue;
+        }
+    } else if (old_pte & PTE_SWAPPED) {
+        page = alloc_user_page(false);
+        if (page) {
+            failed = swap_read_page(swap_pte_slot(old_pte), page) != 0;
+        }
+    } else if (page_has_device_data(region, page_addr)) {
+        page = alloc_user_page(false);
+        if (page && fill_page(region, page_addr, page) != 0) {
+            free_page(page);
+            return -1;
+        }
+    } else {
+        /* anonymous memory: take a pre-zeroed page if there is one */
+        page = alloc_user_page(true);
+    }
+    if (!page) {
+        return -1;
+    }
+
+    /* accessed, so the clock doesn't pick it straight away */
+    uint32_t flags = PTE_USER | PTE_ACCESSED | PTE_PRESENT;
+    if (region->flags & VM_WRITE) {
+        flags |= PTE_WRITE;
+    }
+
+    iflag = beg_int_atomic();
+    pte = paging_get_pte(as->page_dir, page_addr, true);
+    if (!pte) {
+        end_int_atomic(iflag);
+        free_page(page);
+        return -1;
+    }
+    if (*pte != old_pte) {
+        /* someone else faulted it in while we slept (or a failed
+         * swap out put the page back) */
+        end_int_atomic(iflag);
+        free_page(page);
+        return 0;
+    }
+    if (failed) {
+        /* never map what might be garbage */
+        end_int_atomic(iflag);
+        free_page(page);
+        return -1;
+    }
+    *pte = virt_to_phys((uintptr_t)page) | flags;
+    if (old_pte & PTE_SWAPPED) {
+        swap_free_slot(swap_pte_slot(old_pte));
+    }
+    end_int_atomic(iflag);
+
+    return 0;
+}
+
+/*
+ * Grow a stack region down to cover `addr`, if `addr` lies
+ * just below a VM_GROWSDOWN region and within its size limit.
+ * @returns the grown region, or NULL
+ */
+static vm_region_t* grow_stack(address_space_t* as, uintptr_t addr)
+{
+    uintptr_t page_addr = page_align_down(addr);
+    vm_region_t* prev = NULL;
+    vm_region_t* region = as->regions;
+
+    while (region && region->start <= addr) {
+        prev = region;
+        region = region->next;
+    }
+
+    if (!region || !(region->flags & VM_GROWSDOWN)) {
+        return NULL;
+    }
+    if (region->end - page_addr > USER_STACK_MAX) {
+        return NULL;
+    }
+    if (prev && prev->end > page_addr) {
+        return NULL;
+    }
+
+    region->start = page_addr;
+    return region;
+}
+
+static int break_cow(address_space_t* as, uintptr_t page_addr);
+
+/*
+ * Make sure the page holding `addr` is present in `as`.
+ * Used by the kernel to initialize user memory before it runs.
+ * @returns kernel address aliasing `addr`, or NULL on failure
+ */
+void* vm_populate(address_space_t* as, uintptr_t addr)
+{
+    KASSERT(as);
+
+    vm_region_t* region = vm_find_region(as, addr);
+    if (!region) {
+        return NULL;
+    }
+
+    if (region->shm && region->shm->huge) {
+        /* mapped in full by vm_map_shm */
+        uintptr_t offset = addr - region->start;
+        return (char*)region->shm->frames[offset / HUGE_PAGE_SIZE] +
+                offset % HUGE_PAGE_SIZE;
+    }
+
+    /* faulting in may sleep (and let the page be swapped
+     * out again), so check again until it sticks */
+    for (;;) {
+        uint32_t* pte = paging_get_pte(as->page_dir, addr, false);
+        if (!pte || !(*pte & PTE_PRESENT)) {
+            if (fault_in_page(as, region, page_align_down(addr)) != 0) {
+                return NULL;
+            }
+            continue;
+        }
+
+        /* the kernel is about to write here, so the page must be private */
+        if ((*pte & PTE_COW) && (region->flags & VM_WRITE)) {
+            bool iflag = beg_int_atomic();
+            int rc = break_cow(as, page_align_down(addr));
+            end_int_atomic(iflag);
+            if (rc != 0) {
+                return NULL;
+            }
+            continue;
+        }
+
+        return (void*)(phys_to_virt(*pte & PAGE_MASK) + (addr & ~PAGE_MASK));
+    }
+}
+
+/*
+ * Duplicate an address space copy-on-write.
+ *
+ * Every present user page is shared between parent and child.
+ * Pages of writable regions are made read-only in both and marked
+ * PTE_COW, so the first write to either copy gets a private page.
+ * Swapped-out pages share their swap slot instead, and shared
+ * memory mappings simply stay shared.
+ * @returns the new address space, or NULL if out of memory
+ */
+address_space_t* address_space_clone(address_space_t* src)
+{
+    KASSERT(src);
+
+    address_space_t* as = address_space_create();
+    if (!as) {
+        return NULL;
+    }
+
+    as->brk = src->brk;
+
+    /* parent's writable mappings get downgraded */
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, src->page_dir);
+
+    vm_region_t** tail = &as->regions;
+    vm_region_t* region;
+    for (region = src->regions; region; region = region->next) {
+        vm_region_t* copy = malloc(sizeof(*copy));
+        if (!copy) {
+            tlb_batch_flush(&batch);
+            address_space_put(as);
+            return NULL;
+        }
+        *copy = *region;
+        copy->next = NULL;
+        if (copy->shm) {
+            shm_get(copy->shm);
+        }
+        *tail = copy;
+        tail = &copy->next;
+
+        /* shared memory stays shared with the child */
+        if (copy->shm && copy->shm->huge) {
+            if (map_huge_pages(as, copy) != 0) {
+                tlb_batch_flush(&batch);
+                address_space_put(as);
+                return NULL;
+            }
+            continue;
+        }
+
+        uintptr_t addr;
+        for (addr = region->start; addr < region->end; addr += PAGE_SIZE) {
+            bool iflag = beg_int_atomic();
+            uint32_t* src_pte = paging_get_pte(src->page_dir, addr, false);
+            if (!src_pte || !(*src_pte & (PTE_PRESENT | PTE_SWAPPED))) {
+                end_int_atomic(iflag);
+                continue;
+            }
+
+            uint32_t* dst_pte = paging_get_pte(as->page_dir, addr, true);
+            if (!dst_pte) {
+                tlb_batch_flush(&batch);
+                end_int_atomic(iflag);
+                address_space_put(as);
+                return NULL;
+            }
+
+            if (*src_pte & PTE_SWAPPED) {
+                *dst_pte = *src_pte;
+                swap_dup_slot(swap_pte_slot(*src_pte));
+                end_int_atomic(iflag);
+                continue;
+            }
+
+            if ((*src_pte & PTE_WRITE) && !region->shm) {
+                *src_pte = (*src_pte & ~PTE_WRITE) | PTE_COW;
+                tlb_batch_add(&batch, addr);
+            }
+            *dst_pte = *src_pte & ~PTE_ACCESSED;
+            get_page((void*)phys_to_virt(*src_pte & PAGE_MASK));
+            end_int_atomic(iflag);
+        }
+    }
+
+    bool iflag = beg_int_atomic();
+    tlb_batch_flush(&batch);
+    end_int_atomic(iflag);
+
+    return as;
+}
+
+/*
+ * Handle a write to a present, copy-on-write page.
+ * The last sharer simply regains write access; anyone
+ * else gets a private copy of the page.
+ * @returns 0 on success, -1 if out of memory
+ */
+static int break_cow(address_space_t* as, uintptr_t page_addr)
+{
+    KASSERT(!interrupts_enabled());
+
+    uint32_t* pte = paging_get_pte(as->page_dir, page_addr, false);
+    KASSERT(pte && (*pte & PTE_COW));
+
+    void* page = NULL;
+    if (page_refcount((void*)phys_to_virt(*pte & PAGE_MASK)) > 1) {
+        page = alloc_user_page(false);
+        if (!page) {
+            return -1;
+        }
+        /* allocating may have slept: if the page was swapped out
+         * meanwhile, the write simply faults again */
+        if ((*pte & (PTE_PRESENT | PTE_COW)) != (PTE_PRESENT | PTE_COW)) {
+            free_page(page);
+            return 0;
+        }
+    }
+
+    void* frame = (void*)phys_to_virt(*pte & PAGE_MASK);
+    uint32_t flags = (*pte & PTE_FLAGS_MASK & ~PTE_COW) | PTE_WRITE;
+
+    if (page_refcount(frame) == 1) {
+        *pte = virt_to_phys((uintptr_t)frame) | flags;
+        if (page) {
+            free_page(page);
+        }
+    } else {
+        memcpy(page, frame, PAGE_SIZE);
+        *pte = virt_to_phys((uintptr_t)page) | flags;
+        free_page(frame);
+    }
+
+    tlb_invalidate_page(page_addr);
+    return 0;
+}
+
+/*
+ * Resolve a page fault against the current address space.
+ * Called from the page fault handler with interrupts disabled.
+ * @returns 0 if the fault was resolved, -1 otherwise
+ */
+int vm_handle_fault(uintptr_t addr, uint32_t err_code)
+{
+    /* kernel threads have no user memory to fault in */
+    address_space_t* as = get_current_thread()->as;
+    if (!as || addr >= KERNEL_VBASE) {
+        return -1;
+    }
+
+    vm_region_t* region = vm_find_region(as, addr);
+
+    /* the only protection violation we resolve is a COW write */
+    if (err_code & PF_PRESENT) {
+        if (!region || !(err_code & PF_WRITE) || !(region->flags & VM_WRITE)) {
+            return -1;
+        }
+        uint32_t* pte = paging_get_pte(as->page_dir, addr, false);
+        if (!pte || !(*pte & PTE_COW)) {
+            return -1;
+        }
+        return break_cow(as, page_align_down(addr));
+    }
+
+    if (!region) {
+        region = grow_stack(as, addr);
+    }
+    if (!region) {
+        return -1;
+    }
+
+    if ((err_code & PF_WRITE) && !(region->flags & VM_WRITE)) {
+        return -1;
+    }
+
+    return fault_in_page(as, region, page_align_down(addr));
+}
+
+/*
+ * Move the end of an address space's heap by `increment` bytes,
+ * rounded to whole pages. The heap region is created on first
+ * growth; pages beyond a lowered break are freed.
+ * @returns the old break, or -1 on failure
+ */
+int vm_sbrk(address_space_t* as, int increment)
+{
+    KASSERT(as);
+
+    uintptr_t old_brk = as->brk;
+    uintptr_t new_brk = page_align_up(old_brk + increment);
+    if (increment == 0) {
+        return old_brk;
+    }
+    if ((increment > 0 && (new_brk < old_brk || new_brk > USER_STACK_TOP)) ||
+            (increment < 0 && (new_brk > old_brk || new_brk < USER_HEAP_START))) {
+        return -1;
+    }
+
+    vm_region_t* heap = vm_find_region(as, USER_HEAP_START);
+    if (!heap) {
+        /* first growth */
+        if (vm_map_anon(as, USER_HEAP_START, new_brk - USER_HEAP_START,
+                    VM_READ | VM_WRITE) != 0) {
+            return -1;
+        }
+        as->brk = new_brk;
+        return old_brk;
+    }
+
+    bool iflag = beg_int_atomic();
+    if (new_brk > old_brk && heap->next && heap->next->start < new_brk) {
+        /* would run into the next region */
+        end_int_atomic(iflag);
+        return -1;
+    }
+    heap->end = new_brk;
+    as->brk = new_brk;
+    end_int_atomic(iflag);
+
+    if (new_brk == USER_HEAP_START) {
+        vm_unmap(as, USER_HEAP_START);
+    }
+    free_pages(as, new_brk, old_brk);
+
+    return old_brk;
+}
+
+/*
+ * sbrk() system call: grow (or shrink) the caller's heap.
+ */
+int sbrk(int increment)
+{
+    address_space_t* as = get_current_thread()->as;
+    if (!as) {
+        return -1;
+    }
+    return vm_sbrk(as, increment);
+}
+
+/*
+ * mprotect() system call: make the caller's region starting at
+ * `addr` read-only (VM_READ) or writable (VM_READ | VM_WRITE).
+ * @returns 0 on success, -1 on failure
+ */
+int mprotect(void* addr, unsigned int prot)
+{
+    address_space_t* as = get_current_thread()->as;
+    if (!as) {
+        return -1;
+    }
+    return vm_protect(as, (uintptr_t)addr, prot);
+}
+
+/*
+ * Move the clock hand to the next page of user memory,
+ * skipping over missing page tables.
+ * @returns the hand's page table entry, or NULL if its page table
+ * is missing (also if there's no user memory to scan at all)
+ */
+static uint32_t* clock_advance(address_space_t** as_out, uintptr_t* addr_out)
+{
+    unsigned int wraps = 0;
+
+    if (!g_clock_as) {
+        g_clock_as = g_address_spaces;
+        g_clock_addr = 0;
+    }
+
+    while (g_clock_as) {
+        vm_region_t* region = g_clock_as->regions;
+        while (region && region->end <= g_clock_addr) {
+            region = region->next;
+        }
+
+        if (region) {
+            uintptr_t addr = (g_clock_addr > region->start) ?
+                    g_clock_addr : region->start;
+            uint32_t* pte = paging_get_pte(g_clock_as->page_dir, addr, false);
+            if (pte) {
+                g_clock_addr = addr + PAGE_SIZE;
+            } else {
+                /* skip the rest of the missing page table */
+                g_clock_addr = (addr | ((1 << PDE_SHIFT) - 1)) + 1;
+            }
+            *as_out = g_clock_as;
+            *addr_out = addr;
+            return pte;
+        }
+
+        /* on to the next address space */
+        if (g_clock_as->next) {
+            g_clock_as = g_clock_as->next;
+        } else if (++wraps < 2) {
+            g_clock_as = g_address_spaces;
+        } else {
+            break;
+        }
+        g_clock_addr = 0;
+    }
+    return NULL;
+}
+
+/*
+ * Free up to `count` pages by swapping out cold user pages.
+ *
+ * The clock hand sweeps over every address space's pages. A page
+ * accessed since the hand last passed gets a second chance (its
+ * accessed bit is cleared); otherwise it's written to swap. Pages
+ * shared copy-on-write are left alone. May sleep.
+ * @returns number of pages freed
+ */
+unsigned int vm_reclaim(unsigned int count)
+{
+    unsigned int freed = 0;
+    /* enough for two sweeps over every page */
+    unsigned int budget = 2 * mem_page_count();
+
+    bool iflag = beg_int_atomic();
+    while (freed < count && budget-- > 0 && swap_enabled()) {
+        address_space_t* as;
+        uintptr_t addr;
+        uint32_t* pte = clock_advance(&as, &addr);
+        if (!pte || !(*pte & PTE_PRESENT)) {
+            continue;
+        }
+
+        if (*pte & PTE_ACCESSED) {
+            *pte &= ~PTE_ACCESSED;
+            if (as == g_active_as) {
+                tlb_invalidate_page(addr);
+            }
+            continue;
+        }
+
+        void* frame = (void*)phys_to_virt(*pte & PAGE_MASK);
+        if (page_refcount(frame) != 1) {
+            continue;
+        }
+
+        int slot = swap_alloc_slot();
+        if (slot < 0) {
+            break;
+        }
+        uint32_t old_pte = *pte;
+        *pte = swap_pte(slot);
+        if (as == g_active_as) {
+            tlb_invalidate_page(addr);
+        }
+
+        /* sleeps; faults on the page wait until the write is done.
+         * `as` must outlive it to put the page back on failure */
+        address_space_get(as);
+        if (swap_write_page(slot, frame) != 0) {
+            /* still interrupts disabled: nobody has read the bad slot
+             * yet, so give the page back its frame. A child forked
+             * meanwhile keeps the slot and faults fatally on it. */
+            pte = paging_get_pte(as->page_dir, addr, false);
+            if (pte && *pte == swap_pte(slot)) {
+                *pte = old_pte;
+                swap_free_slot(slot);
+            } else {
+                free_page(frame);
+            }
+            address_space_put(as);
+            break;
+        }
+        address_space_put(as);
+        free_page(frame);
+        freed++;
+    }
+    end_int_atomic(iflag);
+
+    if (freed > 0) {
+        DEBUGF("swapped out %u pages\n", freed);
+    }
+    return freed;
+}
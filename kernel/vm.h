@@ -0,0 +1,90 @@
+#ifndef DUNE_VM_H
+#define DUNE_VM_H
+
+#include "dune.h"
+#include "blkdev.h"
+
+/* user stacks grow down from just below the kernel */
+#define USER_STACK_TOP KERNEL_VBASE
+enum { USER_STACK_MAX = 0x100000 };     /* 1MB stack limit */
+
+/* programs are loaded here (see spawn_program) */
+enum { USER_PROGRAM_START = 0x400000 };
+
+/* user heaps grow up from here (see sbrk) */
+enum { USER_HEAP_START = 0x40000000 };
+
+/* shared memory objects are mapped in this range (see shm_map) */
+#define USER_SHM_START 0x80000000
+#define USER_SHM_END 0xB0000000
+
+/* region flags */
+enum {
+    VM_READ      = 0x1,
+    VM_WRITE     = 0x2,
+    VM_GROWSDOWN = 0x4  /* stack: grows down on faults just below it */
+};
+
+struct shm_object;
+
+/*
+ * A range of user virtual memory whose pages are allocated
+ * lazily, on the first fault that touches them.
+ * Pages are zero-filled unless the region is backed by a device,
+ * or shared with other address spaces through a shm object.
+ */
+struct vm_region {
+    uintptr_t start;            /* first address (page aligned) */
+    uintptr_t end;              /* one past last address (page aligned) */
+    uint32_t flags;             /* VM_* flags */
+    block_device_t* device;     /* backing device, or NULL for anonymous */
+    unsigned int offset;        /* device byte offset of `start` */
+    size_t device_bytes;        /* bytes backed by device, rest zero-filled */
+    struct shm_object* shm;     /* shared memory object, or NULL */
+    struct vm_region* next;     /* next region (sorted by address) */
+};
+typedef struct vm_region vm_region_t;
+
+/*
+ * A user address space: a page directory whose kernel half
+ * is shared with every other address space, plus the regions
+ * of user memory it may fault in.
+ */
+struct address_space {
+    uint32_t* page_dir;     /* page directory (virtual address) */
+    uintptr_t cr3;          /* page directory (physical address) */
+    int refcount;           /* threads/owners holding a reference */
+    vm_region_t* regions;   /* sorted list of user regions */
+    uintptr_t brk;          /* end of the heap (page aligned) */
+    struct address_space* next; /* next in list of all address spaces */
+};
+typedef struct address_space address_space_t;
+
+address_space_t* address_space_create(void);
+address_space_t* address_space_clone(address_space_t* src);
+void address_space_get(address_space_t* as);
+void address_space_put(address_space_t* as);
+
+void address_space_switch(address_space_t* as);
+address_space_t* current_address_space(void);
+
+int vm_map_anon(address_space_t* as, uintptr_t start, size_t len,
+        uint32_t flags);
+int vm_map_device(address_space_t* as, uintptr_t start, size_t len,
+        uint32_t flags, block_device_t* dev, unsigned int offset,
+        size_t device_bytes);
+int vm_protect(address_space_t* as, uintptr_t start, uint32_t flags);
+uintptr_t vm_map_shm(address_space_t* as, struct shm_object* shm,
+        uint32_t flags);
+int vm_unmap(address_space_t* as, uintptr_t start);
+vm_region_t* vm_find_region(address_space_t* as, uintptr_t addr);
+
+void* vm_populate(address_space_t* as, uintptr_t addr);
+int vm_handle_fault(uintptr_t addr, uint32_t err_code);
+unsigned int vm_reclaim(unsigned int count);
+
+int vm_sbrk(address_space_t* as, int increment);
+int sbrk(int increment);
+int mprotect(void* addr, unsigned int prot);
+
+#endif /* DUNE_VM_H */
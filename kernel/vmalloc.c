@@ -0,0 +1,181 @@
+#include "int.h"
+#include "mem.h"
+#include "spinlock.h"
+#include "paging.h"
+#include "vmalloc.h"
+
+/*
+ * A virtually-contiguous allocation in the vmalloc area.
+ * Each area is preceded by an unmapped guard page, so running off
+ * either end of an allocation (e.g. overflowing a stack) faults
+ * instead of silently corrupting a neighbor.
+ */
+struct vm_area {
+    uintptr_t start;        /* first mapped page */
+    unsigned int pages;     /* number of mapped pages */
+    struct vm_area* next;   /* next area (sorted by address) */
+};
+
+enum { VM_AREA_GUARD_PAGES = 1 };
+
+/* sorted list of allocated areas */
+static struct vm_area* g_vm_areas;
+static spinlock_t g_vm_area_lock;
+
+/*
+ * Reserve `pages` pages (plus a guard page) of kernel virtual space.
+ * @returns the new area, or NULL if the vmalloc area is full
+ */
+static struct vm_area* reserve_area(struct vm_area* area, unsigned int pages)
+{
+    size_t span = (pages + VM_AREA_GUARD_PAGES) * PAGE_SIZE;
+
+    bool iflag = spin_lock(&g_vm_area_lock);
+
+    /* first fit */
+    uintptr_t start = VMALLOC_START;
+    struct vm_area** a = &g_vm_areas;
+    while (*a) {
+        uintptr_t next_start = (*a)->start - VM_AREA_GUARD_PAGES * PAGE_SIZE;
+        if (next_start - start >= span) {
+            break;
+        }
+        start = (*a)->start + (*a)->pages * PAGE_SIZE;
+        a = &(*a)->next;
+    }
+
+    if (VMALLOC_START + VMALLOC_SIZE - start < span) {
+        spin_unlock(&g_vm_area_lock, iflag);
+        return NULL;
+    }
+
+    area->start = start + VM_AREA_GUARD_PAGES * PAGE_SIZE;
+    area->pages = pages;
+    area->next = *a;
+    *a = area;
+
+    spin_unlock(&g_vm_area_lock, iflag);
+    return area;
+}
+
+static struct vm_area* remove_area(uintptr_t start)
+{
+    bool iflag = spin_lock(&g_vm_area_lock);
+
+    struct vm_area** a = &g_vm_areas;
+    while (*a && (*a)->start != start) {
+        a = &(*a)->next;
+    }
+    struct vm_area* area = *a;
+    if (area) {
+        *a = area->next;
+    }
+
+    spin_unlock(&g_vm_area_lock, iflag);
+    return area;
+}
+
+static void unmap_area(struct vm_area* area, unsigned int pages)
+{
+    unsigned int i;
+    for (i = 0; i < pages; i++) {
+        uint32_t pte = unmap_page(kernel_page_directory(), area->start + i * PAGE_SIZE);
+        free_page((void*)phys_to_virt(pte & PAGE_MASK));
+    }
+}
+
+/*
+ * Allocate `size` bytes of virtually-contiguous kernel memory,
+ * backed by (possibly non-contiguous) physical pages.
+ * @returns NULL if out of memory or kernel virtual space
+ */
+void* vmalloc(size_t size)
+{
+    KASSERT(size > 0);
+    unsigned int pages = page_align_up(size) / PAGE_SIZE;
+
+    struct vm_area* area = malloc(sizeof(*area));
+    if (!area) {
+        return NULL;
+    }
+    if (!reserve_area(area, pages)) {
+        DEBUGF("vmalloc area exhausted (%u pages)\n", pages);
+        free(area);
+        return NULL;
+    }
+
+    unsigned int i;
+    for (i = 0; i < pages; i++) {
+        void* page = alloc_page();
+        if (!page) {
+            unmap_area(area, i);
+            remove_area(area->start);
+            free(area);
+            return NULL;
+        }
+        /* vmalloc page tables exist from boot, so this can't fail */
+        int rc = map_page(kernel_page_directory(), area->start + i * PAGE_SIZE,
+                virt_to_phys((uintptr_t)page), PTE_WRITE);
+        KASSERT(rc == 0);
+    }
+
+    return (void*)area->start;
+}
+
+/*
+ * Unmap and free memory returned by `vmalloc`.
+ */
+void vfree(void* addr)
+{
+    struct vm_area* area = remove_area((uintptr_t)addr);
+    KASSERT(area);
+
+    unmap_area(area, area->pages);
+    free(area);
+}
+
+/*
+ * Map `size` bytes of device memory (e.g. MMIO registers) at
+ * physical address `phys` into the vmalloc area, uncached.
+ * @returns NULL if out of memory or kernel virtual space
+ */
+void* ioremap(uintptr_t phys, size_t size)
+{
+    KASSERT(size > 0);
+    uintptr_t base = page_align_down(phys);
+    unsigned int pages = (page_align_up(phys + size) - base) / PAGE_SIZE;
+
+    struct vm_area* area = malloc(sizeof(*area));
+    if (!area) {
+        return NULL;
+    }
+    if (!reserve_area(area, pages)) {
+        DEBUGF("vmalloc area exhausted (%u pages)\n", pages);
+        free(area);
+        return NULL;
+    }
+
+    unsigned int i;
+    for (i = 0; i < pages; i++) {
+        int rc = map_page(kernel_page_directory(), area->start + i * PAGE_SIZE,
+                base + i * PAGE_SIZE, PTE_WRITE | PTE_NOCACHE | PTE_WRITETHRU);
+        KASSERT(rc == 0);
+    }
+
+    return (void*)(area->start + (phys - base));
+}
+
+/*
+ * Unmap device memory mapped by `ioremap`.
+ */
+void iounmap(void* addr)
+{
+    struct vm_area* area = remove_area(page_align_down((uintptr_t)addr));
+    KASSERT(area);
+
+    unsigned int i;
+    for (i = 0; i < area->pages; i++) {
+        unmap_page(kernel_page_directory(), area->start + i * PAGE_SIZE);
+    }
+    free(area);
+}
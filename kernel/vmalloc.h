@@ -0,0 +1,11 @@
+#ifndef DUNE_VMALLOC_H
+#define DUNE_VMALLOC_H
+
+#include "dune.h"
+
+void* vmalloc(size_t size);
+void vfree(void* addr);
+void* ioremap(uintptr_t phys, size_t size);
+void iounmap(void* addr);
+
+#endif /* DUNE_VMALLOC_H */
@@ -0,0 +1,29 @@
+#include "syscall.h"
+#include "umalloc.h"
+
+/*
+ * Demo program, run from the initrd: builds its messages in
+ * the user heap and prints them through the kernel.
+ */
+int main(void)
+{
+    static const char hello[] = "Hello from usermode!\n";
+
+    unsigned int i;
+    for (i = 0; i < 5; i++) {
+        char* msg = umalloc(sizeof(hello));
+        if (!msg) {
+            return 1;
+        }
+
+        unsigned int j;
+        for (j = 0; j < sizeof(hello); j++) {
+            msg[j] = hello[j];
+        }
+        syscall_print(msg);
+        ufree(msg);
+
+        syscall_sleep(1000);
+    }
+    return 0;
+}
@@ -1,8 +1,9 @@
-; vim:syntax=nasm
 extern main
 
 section .text
 start:
     call main
-    ;jmp $
-    ret
+    mov ebx, eax                ; exit(main's result)
+    mov eax, 2                  ; exit system call (see kernel/syscall.c)
+    int 0x80
+    jmp $
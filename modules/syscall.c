@@ -0,0 +1,15 @@
+#include "syscall.h"
+
+/*
+ * User side of the system calls. The numbers are indexes into
+ * the kernel's table in kernel/syscall.c.
+ */
+DEFN_SYSCALL1(print, 0, const char*)
+DEFN_SYSCALL1(sleep, 1, unsigned int)
+DEFN_SYSCALL1(exit, 2, int)
+DEFN_SYSCALL0(fork, 3)
+DEFN_SYSCALL1(sbrk, 4, int)
+DEFN_SYSCALL3(shm_map, 5, const char*, unsigned int, unsigned int)
+DEFN_SYSCALL1(shm_unmap, 6, void*)
+DEFN_SYSCALL1(shm_unlink, 7, const char*)
+DEFN_SYSCALL2(mprotect, 8, void*, unsigned int)
@@ -0,0 +1,164 @@
+#include "syscall.h"
+#include "umalloc.h"
+
+/*
+ * User-mode heap allocator, linked into programs. It only enters
+ * the kernel (through sbrk) to grow the heap by whole pages.
+ *
+ * All of its state lives in the first page of the process heap,
+ * which every user address space starts with, so it's private to
+ * each process and copied by fork(). Small buffers are carved out
+ * of pages into per-size-class free lists; large ones get a run of
+ * pages of their own, kept on a first-fit list once freed.
+ */
+
+/* these match the kernel's (see kernel/mem.h and kernel/vm.h) */
+enum { PAGE_SIZE = 0x1000 };
+enum { USER_HEAP_START = 0x40000000 };
+
+/* block sizes (including the header) of the size classes */
+enum { UMALLOC_NUM_CLASSES = 7, UMALLOC_LARGE = 0xFF };
+static const size_t umalloc_block_sizes[UMALLOC_NUM_CLASSES] = {
+    32, 64, 128, 256, 512, 1024, 2048
+};
+
+/* prepended to every buffer */
+struct uheader {
+    uint32_t size_class;
+    uint32_t pages;         /* large buffers: length of the page run */
+};
+
+/* a free block/run, linked through its (unused) buffer */
+struct ufree {
+    struct uheader hdr;
+    struct ufree* next;
+};
+
+struct uheap {
+    struct ufree* free_blocks[UMALLOC_NUM_CLASSES];
+    struct ufree* free_runs;
+};
+
+static struct uheap* user_heap(void)
+{
+    return (struct uheap*)USER_HEAP_START;
+}
+
+static size_t page_align_up(size_t size)
+{
+    return (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+}
+
+/*
+ * Grow the heap by `pages` pages.
+ * @returns start of the new pages, or NULL if out of memory
+ */
+static void* grow_heap(unsigned int pages)
+{
+    int old_brk = syscall_sbrk(pages * PAGE_SIZE);
+    if (old_brk == -1) {
+        return NULL;
+    }
+    return (void*)old_brk;
+}
+
+static unsigned int block_class(size_t size)
+{
+    unsigned int cls;
+    for (cls = 0; cls < UMALLOC_NUM_CLASSES; cls++) {
+        if (size + sizeof(struct uheader) <= umalloc_block_sizes[cls]) {
+            return cls;
+        }
+    }
+    return UMALLOC_LARGE;
+}
+
+/*
+ * Split a new page into free blocks of size class `cls`.
+ * @returns 0 on success, -1 if out of memory
+ */
+static int refill_class(struct uheap* heap, unsigned int cls)
+{
+    char* page = grow_heap(1);
+    if (!page) {
+        return -1;
+    }
+
+    size_t block_size = umalloc_block_sizes[cls];
+    size_t off;
+    for (off = 0; off + block_size <= PAGE_SIZE; off += block_size) {
+        struct ufree* block = (struct ufree*)(page + off);
+        block->hdr.size_class = cls;
+        block->next = heap->free_blocks[cls];
+        heap->free_blocks[cls] = block;
+    }
+    return 0;
+}
+
+static void* alloc_large(struct uheap* heap, size_t size)
+{
+    unsigned int pages = page_align_up(size + sizeof(struct uheader)) / PAGE_SIZE;
+
+    /* first fit among freed runs */
+    struct ufree** r = &heap->free_runs;
+    while (*r && (*r)->hdr.pages < pages) {
+        r = &(*r)->next;
+    }
+
+    struct ufree* run = *r;
+    if (run) {
+        *r = run->next;
+    } else {
+        run = grow_heap(pages);
+        if (!run) {
+            return NULL;
+        }
+        run->hdr.pages = pages;
+    }
+    run->hdr.size_class = UMALLOC_LARGE;
+    return &run->hdr + 1;
+}
+
+/*
+ * Allocate a buffer of at least `size` bytes.
+ * @returns NULL if out of memory
+ */
+void* umalloc(size_t size)
+{
+    struct uheap* heap = user_heap();
+
+    if (size == 0) {
+        return NULL;
+    }
+
+    unsigned int cls = block_class(size);
+    if (cls == UMALLOC_LARGE) {
+        return alloc_large(heap, size);
+    }
+
+    if (!heap->free_blocks[cls] && refill_class(heap, cls) != 0) {
+        return NULL;
+    }
+    struct ufree* block = heap->free_blocks[cls];
+    heap->free_blocks[cls] = block->next;
+    return &block->hdr + 1;
+}
+
+void ufree(void* buffer)
+{
+    struct uheap* heap = user_heap();
+
+    if (!buffer) {
+        return;
+    }
+
+    struct ufree* block = (struct ufree*)((struct uheader*)buffer - 1);
+    unsigned int cls = block->hdr.size_class;
+    if (cls == UMALLOC_LARGE) {
+        block->next = heap->free_runs;
+        heap->free_runs = block;
+    } else {
+        block->next = heap->free_blocks[cls];
+        heap->free_blocks[cls] = block;
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef UMALLOC_H
+#define UMALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* user-mode heap allocator (see umalloc.c) */
+void* umalloc(size_t size);
+void ufree(void* buffer);
+
+#endif /* UMALLOC_H */
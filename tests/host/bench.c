@@ -0,0 +1,158 @@
+/*
+ * Microbenchmarks for kernel library routines.
+ * Byte throughput is reported in bytes per TSC cycle,
+ * everything else in operations per second.
+ */
+#include "mem.h"
+#include "string.h"
+#include "harness.h"
+
+enum { BENCH_BUF_SIZE = 1 << 20, BENCH_BYTES = 256 << 20 };
+
+static unsigned char g_src[BENCH_BUF_SIZE + 64], g_dst[BENCH_BUF_SIZE + 64];
+
+static const size_t sizes[] = {
+    16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576
+};
+enum { NUM_SIZES = sizeof(sizes) / sizeof(*sizes) };
+
+/* keeps the compiler from dropping benchmarked calls */
+static volatile uintptr_t g_sink;
+
+/*
+ * Bytes per cycle of `op` on `size` byte buffers
+ * (0: memcpy, 1: memset, 2: memmove with overlap)
+ */
+static double bytes_per_cycle(int op, size_t size)
+{
+    unsigned int iters = BENCH_BYTES / size, i;
+    if (iters > 1000000) {
+        iters = 1000000;
+    }
+
+    uint64_t start = host_cycles();
+    for (i = 0; i < iters; i++) {
+        switch (op) {
+            case 0:
+                g_sink += (uintptr_t)memcpy(g_dst, g_src, size);
+                break;
+            case 1:
+                g_sink += (uintptr_t)memset(g_dst, i, size);
+                break;
+            default:
+                g_sink += (uintptr_t)memmove(g_dst + 8, g_dst, size);
+                break;
+        }
+    }
+    uint64_t cycles = host_cycles() - start;
+
+    return (double)size * iters / cycles;
+}
+
+static void bench_copy(void)
+{
+    static const char* names[] = { "memcpy", "memset", "memmove" };
+    int op;
+    unsigned int i;
+
+    printf("%-8s %9s %12s %12s\n", "", "bytes", "B/cycle", "B/cycle");
+    printf("%-8s %9s %12s %12s\n", "", "", "(rep)", "(sse2)");
+    for (op = 0; op < 3; op++) {
+        for (i = 0; i < NUM_SIZES; i++) {
+            host_set_sse2(false);
+            double rep = bytes_per_cycle(op, sizes[i]);
+            host_set_sse2(true);
+            double sse2 = bytes_per_cycle(op, sizes[i]);
+            printf("%-8s %9zu %12.2f %12.2f\n", names[op], sizes[i], rep, sse2);
+        }
+    }
+}
+
+static void bench_strings(void)
+{
+    static const size_t lengths[] = { 8, 64, 256, 4096 };
+    unsigned int i, j;
+
+    printf("\n%-8s %9s %12s\n", "", "length", "Mops/sec");
+    for (i = 0; i < sizeof(lengths) / sizeof(*lengths); i++) {
+        size_t len = lengths[i];
+        memset(g_src, 'x', len);
+        memset(g_dst, 'x', len);
+        g_src[len] = g_dst[len] = '\0';
+        unsigned int iters = (64 << 20) / len;
+
+        double start = host_seconds();
+        for (j = 0; j < iters; j++) {
+            g_sink += strlen((char*)g_src);
+        }
+        printf("%-8s %9zu %12.2f\n", "strlen", len,
+                iters / (host_seconds() - start) / 1e6);
+
+        start = host_seconds();
+        for (j = 0; j < iters; j++) {
+            g_sink += strcmp((char*)g_src, (char*)g_dst);
+        }
+        printf("%-8s %9zu %12.2f\n", "strcmp", len,
+                iters / (host_seconds() - start) / 1e6);
+
+        start = host_seconds();
+        for (j = 0; j < iters; j++) {
+            g_sink += (uintptr_t)memchr(g_src, '\0', len + 1);
+        }
+        printf("%-8s %9zu %12.2f\n", "memchr", len,
+                iters / (host_seconds() - start) / 1e6);
+    }
+}
+
+static void bench_alloc(void)
+{
+    enum { ROUNDS = 200000, BATCH = 32 };
+    static void* items[BATCH];
+    static const size_t malloc_sizes[] = { 32, 256, 1024, 8192 };
+    unsigned int r, i;
+
+    printf("\n%-22s %12s\n", "", "Mops/sec");
+
+    double start = host_seconds();
+    for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < BATCH; i++) {
+            items[i] = alloc_page();
+        }
+        for (i = 0; i < BATCH; i++) {
+            free_page(items[i]);
+        }
+    }
+    printf("%-22s %12.2f\n", "alloc_page+free_page",
+            (double)ROUNDS * BATCH / (host_seconds() - start) / 1e6);
+
+    for (i = 0; i < sizeof(malloc_sizes) / sizeof(*malloc_sizes); i++) {
+        unsigned int j;
+        start = host_seconds();
+        for (r = 0; r < ROUNDS / 10; r++) {
+            for (j = 0; j < BATCH; j++) {
+                items[j] = malloc(malloc_sizes[i]);
+            }
+            for (j = 0; j < BATCH; j++) {
+                free(items[j]);
+            }
+        }
+        printf("malloc+free %-10zu %12.2f\n", malloc_sizes[i],
+                (double)ROUNDS / 10 * BATCH / (host_seconds() - start) / 1e6);
+    }
+
+    printf("%-22s %12.2f\n", "run queue (depth 1)",
+            bench_run_queue(1, 10000000) / 1e6);
+    printf("%-22s %12.2f\n", "run queue (depth 16)",
+            bench_run_queue(16, 200000) / 1e6);
+}
+
+int main(void)
+{
+    host_mem_init();
+
+    bench_copy();
+    bench_strings();
+    bench_alloc();
+
+    return 0;
+}
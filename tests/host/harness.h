@@ -0,0 +1,47 @@
+#ifndef DUNE_HOST_HARNESS_H
+#define DUNE_HOST_HARNESS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FAIL 0
+#define PASS 1
+#define ASSERT(x) \
+    do { \
+        if (!(x)) { \
+            printf("%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #x); \
+            return FAIL; \
+        } \
+    } while (0)
+
+/* shims.c */
+void host_mem_init(void);
+void host_set_sse2(bool enabled);
+uint64_t host_cycles(void);
+double host_seconds(void);
+extern uint32_t g_host_ticks;   /* returned by get_ticks() */
+
+/* test_thread.c */
+void host_while_asleep(void (*fn)(void));
+
+/* test suites: each returns the number of failed tests */
+int test_string(void);
+int test_mem(void);
+int test_thread(void);
+int test_block(void);
+
+/* benchmarks outside bench.c */
+double bench_run_queue(unsigned int depth, unsigned int rounds);
+
+#define RUN_TEST(fn) RUN_TEST_AS(fn, #fn)
+
+/* run a test reported as `name`, e.g. once per implementation */
+#define RUN_TEST_AS(fn, name) \
+    do { \
+        int passed_ = (fn)(); \
+        printf("  %-28s %s\n", name, passed_ == PASS ? "ok" : "FAILED"); \
+        failures += (passed_ != PASS); \
+    } while (0)
+
+#endif /* DUNE_HOST_HARNESS_H */
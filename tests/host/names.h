@@ -0,0 +1,28 @@
+/*
+ * Force-included (-include) into every harness translation unit,
+ * kernel sources included: renames kernel functions that clash
+ * with the host C library, so both can be linked together.
+ */
+#ifndef DUNE_HOST_NAMES_H
+#define DUNE_HOST_NAMES_H
+
+#define memset      dune_memset
+#define memcpy      dune_memcpy
+#define memmove     dune_memmove
+#define memcmp      dune_memcmp
+#define memchr      dune_memchr
+#define strlen      dune_strlen
+#define strnlen     dune_strnlen
+#define strcmp      dune_strcmp
+#define strncmp     dune_strncmp
+#define strcpy      dune_strcpy
+#define strncpy     dune_strncpy
+#define malloc      dune_malloc
+#define free        dune_free
+#define exit        dune_exit
+#define sleep       dune_sleep
+#define yield       dune_yield
+#define wait        dune_wait
+#define fork        dune_fork
+
+#endif /* DUNE_HOST_NAMES_H */
@@ -0,0 +1,20 @@
+#include "harness.h"
+
+int main(void)
+{
+    int failures = 0;
+
+    host_mem_init();
+
+    printf("string:\n");
+    failures += test_string();
+    printf("mem:\n");
+    failures += test_mem();
+    printf("thread:\n");
+    failures += test_thread();
+    printf("block:\n");
+    failures += test_block();
+
+    printf("%s (%d failed)\n", failures ? "FAILED" : "passed", failures);
+    return failures ? 1 : 0;
+}
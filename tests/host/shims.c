@@ -0,0 +1,152 @@
+/*
+ * Host replacements for the kernel services that the kernel library
+ * code under test calls: console output, halting, interrupt control
+ * and CPU feature queries. Interrupts are only simulated, so code
+ * asserting that they're disabled behaves as in the kernel.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <cpuid.h>
+#include <x86intrin.h>
+#include <sys/mman.h>
+
+#include "dune.h"
+#include "int.h"
+#include "cpu.h"
+#include "mem.h"
+#include "string.h"
+#include "multiboot.h"
+#include "harness.h"
+
+/* physical memory simulated by the harness, mapped where the kernel
+ * expects its direct map of RAM to be */
+enum { HOST_MEM_SIZE = 32 * 1024 * 1024 };
+
+static bool g_iflag = true;
+static bool g_sse2 = true;
+
+char g_bss, g_end;
+
+size_t kprintf(char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = vprintf(fmt, args);
+    va_end(args);
+    return n;
+}
+
+size_t dbgprintf(char* fmt, ...)
+{
+    (void)fmt;
+    return 0;
+}
+
+void khalt(void)
+{
+    fflush(stdout);
+    abort();
+}
+
+bool interrupts_enabled(void)
+{
+    return g_iflag;
+}
+
+void cli(void)
+{
+    g_iflag = false;
+}
+
+void sti(void)
+{
+    g_iflag = true;
+}
+
+bool beg_int_atomic(void)
+{
+    bool iflag = g_iflag;
+    g_iflag = false;
+    return iflag;
+}
+
+void end_int_atomic(bool iflag)
+{
+    g_iflag = iflag;
+}
+
+bool cpu_has_feature(uint32_t edx_feature)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    if (!g_sse2) {
+        edx &= ~CPUID_FEAT_EDX_SSE2;
+    }
+    return (edx & edx_feature) == edx_feature;
+}
+
+/* there are no interrupts to disable, so SSE2 is fine everywhere */
+bool cpu_user_mode(void)
+{
+    return false;
+}
+
+unsigned int cpu_id(void)
+{
+    return 0;
+}
+
+/*
+ * Choose whether the string routines may use SSE2.
+ */
+void host_set_sse2(bool enabled)
+{
+    g_sse2 = enabled;
+    string_init();
+}
+
+/*
+ * Set up the page allocator and kernel heap over
+ * HOST_MEM_SIZE bytes of memory mapped at KERNEL_VBASE.
+ */
+void host_mem_init(void)
+{
+    void* base = mmap((void*)KERNEL_VBASE, HOST_MEM_SIZE,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+            -1, 0);
+    if (base != (void*)KERNEL_VBASE) {
+        perror("mmap at KERNEL_VBASE");
+        khalt();
+    }
+
+    struct multiboot_info mbinfo = { 0 };
+    mbinfo.flags = MULTIBOOT_INFO_MEMORY;
+    mbinfo.mem_upper = HOST_MEM_SIZE / 1024;
+
+    /* pretend the kernel image occupies 1MB-2MB */
+    mem_init(&mbinfo, KERNEL_VBASE + 0x100000, KERNEL_VBASE + 0x200000);
+}
+
+uint64_t host_cycles(void)
+{
+    return __rdtsc();
+}
+
+double host_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* timer: tests move time forward by hand */
+uint32_t g_host_ticks;
+
+uint32_t get_ticks(void)
+{
+    return g_host_ticks;
+}
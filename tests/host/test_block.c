@@ -0,0 +1,598 @@
+/*
+ * Block request queueing: I/O scheduler ordering and merging, and
+ * splitting merged requests on completion. No driver is involved;
+ * requests are popped and completed by hand, or served right away
+ * by the "instant" scheduler below.
+ */
+#include "blkdev.h"
+#include "iosched.h"
+#include "bcache.h"
+#include "string.h"
+#include "timer.h"
+#include "harness.h"
+
+enum { DISK_BLOCKS = 64, MAX_REQUESTS = 16 };
+
+/* page aligned, so the pages requests touch are known */
+static char g_buffer[DISK_BLOCKS * BLOCK_SIZE] __attribute__((aligned(PAGE_SIZE)));
+static block_request_t g_requests[MAX_REQUESTS];
+static thread_queue_t g_driver_wait;
+static block_device_t g_dev;
+static unsigned int g_completed;
+
+static void count_completion(block_request_t* request)
+{
+    (void)request;
+    g_completed++;
+}
+
+static void setup(struct io_scheduler* sched)
+{
+    memset(&g_dev, 0, sizeof(g_dev));
+    g_dev.blocksize = BLOCK_SIZE;
+    g_dev.max_blocks = UINT32_MAX;
+    g_dev.max_segs = UINT32_MAX;
+    g_dev.wait_queue = &g_driver_wait;
+    thread_queue_clear(&g_driver_wait);
+    block_device_set_scheduler(&g_dev, sched);
+
+    g_completed = 0;
+    g_host_ticks = 0;
+}
+
+/*
+ * Submit request `i` for `count` blocks from `block`. Requests
+ * use the matching part of g_buffer if `contiguous` is set,
+ * otherwise a part that never continues another request's.
+ */
+static block_request_t* submit(unsigned int i, int type, unsigned int block,
+        unsigned int count, bool contiguous)
+{
+    char* buf = contiguous ? &g_buffer[block * BLOCK_SIZE] :
+            &g_buffer[(MAX_REQUESTS - i) * 2 * BLOCK_SIZE];
+    block_request_init(&g_requests[i], &g_dev, type, block, count, buf,
+            count_completion, NULL);
+    block_device_submit(&g_requests[i]);
+    return &g_requests[i];
+}
+
+static int test_deadline_order(void)
+{
+    setup(&io_sched_deadline);
+
+    submit(0, BLOCK_REQUEST_READ, 40, 1, false);
+    submit(1, BLOCK_REQUEST_READ, 10, 1, false);
+    submit(2, BLOCK_REQUEST_WRITE, 30, 1, false);
+    submit(3, BLOCK_REQUEST_READ, 20, 1, false);
+    ASSERT(g_dev.queued == 4);
+
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 10);
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 20);
+
+    /* behind the sweep: waits for it to wrap around */
+    submit(4, BLOCK_REQUEST_READ, 5, 1, false);
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 30);
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 40);
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 5);
+    ASSERT(g_dev.queued == 0);
+    return PASS;
+}
+
+static int test_deadline_expiry(void)
+{
+    setup(&io_sched_deadline);
+
+    submit(0, BLOCK_REQUEST_READ, 10, 1, false);
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 10);
+
+    /* the sweep would reach these first... */
+    submit(1, BLOCK_REQUEST_WRITE, 2, 1, false);
+    submit(2, BLOCK_REQUEST_READ, 4, 1, false);
+    submit(3, BLOCK_REQUEST_READ, 20, 1, false);
+    submit(4, BLOCK_REQUEST_READ, 30, 1, false);
+
+    /* ...but once reads expire, the oldest goes first */
+    g_host_ticks = TICKS_PER_SEC;
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 4);
+    /* the write's deadline is further off */
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 20);
+    g_host_ticks = 10 * TICKS_PER_SEC;
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 30);
+
+    /* expired writes aren't starved by a stream of expired reads */
+    submit(5, BLOCK_REQUEST_READ, 40, 1, false);
+    g_host_ticks = 11 * TICKS_PER_SEC;
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 2);
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 40);
+    return PASS;
+}
+
+static int test_deadline_merge(void)
+{
+    setup(&io_sched_deadline);
+
+    block_request_t* first = submit(0, BLOCK_REQUEST_WRITE, 0, 2, true);
+    submit(1, BLOCK_REQUEST_WRITE, 2, 2, true);            /* back merge */
+    submit(2, BLOCK_REQUEST_WRITE, 8, 2, true);
+    block_request_t* front = submit(3, BLOCK_REQUEST_WRITE, 6, 2, true);
+    submit(4, BLOCK_REQUEST_READ, 4, 2, true);             /* other type */
+    /* adjacent on disk, not in memory: drivers take it as another piece */
+    submit(5, BLOCK_REQUEST_WRITE, 10, 2, false);
+
+    block_request_t* request = block_device_pop_request(&g_dev);
+    ASSERT(request == first && request->block_count == 4);
+    request = block_device_pop_request(&g_dev);
+    ASSERT(request->type == BLOCK_REQUEST_READ);
+    request = block_device_pop_request(&g_dev);
+    ASSERT(request == front && request->block_count == 6);
+    ASSERT(request->pieces == 3);
+    ASSERT(g_dev.queued == 0);
+
+    /* the driver sees the last request's buffer as a separate piece */
+    struct block_iter it;
+    void* addr;
+    block_iter_init(&it, front);
+    ASSERT(block_iter_next(&it, &addr, SIZE_MAX) == 2 * BLOCK_SIZE &&
+            addr == g_buffer + 6 * BLOCK_SIZE);
+    ASSERT(block_iter_next(&it, &addr, SIZE_MAX) == 2 * BLOCK_SIZE &&
+            addr == g_buffer + 8 * BLOCK_SIZE);
+    ASSERT(block_iter_next(&it, &addr, SIZE_MAX) == 2 * BLOCK_SIZE &&
+            addr == g_requests[5].buffer);
+    ASSERT(block_iter_next(&it, &addr, SIZE_MAX) == 0);
+
+    /* completing a merged request completes everything in it */
+    notify_requester(first, BLOCK_REQUEST_COMPLETE, 0);
+    ASSERT(g_completed == 2);
+    ASSERT(first->block_count == 2);
+    ASSERT(g_requests[1].state == BLOCK_REQUEST_COMPLETE);
+    notify_requester(front, BLOCK_REQUEST_COMPLETE, -1);
+    ASSERT(g_completed == 5);
+    ASSERT(g_requests[2].ecode == -1 && g_requests[2].block_count == 2);
+    ASSERT(g_requests[5].ecode == -1);
+    return PASS;
+}
+
+static int test_merge_limit(void)
+{
+    setup(&io_sched_deadline);
+    g_dev.max_blocks = 4;
+
+    submit(0, BLOCK_REQUEST_READ, 0, 2, true);
+    submit(1, BLOCK_REQUEST_READ, 2, 2, true);
+    submit(2, BLOCK_REQUEST_READ, 4, 2, true);
+
+    ASSERT(block_device_pop_request(&g_dev)->block_count == 4);
+    ASSERT(block_device_pop_request(&g_dev)->block_count == 2);
+    return PASS;
+}
+
+static int test_vectored(void)
+{
+    setup(&io_sched_deadline);
+    g_dev.max_segs = 3;
+
+    /* blocks 2 and 3 come from two other pages */
+    struct block_seg segs[] = {
+        { g_buffer, 8 * BLOCK_SIZE, BLOCK_SIZE },
+        { g_buffer, 16 * BLOCK_SIZE, BLOCK_SIZE },
+        { g_buffer, 24 * BLOCK_SIZE, BLOCK_SIZE }
+    };
+    block_request_t* head = submit(0, BLOCK_REQUEST_READ, 0, 2, true);
+    block_request_init_vec(&g_requests[1], &g_dev, BLOCK_REQUEST_READ, 2,
+            &segs[0], 2, count_completion, NULL);
+    block_device_submit(&g_requests[1]);
+    ASSERT(g_requests[1].block_count == 2 && g_requests[1].pieces == 2);
+    /* would touch a fourth page */
+    block_request_init_vec(&g_requests[2], &g_dev, BLOCK_REQUEST_READ, 4,
+            &segs[2], 1, count_completion, NULL);
+    block_device_submit(&g_requests[2]);
+
+    block_request_t* request = block_device_pop_request(&g_dev);
+    ASSERT(request == head && request->block_count == 4);
+
+    /* the driver's view: the head's buffer, then the segments */
+    struct block_iter it;
+    void* addr;
+    block_iter_init(&it, request);
+    ASSERT(block_iter_next(&it, &addr, SIZE_MAX) == 2 * BLOCK_SIZE &&
+            addr == g_buffer);
+    ASSERT(block_iter_next(&it, &addr, SIZE_MAX) == BLOCK_SIZE &&
+            addr == g_buffer + 8 * BLOCK_SIZE);
+    ASSERT(block_iter_next(&it, &addr, SIZE_MAX) == BLOCK_SIZE &&
+            addr == g_buffer + 16 * BLOCK_SIZE);
+    ASSERT(block_iter_next(&it, &addr, SIZE_MAX) == 0);
+
+    /* or a block at a time */
+    block_iter_init(&it, request);
+    ASSERT(block_iter_next(&it, &addr, BLOCK_SIZE) == BLOCK_SIZE &&
+            addr == g_buffer);
+    ASSERT(block_iter_next(&it, &addr, BLOCK_SIZE) == BLOCK_SIZE &&
+            addr == g_buffer + BLOCK_SIZE);
+    ASSERT(block_iter_next(&it, &addr, BLOCK_SIZE) == BLOCK_SIZE &&
+            addr == g_buffer + 8 * BLOCK_SIZE);
+
+    /* a page at a time, handing back what didn't fit */
+    block_request_init(&g_requests[3], &g_dev, BLOCK_REQUEST_READ, 0, 2,
+            g_buffer + 7 * BLOCK_SIZE, count_completion, NULL);
+    block_iter_init(&it, &g_requests[3]);
+    ASSERT(block_iter_next_page(&it, &addr, SIZE_MAX) == BLOCK_SIZE &&
+            addr == g_buffer + 7 * BLOCK_SIZE);
+    block_iter_unget(&it, 100);
+    ASSERT(block_iter_next_page(&it, &addr, SIZE_MAX) == 100 &&
+            addr == g_buffer + 8 * BLOCK_SIZE - 100);
+    ASSERT(block_iter_next_page(&it, &addr, SIZE_MAX) == BLOCK_SIZE &&
+            addr == g_buffer + 8 * BLOCK_SIZE);
+    ASSERT(block_iter_next_page(&it, &addr, SIZE_MAX) == 0);
+
+    request = block_device_pop_request(&g_dev);
+    ASSERT(request == &g_requests[2] && request->block_count == 1);
+
+    notify_requester(head, BLOCK_REQUEST_COMPLETE, 0);
+    ASSERT(g_completed == 2 && head->block_count == 2);
+    return PASS;
+}
+
+static int test_deadline_barrier(void)
+{
+    setup(&io_sched_deadline);
+
+    submit(0, BLOCK_REQUEST_WRITE, 40, 1, false);
+    block_request_t* flush = submit(1, BLOCK_REQUEST_FLUSH, 0, 0, false);
+    submit(2, BLOCK_REQUEST_WRITE, 10, 1, false);
+    submit(3, BLOCK_REQUEST_READ, 20, 1, false);
+    ASSERT(g_dev.queued == 4);
+
+    /* nothing passes the flush in either direction */
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 40);
+    ASSERT(block_device_pop_request(&g_dev) == flush);
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 10);
+    ASSERT(block_device_try_pop_request(&g_dev)->block_number == 20);
+    ASSERT(g_dev.queued == 0);
+    ASSERT(block_device_try_pop_request(&g_dev) == NULL);
+    return PASS;
+}
+
+static int test_noop(void)
+{
+    setup(&io_sched_noop);
+
+    submit(0, BLOCK_REQUEST_READ, 30, 1, false);
+    submit(1, BLOCK_REQUEST_READ, 10, 2, true);
+    submit(2, BLOCK_REQUEST_READ, 12, 2, true);    /* merges with tail */
+    submit(3, BLOCK_REQUEST_READ, 20, 1, false);
+
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 30);
+    block_request_t* request = block_device_pop_request(&g_dev);
+    ASSERT(request->block_number == 10 && request->block_count == 4);
+    ASSERT(block_device_pop_request(&g_dev)->block_number == 20);
+    ASSERT(g_dev.queued == 0);
+    return PASS;
+}
+
+/*
+ * A scheduler that performs each request against g_disk as soon
+ * as it's submitted, so synchronous I/O never has to sleep. While
+ * g_hold_writes is set, writes wait for release_writes() instead.
+ */
+static char g_disk[DISK_BLOCKS * BLOCK_SIZE];
+static unsigned int g_disk_reads, g_disk_writes, g_disk_flushes;
+static unsigned int g_writes_at_flush;  /* g_disk_writes at the last flush */
+static bool g_hold_writes;
+static block_request_t* g_held;         /* by `next` */
+
+static void* instant_init(block_device_t* dev)
+{
+    (void)dev;
+    return &g_disk;
+}
+
+static void instant_exit(void* queue)
+{
+    (void)queue;
+}
+
+static void instant_add(block_device_t* dev, block_request_t* request)
+{
+    char* disk = &g_disk[request->block_number * dev->blocksize];
+    struct block_iter it;
+    void* addr;
+    size_t bytes;
+    if (g_hold_writes && request->type == BLOCK_REQUEST_WRITE) {
+        request->next = g_held;
+        g_held = request;
+        return;
+    }
+    if (request->type == BLOCK_REQUEST_FLUSH) {
+        g_disk_flushes++;
+        g_writes_at_flush = g_disk_writes;
+    } else {
+        block_iter_init(&it, request);
+        while ((bytes = block_iter_next(&it, &addr, SIZE_MAX)) > 0) {
+            if (request->type == BLOCK_REQUEST_READ) {
+                memcpy(addr, disk, bytes);
+            } else {
+                memcpy(disk, addr, bytes);
+            }
+            disk += bytes;
+        }
+        if (request->type == BLOCK_REQUEST_READ) {
+            g_disk_reads++;
+        } else {
+            g_disk_writes++;
+        }
+    }
+    dev->queued--;      /* never reaches the driver */
+    notify_requester(request, BLOCK_REQUEST_COMPLETE, 0);
+}
+
+static void release_writes(void)
+{
+    g_hold_writes = false;
+    while (g_held) {
+        block_request_t* request = g_held;
+        g_held = request->next;
+        instant_add(request->device, request);
+    }
+}
+
+static block_request_t* instant_next(block_device_t* dev)
+{
+    (void)dev;
+    return NULL;
+}
+
+static struct io_scheduler io_sched_instant = {
+    "instant",
+    instant_init,
+    instant_exit,
+    instant_add,
+    instant_next
+};
+
+static int test_bcache(void)
+{
+    setup(&io_sched_instant);
+    g_dev.id = 7;
+    unsigned int i;
+    for (i = 0; i < DISK_BLOCKS; i++) {
+        memset(&g_disk[i * BLOCK_SIZE], i, BLOCK_SIZE);
+    }
+    bcache_set_limit(4 * BLOCK_SIZE);
+    g_disk_reads = g_disk_writes = 0;
+
+    /* a second read of the same block is a hit */
+    buffer_t* a = bcache_read(&g_dev, 3);
+    ASSERT(a && ((unsigned char*)a->data)[0] == 3);
+    buffer_t* b = bcache_read(&g_dev, 3);
+    ASSERT(b == a && a->refcount == 2 && g_disk_reads == 1);
+    bcache_release(b);
+
+    /* written data goes to the device on sync, and stays cached */
+    memset(a->data, 0xEE, BLOCK_SIZE);
+    bcache_write(a);
+    ASSERT(g_disk_writes == 0);
+    ASSERT(bcache_sync(&g_dev) == 0);
+    ASSERT(g_disk_writes == 1 && (unsigned char)g_disk[3 * BLOCK_SIZE] == 0xEE);
+    bcache_release(a);
+
+    /* the least recently released block is evicted first
+     * (blocks are spaced out so they aren't read ahead) */
+    for (i = 10; i < 16; i += 2) {
+        bcache_release(bcache_read(&g_dev, i));
+    }
+    ASSERT(g_disk_reads == 4);
+    bcache_release(bcache_read(&g_dev, 3));
+    ASSERT(g_disk_reads == 4);
+    bcache_release(bcache_read(&g_dev, 16));    /* evicts 10 */
+    bcache_release(bcache_read(&g_dev, 3));
+    bcache_release(bcache_read(&g_dev, 12));
+    ASSERT(g_disk_reads == 5);
+    bcache_release(bcache_read(&g_dev, 10));
+    ASSERT(g_disk_reads == 6);
+
+    /* referenced buffers are never evicted */
+    buffer_t* held[6];
+    for (i = 0; i < 6; i++) {
+        held[i] = bcache_read(&g_dev, 20 + 2 * i);
+        ASSERT(held[i]);
+    }
+    for (i = 0; i < 6; i++) {
+        ASSERT(((unsigned char*)held[i]->data)[0] == 20 + 2 * i);
+        bcache_release(held[i]);
+    }
+
+    bcache_invalidate(&g_dev);
+    bcache_release(bcache_read(&g_dev, 30));
+    ASSERT(g_disk_reads == 13);
+
+    bcache_invalidate(&g_dev);
+    bcache_set_limit(BCACHE_DEFAULT_LIMIT);
+    return PASS;
+}
+
+static int test_readahead(void)
+{
+    setup(&io_sched_instant);
+    g_dev.id = 8;
+    unsigned int i;
+    for (i = 0; i < DISK_BLOCKS; i++) {
+        memset(&g_disk[i * BLOCK_SIZE], i, BLOCK_SIZE);
+    }
+    bcache_set_limit(32 * BLOCK_SIZE);
+    g_disk_reads = 0;
+
+    /* a sequential scan is served by a few large requests */
+    for (i = 0; i < 48; i++) {
+        buffer_t* buf = bcache_read(&g_dev, i);
+        ASSERT(buf && ((unsigned char*)buf->data)[BLOCK_SIZE - 1] == i);
+        bcache_release(buf);
+    }
+    ASSERT(g_disk_reads <= 12);
+
+    /* random reads don't read ahead */
+    bcache_invalidate(&g_dev);
+    g_disk_reads = 0;
+    bcache_release(bcache_read(&g_dev, 40));
+    bcache_release(bcache_read(&g_dev, 20));
+    bcache_release(bcache_read(&g_dev, 30));
+    bcache_release(bcache_read(&g_dev, 30));
+    ASSERT(g_disk_reads == 3);
+    bcache_release(bcache_read(&g_dev, 10));
+    ASSERT(g_disk_reads == 4);
+
+    /* interleaved streams are each detected */
+    bcache_invalidate(&g_dev);
+    g_disk_reads = 0;
+    for (i = 0; i < 16; i++) {
+        bcache_release(bcache_read(&g_dev, i));
+        buffer_t* buf = bcache_read(&g_dev, 32 + i);
+        ASSERT(buf && ((unsigned char*)buf->data)[0] == 32 + i);
+        bcache_release(buf);
+    }
+    ASSERT(g_disk_reads <= 12);     /* rather than 32 */
+
+    bcache_invalidate(&g_dev);
+    bcache_set_limit(BCACHE_DEFAULT_LIMIT);
+    return PASS;
+}
+
+static void write_block(unsigned int block, unsigned char value)
+{
+    buffer_t* buf = bcache_read(&g_dev, block);
+    memset(buf->data, value, BLOCK_SIZE);
+    bcache_write(buf);
+    bcache_release(buf);
+}
+
+/*
+ * Stands in for the flusher while a sync sleeps: first it starts
+ * writing block 44 and lets the sync's own (held) write finish,
+ * then it fails the write of block 44.
+ */
+static unsigned int g_race_step;
+
+static void flusher_races_sync(void)
+{
+    if (g_race_step++ == 0) {
+        block_request_t* ours = g_held;
+        g_held = NULL;
+        write_block(44, 0x44);
+        bcache_barrier(&g_dev);     /* held, like the sync's */
+        g_hold_writes = false;
+        instant_add(ours->device, ours);
+        g_hold_writes = true;
+    } else {
+        g_hold_writes = false;
+        while (g_held) {
+            block_request_t* request = g_held;
+            g_held = request->next;
+            g_dev.queued--;
+            notify_requester(request, BLOCK_REQUEST_COMPLETE, -1);
+        }
+    }
+}
+
+static int test_writeback(void)
+{
+    setup(&io_sched_instant);
+    g_dev.id = 9;
+    memset(g_disk, 0, sizeof(g_disk));
+    bcache_set_limit(16 * BLOCK_SIZE);
+    g_disk_reads = g_disk_writes = g_disk_flushes = 0;
+
+    /* writes are deferred, and adjacent blocks go out together */
+    unsigned int i;
+    for (i = 4; i > 0; i--) {
+        write_block(i, 0xA0 + i);
+    }
+    write_block(10, 0xAA);
+    ASSERT(g_disk_writes == 0);
+    ASSERT(bcache_sync(&g_dev) == 0);
+    ASSERT(g_disk_writes == 2 && g_disk_flushes == 1);
+    for (i = 1; i <= 4; i++) {
+        ASSERT((unsigned char)g_disk[(i + 1) * BLOCK_SIZE - 1] == 0xA0 + i);
+    }
+    ASSERT((unsigned char)g_disk[10 * BLOCK_SIZE] == 0xAA);
+
+    /* nothing left to write */
+    ASSERT(bcache_sync(&g_dev) == 0);
+    ASSERT(g_disk_writes == 2 && g_disk_flushes == 2);
+
+    /* dirty blocks aren't evicted */
+    write_block(40, 0x40);
+    unsigned int reads = g_disk_reads;
+    for (i = 0; i < 20; i++) {
+        bcache_release(bcache_read(&g_dev, 21 + 2 * i));
+    }
+    bcache_invalidate(&g_dev);
+    buffer_t* buf = bcache_read(&g_dev, 40);
+    ASSERT(buf && ((unsigned char*)buf->data)[0] == 0x40);
+    bcache_release(buf);
+    ASSERT(g_disk_reads == reads + 20);
+    ASSERT(g_disk[40 * BLOCK_SIZE] == 0);
+
+    /* a barrier writes everything, then flushes */
+    unsigned int writes = g_disk_writes, flushes = g_disk_flushes;
+    write_block(41, 0x41);
+    ASSERT(bcache_barrier(&g_dev) == 0);
+    ASSERT(g_disk_writes == writes + 1 && g_disk_flushes == flushes + 1);
+    ASSERT((unsigned char)g_disk[40 * BLOCK_SIZE] == 0x40);
+
+    /* data changed while it's being written goes out before the flush */
+    writes = g_disk_writes;
+    flushes = g_disk_flushes;
+    write_block(42, 0x42);
+    g_hold_writes = true;
+    ASSERT(bcache_barrier(&g_dev) == 0);
+    ASSERT(g_held && g_disk_writes == writes);
+    write_block(42, 0x43);
+    host_while_asleep(release_writes);
+    ASSERT(bcache_barrier(&g_dev) == 0);
+    host_while_asleep(NULL);
+    ASSERT(g_disk_writes == writes + 2 && g_disk_flushes == flushes + 2);
+    ASSERT(g_writes_at_flush == g_disk_writes);
+    ASSERT((unsigned char)g_disk[42 * BLOCK_SIZE] == 0x43);
+
+    /* a sync waits for writes the flusher starts meanwhile,
+     * and reports their errors */
+    write_block(43, 0x43);
+    g_hold_writes = true;
+    g_race_step = 0;
+    host_while_asleep(flusher_races_sync);
+    ASSERT(bcache_sync(&g_dev) == -1);
+    host_while_asleep(NULL);
+    ASSERT(g_race_step == 2 && !g_held);
+    ASSERT((unsigned char)g_disk[43 * BLOCK_SIZE] == 0x43);
+    ASSERT(bcache_sync(&g_dev) == 0);
+    ASSERT((unsigned char)g_disk[44 * BLOCK_SIZE] == 0x44);
+
+    /* past half the budget, writers start write-back themselves */
+    writes = g_disk_writes;
+    for (i = 0; i < 12; i++) {
+        write_block(2 * i, 0x55);
+    }
+    ASSERT(g_disk_writes > writes);
+
+    ASSERT(bcache_sync(&g_dev) == 0);
+    bcache_invalidate(&g_dev);
+    bcache_set_limit(BCACHE_DEFAULT_LIMIT);
+    return PASS;
+}
+
+int test_block(void)
+{
+    int failures = 0;
+
+    RUN_TEST(test_deadline_order);
+    RUN_TEST(test_deadline_expiry);
+    RUN_TEST(test_deadline_merge);
+    RUN_TEST(test_merge_limit);
+    RUN_TEST(test_vectored);
+    RUN_TEST(test_deadline_barrier);
+    RUN_TEST(test_noop);
+    RUN_TEST(test_bcache);
+    RUN_TEST(test_readahead);
+    RUN_TEST(test_writeback);
+
+    return failures;
+}
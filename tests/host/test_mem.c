@@ -0,0 +1,168 @@
+#include "mem.h"
+#include "string.h"
+#include "harness.h"
+
+enum { MAX_PAGES = 8192, NUM_BUFFERS = 512 };
+
+static void* g_pages[MAX_PAGES];
+
+/*
+ * Allocate every free page.
+ * @returns number of pages allocated
+ */
+static unsigned int alloc_all_pages(void)
+{
+    unsigned int n = 0;
+    while (n < MAX_PAGES && (g_pages[n] = alloc_page()) != NULL) {
+        n++;
+    }
+    return n;
+}
+
+static void free_pages(unsigned int n)
+{
+    while (n > 0) {
+        free_page(g_pages[--n]);
+    }
+}
+
+static int test_alloc_all_pages(void)
+{
+    unsigned int n = alloc_all_pages();
+    ASSERT(n > 0 && n < MAX_PAGES);
+
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+        uintptr_t addr = (uintptr_t)g_pages[i];
+        ASSERT(addr == page_align_down(addr));
+        ASSERT(addr >= KERNEL_VBASE);
+        ASSERT(addr < KERNEL_VBASE + mem_page_count() * PAGE_SIZE);
+        ASSERT(page_refcount(g_pages[i]) == 1);
+        /* every page is distinct and usable */
+        *(uint32_t*)g_pages[i] = i;
+    }
+    for (i = 0; i < n; i++) {
+        ASSERT(*(uint32_t*)g_pages[i] == i);
+    }
+
+    free_pages(n);
+
+    /* everything came back */
+    ASSERT(alloc_all_pages() == n);
+    free_pages(n);
+    return PASS;
+}
+
+static int test_page_refcount(void)
+{
+    void* page = alloc_page();
+    ASSERT(page);
+
+    get_page(page);
+    ASSERT(page_refcount(page) == 2);
+    free_page(page);
+    ASSERT(page_refcount(page) == 1);
+
+    /* still allocated: not handed out again */
+    void* other = alloc_page();
+    ASSERT(other && other != page);
+
+    free_page(other);
+    free_page(page);
+    return PASS;
+}
+
+static int test_zeroed_pages(void)
+{
+    unsigned int i;
+    for (i = 0; i < 64; i++) {
+        void* page = alloc_page();
+        ASSERT(page);
+        memset(page, 0xAA, PAGE_SIZE);
+        free_page(page);
+
+        if (i % 8 == 0) {
+            refill_zeroed_pages(4);
+        }
+
+        unsigned char* zeroed = alloc_zeroed_page();
+        ASSERT(zeroed);
+        size_t j;
+        for (j = 0; j < PAGE_SIZE; j++) {
+            ASSERT(zeroed[j] == 0);
+        }
+        free_page(zeroed);
+    }
+    return PASS;
+}
+
+static int test_huge_page(void)
+{
+    unsigned char* huge = alloc_huge_page();
+    ASSERT(huge);
+    ASSERT(((uintptr_t)huge - KERNEL_VBASE) % HUGE_PAGE_SIZE == 0);
+    ASSERT(page_refcount(huge) == 1);
+    memset(huge, 0x5A, HUGE_PAGE_SIZE);
+
+    /* single pages never come from inside it */
+    unsigned int n = alloc_all_pages(), i;
+    for (i = 0; i < n; i++) {
+        ASSERT((unsigned char*)g_pages[i] < huge ||
+                (unsigned char*)g_pages[i] >= huge + HUGE_PAGE_SIZE);
+    }
+    free_pages(n);
+
+    ASSERT(huge[0] == 0x5A && huge[HUGE_PAGE_SIZE - 1] == 0x5A);
+    free_huge_page(huge);
+
+    /* the run is free again, and so is everything else */
+    void* again = alloc_huge_page();
+    ASSERT(again == huge);
+    free_huge_page(again);
+    ASSERT(alloc_all_pages() == n + HUGE_PAGE_PAGES);
+    free_pages(n + HUGE_PAGE_PAGES);
+    return PASS;
+}
+
+static int test_malloc_free(void)
+{
+    static unsigned char* buffers[NUM_BUFFERS];
+    static size_t sizes[NUM_BUFFERS];
+    unsigned int seed = 3;
+    unsigned int round, i;
+
+    for (round = 0; round < 50; round++) {
+        for (i = 0; i < NUM_BUFFERS; i++) {
+            seed = seed * 1103515245u + 12345u;
+            sizes[i] = 1 + (seed >> 8) % ((i % 8 == 0) ? 3000 : 200);
+            buffers[i] = malloc(sizes[i]);
+            ASSERT(buffers[i]);
+            ASSERT(((uintptr_t)buffers[i] & 7) == 0);
+            memset(buffers[i], i & 0xFF, sizes[i]);
+        }
+
+        /* free in a scrambled order, checking nothing overlapped */
+        for (i = 0; i < NUM_BUFFERS; i++) {
+            unsigned int k = (i * 7) % NUM_BUFFERS;
+            size_t j;
+            for (j = 0; j < sizes[k]; j++) {
+                ASSERT(buffers[k][j] == (k & 0xFF));
+            }
+            free(buffers[k]);
+        }
+    }
+    return PASS;
+}
+
+int test_mem(void)
+{
+    int failures = 0;
+
+    RUN_TEST(test_alloc_all_pages);
+    RUN_TEST(test_page_refcount);
+    RUN_TEST(test_zeroed_pages);
+    RUN_TEST(test_huge_page);
+    RUN_TEST(test_malloc_free);
+
+    return failures;
+}
@@ -0,0 +1,161 @@
+#include "string.h"
+#include "harness.h"
+
+enum { BUF_SIZE = 8192 };
+
+static unsigned char g_buf[BUF_SIZE], g_ref[BUF_SIZE], g_tmp[BUF_SIZE];
+static unsigned int g_seed = 1;
+
+static unsigned int rnd(void)
+{
+    g_seed = g_seed * 1103515245u + 12345u;
+    return g_seed >> 8;
+}
+
+static void fill_random(unsigned char* buf, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        buf[i] = rnd();
+    }
+}
+
+/* byte-at-a-time reference memmove */
+static void ref_move(unsigned char* dst, const unsigned char* src, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        g_tmp[i] = src[i];
+    }
+    for (i = 0; i < n; i++) {
+        dst[i] = g_tmp[i];
+    }
+}
+
+static int ref_cmp(const unsigned char* p1, const unsigned char* p2,
+        size_t n, bool string)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (p1[i] != p2[i]) {
+            return p1[i] - p2[i];
+        }
+        if (string && p1[i] == '\0') {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static int sign(int x)
+{
+    return (x > 0) - (x < 0);
+}
+
+static bool same(const unsigned char* a, const unsigned char* b, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (a[i] != b[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Random sizes/alignments/overlaps against byte-wise references,
+ * covering both the rep movs/stos and (large) SSE2 paths.
+ */
+static int test_memcpy_memset_memmove(void)
+{
+    unsigned int i;
+    for (i = 0; i < 20000; i++) {
+        fill_random(g_buf, BUF_SIZE);
+        memcpy(g_ref, g_buf, BUF_SIZE);
+
+        size_t n = rnd() % (BUF_SIZE / 2);
+        size_t src = rnd() % (BUF_SIZE / 2);
+        size_t dst = rnd() % (BUF_SIZE / 2);
+        int c = rnd();
+
+        switch (rnd() % 3) {
+            case 0:
+                ref_move(g_ref + dst, g_ref + src, n);
+                ASSERT(memmove(g_buf + dst, g_buf + src, n) == g_buf + dst);
+                break;
+            case 1:
+                /* no overlap: dst in the upper half */
+                dst = BUF_SIZE / 2 + dst % (BUF_SIZE / 2 - n + 1);
+                src %= BUF_SIZE / 2 - n + 1;
+                ref_move(g_ref + dst, g_ref + src, n);
+                ASSERT(memcpy(g_buf + dst, g_buf + src, n) == g_buf + dst);
+                break;
+            default: {
+                size_t j;
+                for (j = 0; j < n; j++) {
+                    g_ref[dst + j] = c;
+                }
+                ASSERT(memset(g_buf + dst, c, n) == g_buf + dst);
+                break;
+            }
+        }
+        ASSERT(same(g_buf, g_ref, BUF_SIZE));
+    }
+    return PASS;
+}
+
+static int test_compare_scan(void)
+{
+    unsigned int i;
+    for (i = 0; i < 50000; i++) {
+        size_t off1 = rnd() % 8, off2 = rnd() % 8;
+        size_t n = rnd() % 100;
+        size_t len = rnd() % 120;
+        unsigned char* s1 = g_buf + off1;
+        unsigned char* s2 = g_ref + off2;
+        size_t j;
+
+        /* two-letter alphabet, so strings share long prefixes */
+        for (j = 0; j < 200; j++) {
+            s1[j] = s2[j] = 'a' + rnd() % 2;
+        }
+        s1[len] = s2[len] = '\0';
+        if (rnd() % 2) {
+            s2[rnd() % 130] = (rnd() % 3) ? 0xC3 : '\0';
+        }
+
+        ASSERT(sign(memcmp(s1, s2, n)) == sign(ref_cmp(s1, s2, n, false)));
+        ASSERT(sign(strcmp((char*)s1, (char*)s2)) ==
+                sign(ref_cmp(s1, s2, SIZE_MAX, true)));
+        ASSERT(sign(strncmp((char*)s1, (char*)s2, n)) ==
+                sign(ref_cmp(s1, s2, n, true)));
+
+        ASSERT((size_t)strlen((char*)s1) == len);
+        ASSERT(strnlen((char*)s1, n) == (len < n ? len : n));
+
+        unsigned char* b = NULL;
+        for (j = 0; j < n; j++) {
+            if (s1[j] == 'b') {
+                b = s1 + j;
+                break;
+            }
+        }
+        ASSERT(memchr(s1, 'b', n) == b);
+    }
+    return PASS;
+}
+
+int test_string(void)
+{
+    int failures = 0;
+
+    host_set_sse2(true);
+    RUN_TEST_AS(test_memcpy_memset_memmove, "test_memcpy_memset_memmove (sse2)");
+    RUN_TEST(test_compare_scan);
+
+    host_set_sse2(false);
+    RUN_TEST_AS(test_memcpy_memset_memmove, "test_memcpy_memset_memmove (no sse2)");
+
+    return failures;
+}
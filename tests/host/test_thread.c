@@ -0,0 +1,209 @@
+/*
+ * Thread queue tests. The queue helpers are static, so thread.c
+ * is compiled right into this file, with stubs for the parts of the
+ * kernel the scheduler calls but the queue code never reaches.
+ */
+#include "../../kernel/thread.c"
+#include "harness.h"
+
+enum { NUM_THREADS = 64 };
+
+static thread_t g_threads[NUM_THREADS];
+
+/* stand-ins for the sleeping thread and whoever runs meanwhile */
+static thread_t g_host_thread, g_idle_thread;
+static void (*g_while_asleep)(void);
+
+/* assembly entry points (start.s) */
+char main_thread_addr[PAGE_SIZE], kernel_stack_bottom[PAGE_SIZE];
+
+/* runs g_while_asleep, then "switches" straight back */
+void switch_to_thread(thread_t* thread)
+{
+    (void)thread;
+    if (g_while_asleep) {
+        g_while_asleep();
+        if (contains_thread(&run_queue, g_current_thread)) {
+            dequeue_thread(&run_queue, g_current_thread);
+        }
+        if (!contains_thread(&run_queue, &g_idle_thread)) {
+            make_runnable(&g_idle_thread);
+        }
+    }
+}
+
+void start_user_mode(void) { }
+void fork_return(void) { }
+
+/* virtual memory */
+void* vmalloc(size_t size) { (void)size; return NULL; }
+void vfree(void* addr) { (void)addr; }
+address_space_t* address_space_create(void) { return NULL; }
+address_space_t* address_space_clone(address_space_t* src) { (void)src; return NULL; }
+void address_space_put(address_space_t* as) { (void)as; }
+void address_space_switch(address_space_t* as) { (void)as; }
+int vm_map_anon(address_space_t* as, uintptr_t start, size_t len, uint32_t flags)
+{
+    (void)as; (void)start; (void)len; (void)flags;
+    return -1;
+}
+int vm_sbrk(address_space_t* as, int increment) { (void)as; (void)increment; return -1; }
+void* vm_populate(address_space_t* as, uintptr_t addr) { (void)as; (void)addr; return NULL; }
+unsigned int vm_reclaim(unsigned int count) { (void)count; return 0; }
+
+/*
+ * Let kernel code under test sleep: whenever it waits, `fn` runs in
+ * place of other threads, and should wake it (as an interrupt
+ * handler would). NULL turns this off again.
+ */
+void host_while_asleep(void (*fn)(void))
+{
+    bool iflag = beg_int_atomic();
+    if (fn) {
+        g_current_thread = &g_host_thread;
+        make_runnable(&g_idle_thread);
+    } else {
+        g_current_thread = NULL;
+        thread_queue_clear(&run_queue);
+    }
+    g_while_asleep = fn;
+    end_int_atomic(iflag);
+}
+
+static int test_enqueue_dequeue(void)
+{
+    thread_queue_t queue;
+    thread_queue_clear(&queue);
+    ASSERT(thread_queue_empty(&queue));
+
+    bool iflag = beg_int_atomic();
+
+    enqueue_thread(&queue, &g_threads[0]);
+    enqueue_thread(&queue, &g_threads[1]);
+    enqueue_thread(&queue, &g_threads[2]);
+    ASSERT(queue.head == &g_threads[0]);
+    ASSERT(queue.tail == &g_threads[2]);
+    ASSERT(contains_thread(&queue, &g_threads[1]));
+
+    /* middle */
+    dequeue_thread(&queue, &g_threads[1]);
+    ASSERT(!contains_thread(&queue, &g_threads[1]));
+    ASSERT(queue.head->queue_next == &g_threads[2]);
+
+    /* tail */
+    dequeue_thread(&queue, &g_threads[2]);
+    ASSERT(queue.head == &g_threads[0] && queue.tail == &g_threads[0]);
+
+    /* last one */
+    dequeue_thread(&queue, &g_threads[0]);
+    ASSERT(thread_queue_empty(&queue));
+
+    end_int_atomic(iflag);
+    return PASS;
+}
+
+static int test_run_queue_fifo(void)
+{
+    unsigned int i;
+    bool iflag = beg_int_atomic();
+
+    for (i = 0; i < NUM_THREADS; i++) {
+        make_runnable(&g_threads[i]);
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        ASSERT(get_next_runnable() == &g_threads[i]);
+    }
+    ASSERT(thread_queue_empty(&run_queue));
+
+    end_int_atomic(iflag);
+    return PASS;
+}
+
+static int test_wake(void)
+{
+    thread_queue_t waiters;
+    thread_queue_clear(&waiters);
+    unsigned int i;
+
+    bool iflag = beg_int_atomic();
+
+    for (i = 0; i < 4; i++) {
+        enqueue_thread(&waiters, &g_threads[i]);
+    }
+
+    wake_one(&waiters);
+    ASSERT(waiters.head == &g_threads[1]);
+    ASSERT(run_queue.head == &g_threads[0]);
+
+    wake_all(&waiters);
+    ASSERT(thread_queue_empty(&waiters));
+    for (i = 0; i < 4; i++) {
+        ASSERT(get_next_runnable() == &g_threads[i]);
+    }
+
+    end_int_atomic(iflag);
+    return PASS;
+}
+
+static int test_completion(void)
+{
+    completion_t done;
+    completion_init(&done);
+
+    bool iflag = beg_int_atomic();
+    enqueue_thread(&done.wait_queue, &g_threads[0]);
+    enqueue_thread(&done.wait_queue, &g_threads[1]);
+    end_int_atomic(iflag);
+
+    complete(&done);
+    ASSERT(done.done);
+    ASSERT(thread_queue_empty(&done.wait_queue));
+
+    iflag = beg_int_atomic();
+    ASSERT(get_next_runnable() == &g_threads[0]);
+    ASSERT(get_next_runnable() == &g_threads[1]);
+    end_int_atomic(iflag);
+
+    /* already signalled: doesn't sleep */
+    wait_for_completion(&done);
+    return PASS;
+}
+
+int test_thread(void)
+{
+    int failures = 0;
+
+    RUN_TEST(test_enqueue_dequeue);
+    RUN_TEST(test_run_queue_fifo);
+    RUN_TEST(test_wake);
+    RUN_TEST(test_completion);
+
+    return failures;
+}
+
+/*
+ * Make runnable/pick next for `depth` threads queued at once.
+ * @returns operations (enqueue + dequeue pairs) per second
+ */
+double bench_run_queue(unsigned int depth, unsigned int rounds)
+{
+    unsigned int r, i;
+    if (depth > NUM_THREADS) {
+        depth = NUM_THREADS;
+    }
+
+    bool iflag = beg_int_atomic();
+    double start = host_seconds();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < depth; i++) {
+            make_runnable(&g_threads[i]);
+        }
+        for (i = 0; i < depth; i++) {
+            get_next_runnable();
+        }
+    }
+    double elapsed = host_seconds() - start;
+    end_int_atomic(iflag);
+
+    return (double)depth * rounds / elapsed;
+}
@@ -63,7 +63,29 @@ int test_strncmp()
 
     ASSERT(strcmp(s4, s4) == 0);
 
+    ASSERT(strncmp(s1, s4, 5) == 0);
+    ASSERT(strncmp(s1, s4, 6) < 0);
+    ASSERT(strncmp(s1, s3, 4) == 0);
+    ASSERT(strncmp(s1, s3, 5) > 0);
+    ASSERT(strncmp(s1, s2, 0) == 0);
+
     return PASS;
+}
+
+int test_strlen()
+{
+    char* s = "Hello, world";
+
+    ASSERT(strlen("") == 0);
+    ASSERT(strlen(s) == 12);
+    ASSERT(strlen(s + 1) == 11);
+
+    ASSERT(strnlen(s, 5) == 5);
+    ASSERT(strnlen(s, 100) == 12);
+
+    ASSERT(memchr(s, 'w', 12) == s + 7);
+    ASSERT(memchr(s, 'w', 7) == NULL);
+    ASSERT(memchr(s, '\0', 13) == s + 12);
 
     return PASS;
 }
@@ -107,6 +129,42 @@ int test_strncpy()
     return PASS;
 }
 
+int test_memset()
+{
+    char buf[16] = "abcdefghijklmno";
+    unsigned int i;
+
+    memset(buf, 'x', 0);
+    ASSERT(buf[0] == 'a');
+
+    memset(buf + 1, 'x', 5);
+    ASSERT(buf[0] == 'a');
+    for (i = 1; i < 6; i++) {
+        ASSERT(buf[i] == 'x');
+    }
+    ASSERT(buf[6] == 'g');
+
+    return PASS;
+}
+
+int test_memmove()
+{
+    char buf[16] = "abcdefghijklmno";
+
+    /* overlapping, dst above src */
+    memmove(buf + 2, buf, 7);
+    ASSERT(strncmp(buf, "ababcdefgjk", 11) == 0);
+
+    /* overlapping, dst below src */
+    memmove(buf, buf + 2, 7);
+    ASSERT(strncmp(buf, "abcdefgfgjk", 11) == 0);
+
+    ASSERT(memcpy(buf, "0123", 4) == buf);
+    ASSERT(strncmp(buf, "0123efg", 7) == 0);
+
+    return PASS;
+}
+
 int main(void)
 {
     if (test_strcmp() != PASS) {
@@ -117,6 +175,10 @@ int main(void)
         return 1;
     }
 
+    if (test_strlen() != PASS) {
+        return 1;
+    }
+
     if (test_strcpy() != PASS) {
         return 1;
     }
@@ -125,5 +187,13 @@ int main(void)
         return 1;
     }
 
+    if (test_memset() != PASS) {
+        return 1;
+    }
+
+    if (test_memmove() != PASS) {
+        return 1;
+    }
+
     return 0;
 }